@@ -1,17 +1,39 @@
 #include "daemon.h"
+#include "health.h"
+#include "lease_registry.h"
+#include "metrics.h"
+#include "renewal_scheduler.h"
+#include "worker_pool.h"
 
+#include <atomic>
 #include <credentialsfetcher.grpc.pb.h>
 #include <fstream>
+#include <grpcpp/alarm.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <mutex>
+#include <poll.h>
 #include <random>
+#include <sstream>
 #include <sys/stat.h>
+#include <thread>
 
 
 #define LEASE_ID_LENGTH 10
 #define UNIX_SOCKET_NAME "credentials_fetcher.sock"
 #define INPUT_CREDENTIALS_LENGTH 256
+#define RPC_QUEUE_FULL_ERR_MSG "Error: too many requests in progress, retry later"
+#define RPC_SHUTTING_DOWN_ERR_MSG "Error: the daemon is shutting down"
+// gMSA tickets of one lease fetched at the same time
+#define MAX_PARALLEL_TICKETS_PER_LEASE 4
+// rpcs in progress when the daemon shuts down get this long to finish
+#define GRPC_SHUTDOWN_GRACE_SECONDS 2
+#define PROMETHEUS_METRIC_PREFIX "credentials_fetcher_"
+
+// upper bounds of the latency histogram buckets exported to prometheus, in seconds
+static const std::vector<double> prometheus_latency_bounds = {
+    0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
 
 static const std::vector<char> invalid_characters = {
     '&', '|', ';', '$', '*', '?', '<', '>', '!',' '};
@@ -38,7 +60,315 @@ bool contains_invalid_characters_in_credentials( const std::string& value )
     return result;
 }
 
-volatile sig_atomic_t* pthread_shutdown_signal = nullptr;
+// Runs the blocking part of the lease rpcs, owned by CredentialsFetcherImpl
+creds_fetcher::WorkerPool* rpc_worker_pool = nullptr;
+// Held when the worker pool is set, removed or used
+static std::mutex rpc_worker_pool_mutex;
+
+// Logger of the rpcs, set by RunGrpcServer
+static creds_fetcher::CF_logger* rpc_logger = nullptr;
+
+/**
+ * Trace the state of an rpc at debug level, it is skipped unless debug logs are enabled
+ * @param rpc_name - class handling the rpc
+ * @param call_data - rpc being handled
+ * @param status - state of the rpc
+ */
+static void log_rpc_state( const char* rpc_name, const void* call_data, int status )
+{
+    if ( rpc_logger != nullptr )
+    {
+        rpc_logger->logger( LOG_DEBUG, "%s %p status: %d", rpc_name, call_data, status );
+    }
+}
+
+/**
+ * Run the blocking part of an rpc in a worker, an exception fails the rpc instead of
+ * leaving it without a reply. The rpcs still queued when the server shuts down are
+ * not processed, the pool is joined once the rpcs already running are done.
+ * @param reply_status - status the rpc finishes with, INTERNAL if process throws and
+ *                       UNAVAILABLE if the server is shutting down
+ * @param process - Process of the rpc
+ */
+static void run_rpc_process( grpc::Status& reply_status, const std::function<void()>& process )
+{
+    {
+        // the pool is removed before it is stopped
+        std::lock_guard<std::mutex> lock( rpc_worker_pool_mutex );
+        if ( rpc_worker_pool == nullptr )
+        {
+            reply_status = grpc::Status( grpc::StatusCode::UNAVAILABLE,
+                                         RPC_SHUTTING_DOWN_ERR_MSG );
+            return;
+        }
+    }
+
+    std::string err_msg;
+    try
+    {
+        process();
+        return;
+    }
+    catch ( const std::exception& ex )
+    {
+        err_msg = ex.what();
+    }
+    catch ( ... )
+    {
+        err_msg = "unknown exception";
+    }
+
+    if ( rpc_logger != nullptr )
+    {
+        rpc_logger->logger( LOG_ERR, "ERROR: rpc failed with an exception: %s",
+                            err_msg.c_str() );
+    }
+    reply_status = grpc::Status( grpc::StatusCode::INTERNAL, "ERROR: " + err_msg );
+}
+
+/**
+ * Queue the blocking part of an rpc in the worker pool. The pool is used under the
+ * lock so that it cannot be removed by a shutdown in the meantime.
+ * @param task - work of the rpc
+ * @return - OK if queued, RESOURCE_EXHAUSTED if too many rpcs are queued, UNAVAILABLE
+ *           once the server is shutting down
+ */
+static grpc::Status submit_rpc_work( std::function<void()> task )
+{
+    std::lock_guard<std::mutex> lock( rpc_worker_pool_mutex );
+    if ( rpc_worker_pool == nullptr )
+    {
+        return grpc::Status( grpc::StatusCode::UNAVAILABLE, RPC_SHUTTING_DOWN_ERR_MSG );
+    }
+    if ( !rpc_worker_pool->submit( std::move( task ) ) )
+    {
+        creds_fetcher::Metrics::instance().increment( creds_fetcher::METRIC_RPC_REJECTED );
+        return grpc::Status( grpc::StatusCode::RESOURCE_EXHAUSTED, RPC_QUEUE_FULL_ERR_MSG );
+    }
+    return grpc::Status::OK;
+}
+
+/**
+ * Collect the state of the daemon, it is cheap enough to be done on every scrape
+ * @return - lease and ticket counts, queue depths, latencies and counters
+ */
+static creds_fetcher::daemon_metrics_t get_daemon_metrics()
+{
+    creds_fetcher::daemon_metrics_t metrics;
+    metrics.leases = lease_registry.size();
+
+    creds_fetcher::renewal_stats_t renewal_stats = krb_renewal_scheduler.stats();
+    metrics.tickets_scheduled = renewal_stats.scheduled;
+    metrics.tickets_renewing = renewal_stats.renewing;
+    metrics.tickets_retrying = renewal_stats.retrying;
+    metrics.renewal_backlog = renewal_stats.backlog;
+    metrics.next_renewal_time = renewal_stats.next_deadline;
+
+    {
+        std::lock_guard<std::mutex> lock( rpc_worker_pool_mutex );
+        if ( rpc_worker_pool != nullptr )
+        {
+            metrics.rpc_queue_depth = rpc_worker_pool->queue_depth();
+            metrics.rpc_active_workers = rpc_worker_pool->active_workers();
+        }
+    }
+
+    metrics.log_records_dropped = creds_fetcher::AsyncJournal::instance().dropped();
+    metrics.latencies = creds_fetcher::Metrics::instance().snapshot();
+    return metrics;
+}
+
+/**
+ * Render the metrics of the daemon in the prometheus text format. The latency
+ * histograms are exported with fixed bounds, a bucket of the daemon histogram that
+ * straddles a bound is counted in the next one.
+ * @return - metrics of the daemon, one sample per line
+ */
+std::string get_prometheus_metrics()
+{
+    creds_fetcher::daemon_metrics_t metrics = get_daemon_metrics();
+    std::ostringstream text;
+    text.precision( 12 );
+
+    auto header = [&text]( const std::string& name, const char* type, const char* help ) {
+        text << "# HELP " PROMETHEUS_METRIC_PREFIX << name << " " << help << "\n"
+             << "# TYPE " PROMETHEUS_METRIC_PREFIX << name << " " << type << "\n";
+    };
+    auto gauge = [&text, &header]( const char* name, const char* help, int64_t value ) {
+        header( name, "gauge", help );
+        text << PROMETHEUS_METRIC_PREFIX << name << " " << value << "\n";
+    };
+
+    gauge( "leases", "Number of leases", metrics.leases );
+    header( "tickets", "gauge", "Kerberos tickets by renewal state" );
+    text << PROMETHEUS_METRIC_PREFIX "tickets{state=\"scheduled\"} " << metrics.tickets_scheduled
+         << "\n"
+         << PROMETHEUS_METRIC_PREFIX "tickets{state=\"renewing\"} " << metrics.tickets_renewing
+         << "\n"
+         << PROMETHEUS_METRIC_PREFIX "tickets{state=\"retrying\"} " << metrics.tickets_retrying
+         << "\n";
+    gauge( "renewal_backlog", "Tickets due for renewal and not renewed yet",
+           metrics.renewal_backlog );
+    gauge( "next_renewal_timestamp_seconds", "Unix time of the next ticket renewal",
+           metrics.next_renewal_time );
+    gauge( "rpc_queue_depth", "Rpcs waiting for a worker", metrics.rpc_queue_depth );
+    gauge( "rpc_active_workers", "Rpcs being processed by a worker", metrics.rpc_active_workers );
+
+    header( "log_records_dropped_total", "counter", "Log records dropped by the rate limit" );
+    text << PROMETHEUS_METRIC_PREFIX "log_records_dropped_total " << metrics.log_records_dropped
+         << "\n";
+    for ( const auto& counter : metrics.latencies.counters )
+    {
+        header( counter.first + "_total", "counter", "Number of events" );
+        text << PROMETHEUS_METRIC_PREFIX << counter.first << "_total " << counter.second << "\n";
+    }
+
+    header( "stage_duration_seconds", "histogram",
+            "Latency of the stages of the ticket pipeline and of the rpcs" );
+    for ( const auto& stage : metrics.latencies.stages )
+    {
+        std::string labels = "stage=\"" + stage.name + "\"";
+        size_t bucket = 0;
+        uint64_t cumulative_count = 0;
+        for ( double bound : prometheus_latency_bounds )
+        {
+            for ( ; bucket < stage.buckets.size() &&
+                    stage.buckets[bucket].first <= (uint64_t)( bound * 1000000 );
+                  bucket++ )
+            {
+                cumulative_count += stage.buckets[bucket].second;
+            }
+            text << PROMETHEUS_METRIC_PREFIX "stage_duration_seconds_bucket{" << labels
+                 << ",le=\"" << bound << "\"} " << cumulative_count << "\n";
+        }
+        text << PROMETHEUS_METRIC_PREFIX "stage_duration_seconds_bucket{" << labels
+             << ",le=\"+Inf\"} " << stage.count << "\n"
+             << PROMETHEUS_METRIC_PREFIX "stage_duration_seconds_sum{" << labels << "} "
+             << stage.sum_micros / 1000000.0 << "\n"
+             << PROMETHEUS_METRIC_PREFIX "stage_duration_seconds_count{" << labels << "} "
+             << stage.count << "\n";
+    }
+
+    header( "stage_duration_quantile_seconds", "gauge",
+            "Latency quantiles of the stages since the daemon started" );
+    for ( const auto& stage : metrics.latencies.stages )
+    {
+        std::pair<const char*, uint64_t> quantiles[] = { { "0.5", stage.p50_micros },
+                                                         { "0.9", stage.p90_micros },
+                                                         { "0.99", stage.p99_micros },
+                                                         { "0.999", stage.p999_micros } };
+        for ( const auto& quantile : quantiles )
+        {
+            text << PROMETHEUS_METRIC_PREFIX "stage_duration_quantile_seconds{stage=\""
+                 << stage.name << "\",quantile=\"" << quantile.first << "\"} "
+                 << quantile.second / 1000000.0 << "\n";
+        }
+    }
+
+    header( "stage_errors_total", "counter", "Stages that returned an error" );
+    for ( const auto& stage : metrics.latencies.stages )
+    {
+        text << PROMETHEUS_METRIC_PREFIX "stage_errors_total{stage=\"" << stage.name << "\"} "
+             << stage.errors << "\n";
+    }
+
+    return text.str();
+}
+
+/**
+ * Create the kerberos tickets of the gMSA accounts of a lease, at most max_parallel
+ * tickets are fetched at the same time. The caller removes the lease directory if
+ * an error is returned.
+ * @param krb_tickets - tickets to create, owned by the lease, krb_file_path is changed
+ *                      to the ccache path
+ * @param domain_name - domain of the accounts, the domain of each ticket if empty
+ * @param host_tgt - machine or user TGT the ldap searches bind with
+ * @param max_parallel - number of tickets fetched at the same time
+ * @param cf_logger - log to systemd daemon
+ * @return - error message, empty if all the tickets were created
+ */
+static std::string create_gmsa_krb_tickets(
+    const std::vector<creds_fetcher::krb_ticket_info*>& krb_tickets,
+    const std::string& domain_name, const creds_fetcher::host_tgt_ref_t& host_tgt,
+    size_t max_parallel, creds_fetcher::CF_logger& cf_logger )
+{
+    std::vector<creds_fetcher::krb_ticket_info*> pending;
+    for ( auto krb_ticket : krb_tickets )
+    {
+        std::string krb_file_path = krb_ticket->krb_file_path;
+        if ( std::filesystem::exists( krb_file_path ) )
+        {
+            cf_logger.logger( LOG_ERR, "Directory already exists: %s", krb_file_path.c_str() );
+            return "ERROR: krb ticket directory already exists";
+        }
+        std::filesystem::create_directories( krb_file_path );
+
+        // the ccache file is created when the ticket is published
+        std::string krb_ccname_str = krb_file_path + "/krb5cc";
+
+        krb_ticket->krb_file_path = krb_ccname_str;
+        pending.push_back( krb_ticket );
+    }
+
+    std::atomic<size_t> next_ticket( 0 );
+    std::atomic<bool> failed( false );
+    auto fetch_tickets = [&]() {
+        size_t i;
+        while ( !failed && ( i = next_ticket++ ) < pending.size() )
+        {
+            creds_fetcher::krb_ticket_info* krb_ticket = pending[i];
+            std::pair<int, std::string> gmsa_ticket_result;
+            // an exception on a fetch thread would terminate the daemon
+            try
+            {
+                gmsa_ticket_result = get_gmsa_krb_ticket(
+                    domain_name.empty() ? krb_ticket->domain_name : domain_name,
+                    krb_ticket->service_account_name, krb_ticket->krb_file_path, host_tgt,
+                    cf_logger );
+            }
+            catch ( const std::exception& ex )
+            {
+                cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s: %s",
+                                  krb_ticket->service_account_name.c_str(), ex.what() );
+                failed = true;
+                return;
+            }
+            creds_fetcher::log_fields_t log_fields;
+            log_fields.account = krb_ticket->service_account_name;
+            log_fields.domain = domain_name.empty() ? krb_ticket->domain_name : domain_name;
+            if ( gmsa_ticket_result.first != 0 )
+            {
+                cf_logger.logger( LOG_ERR, log_fields,
+                                  "ERROR: Cannot get gMSA krb ticket using account %s",
+                                  krb_ticket->service_account_name.c_str() );
+                failed = true;
+                return;
+            }
+            cf_logger.logger( LOG_INFO, log_fields, "gMSA ticket is at %s",
+                              gmsa_ticket_result.second.c_str() );
+        }
+    };
+
+    // the calling thread fetches tickets too
+    std::vector<std::thread> fetch_threads;
+    size_t num_threads = std::min( std::max( max_parallel, (size_t)1 ), pending.size() );
+    for ( size_t i = 1; i < num_threads; i++ )
+    {
+        fetch_threads.emplace_back( fetch_tickets );
+    }
+    fetch_tickets();
+    for ( auto& fetch_thread : fetch_threads )
+    {
+        fetch_thread.join();
+    }
+
+    if ( failed )
+    {
+        return "ERROR: Cannot get gMSA krb ticket";
+    }
+
+    return "";
+}
 
 /**
  * gRPC code derived from
@@ -49,18 +379,53 @@ class CredentialsFetcherImpl final
   public:
     ~CredentialsFetcherImpl()
     {
-        server_->Shutdown();
-        // Always shutdown the completion queue after the server.
-        cq_->Shutdown();
+        Shutdown();
+    }
+
+    /**
+     * Shutdown - stop serving rpcs, the completion queue threads return once their
+     * queue is drained
+     */
+    void Shutdown()
+    {
+        if ( shut_down_ || server_ == nullptr )
+        {
+            return;
+        }
+        shut_down_ = true;
+        // the rpcs still running after the grace period are cancelled
+        server_->Shutdown( std::chrono::system_clock::now() +
+                           std::chrono::seconds( GRPC_SHUTDOWN_GRACE_SECONDS ) );
+        // Let the workers finish the rpcs they are running, they still post to the
+        // completion queues. The rpcs still queued in the pool and the ones drained by
+        // the completion queue threads from now on finish with UNAVAILABLE.
+        {
+            std::lock_guard<std::mutex> lock( rpc_worker_pool_mutex );
+            rpc_worker_pool = nullptr;
+        }
+        worker_pool_.reset();
+        // Always shutdown the completion queues after the server.
+        for ( auto& cq : cqs_ )
+        {
+            cq->Shutdown();
+        }
+        health_cq_->Shutdown();
     }
 
     /**
      * RunServer - Run one grpc server for all rpcs
      * @param unix_socket_dir: path to unix domain socket
      * @param cf_logger : log to systemd
+     * @param num_completion_queues : number of completion queues, each one is
+     *                                drained by its own thread
+     * @param num_rpc_workers : number of threads doing the kerberos/ldap work of the rpcs
+     * @param max_queued_rpcs : rpcs waiting for a worker, further rpcs are rejected
+     * @param shutdown_fd : readable when the daemon shuts down
      */
     void RunServer( std::string unix_socket_dir, std::string krb_files_dir,
-                    creds_fetcher::CF_logger& cf_logger, std::string aws_sm_secret_name )
+                    creds_fetcher::CF_logger& cf_logger, std::string aws_sm_secret_name,
+                    int num_completion_queues, int num_rpc_workers, int max_queued_rpcs,
+                    int shutdown_fd )
     {
         std::string unix_socket_address =
             std::string( "unix:" ) + unix_socket_dir + "/" + std::string( UNIX_SOCKET_NAME );
@@ -72,15 +437,61 @@ class CredentialsFetcherImpl final
         // Register "service_" as the instance through which we'll communicate with
         // clients. In this case it corresponds to an *asynchronous* service.
         builder.RegisterService( &service_ );
-        // Get hold of the completion queue used for the asynchronous communication
-        // with the gRPC runtime.
-        cq_ = builder.AddCompletionQueue();
+        // Get hold of the completion queues used for the asynchronous communication
+        // with the gRPC runtime, a slow rpc only holds up the queue it was served from.
+        if ( num_completion_queues <= 0 )
+        {
+            num_completion_queues = DEFAULT_GRPC_COMPLETION_QUEUES;
+        }
+        for ( int i = 0; i < num_completion_queues; i++ )
+        {
+            cqs_.emplace_back( builder.AddCompletionQueue() );
+        }
+        health_cq_ = builder.AddCompletionQueue();
+        // The completion queue threads only accept rpcs and hand them off to the
+        // workers, this bounds the number of concurrent KDC/LDAP operations.
+        if ( num_rpc_workers <= 0 )
+        {
+            num_rpc_workers = DEFAULT_RPC_WORKERS;
+        }
+        if ( max_queued_rpcs <= 0 )
+        {
+            max_queued_rpcs = DEFAULT_RPC_MAX_QUEUED;
+        }
+        worker_pool_.reset( new creds_fetcher::WorkerPool( num_rpc_workers, max_queued_rpcs ) );
+        {
+            std::lock_guard<std::mutex> lock( rpc_worker_pool_mutex );
+            rpc_worker_pool = worker_pool_.get();
+        }
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
-        std::cout << "Server listening on " << server_address << std::endl;
+        std::cout << "Server listening on " << server_address << " with " << cqs_.size()
+                  << " completion queues" << std::endl;
 
-        // Proceed to the server's main loop.
-        HandleRpcs( krb_files_dir, cf_logger, aws_sm_secret_name );
+        // Proceed to the server's main loop, one thread per completion queue.
+        std::vector<std::thread> cq_threads;
+        for ( size_t i = 0; i < cqs_.size(); i++ )
+        {
+            grpc::ServerCompletionQueue* cq = cqs_[i].get();
+            cq_threads.emplace_back( [this, cq, krb_files_dir, &cf_logger, aws_sm_secret_name]()
+                                     { HandleRpcs( cq, krb_files_dir, cf_logger,
+                                                   aws_sm_secret_name ); } );
+        }
+        std::thread health_cq_thread( [this]() { HandleHealthRpcs( health_cq_.get() ); } );
+
+        // The completion queue threads block in Next, this thread waits for the
+        // daemon to shut down and then shuts down the queues to release them.
+        struct pollfd shutdown_pollfd = { shutdown_fd, POLLIN, 0 };
+        while ( poll( &shutdown_pollfd, 1, -1 ) < 0 && errno == EINTR )
+        {
+        }
+        Shutdown();
+
+        for ( auto& cq_thread : cq_threads )
+        {
+            cq_thread.join();
+        }
+        health_cq_thread.join();
     }
 
   private:
@@ -101,19 +512,20 @@ class CredentialsFetcherImpl final
                 , cq_( cq )
                 , health_check_responder_( &health_check_ctx_ )
                 , status_( CREATE )
+                , rpc_timer_( creds_fetcher::METRIC_RPC_HEALTH_CHECK, false )
         {
             cookie = CLASS_NAME_CallDataHealthCheck;
             // Invoke the serving logic right away.
             Proceed();
         }
 
-        void Proceed(creds_fetcher::CF_logger& cf_logger)
+        void Proceed()
         {
             if ( cookie.compare( CLASS_NAME_CallDataHealthCheck ) != 0 )
             {
                 return;
             }
-            printf( "CallDataHealthCheck %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataHealthCheck", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -134,12 +546,18 @@ class CredentialsFetcherImpl final
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
                 new CallDataHealthCheck( service_, cq_ );
+                rpc_timer_.start();
 
-                // The actual processing.
-                health_check_reply_.set_status( "OK" );
+                // The health is refreshed by the main loop, the rpc only copies the
+                // last snapshot.
+                SetReply( *creds_fetcher::HealthMonitor::instance().snapshot() );
+
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
                 status_ = FINISH;
+                rpc_timer_.stop( true );
                 health_check_responder_.Finish( health_check_reply_, grpc::Status::OK, this );
-
             }
             else
             {
@@ -150,42 +568,124 @@ class CredentialsFetcherImpl final
 
             return;
         }
+
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataHealthCheck (cancelled)", this, status_ );
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
+
+    private:
+        void SetReply( const creds_fetcher::health_snapshot_t& health )
+        {
+            health_check_reply_.set_status( health.status );
+            health_check_reply_.set_renewal_thread_alive( health.renewal_thread_alive );
+            health_check_reply_.set_renewal_heartbeat_time( health.renewal_heartbeat );
+            health_check_reply_.set_renewal_backlog( health.renewal_backlog );
+            health_check_reply_.set_oldest_overdue_renewal_time(
+                health.oldest_overdue_deadline );
+            for ( const auto& domain : health.domain_controllers )
+            {
+                credentialsfetcher::DomainControllerHealth* domain_health =
+                    health_check_reply_.add_domain_controllers();
+                domain_health->set_domain( domain.domain );
+                domain_health->set_reachable( domain.reachable );
+                domain_health->set_last_checked_time( domain.last_checked );
+                domain_health->set_error( domain.error );
+            }
+            health_check_reply_.set_last_kdc_error( health.last_kdc_error );
+            health_check_reply_.set_last_kdc_error_time( health.last_kdc_error_time );
+            health_check_reply_.set_updated_time( health.updated );
+        }
+
+        // The means of communication with the gRPC runtime for an asynchronous
+        // server.
+        credentialsfetcher::CredentialsFetcherService::AsyncService* service_;
+        // The producer-consumer queue where for asynchronous server notifications.
+        grpc::ServerCompletionQueue* cq_;
+        // Context for the rpc, allowing to tweak aspects of it such as the use
+        // of compression, authentication, as well as to send metadata back to the
+        // client.
+        grpc::ServerContext health_check_ctx_;
+
+        // What we get from the client.
+        credentialsfetcher::HealthCheckRequest health_check_request_;
+        // What we send back to the client.
+        credentialsfetcher::HealthCheckResponse health_check_reply_;
+
+        // The means to get back to the client.
+        grpc::ServerAsyncResponseWriter<credentialsfetcher::HealthCheckResponse>
+                health_check_responder_;
+
+        // Let's implement a tiny state machine with the following states.
+        enum CallStatus
+        {
+            CREATE,
+            PROCESS,
+            FINISH
+        };
+        CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
+    };
+
+    // Class encompasing the state and logic needed to serve a request.
+    class CallDataGetMetrics
+    {
+      public:
+        std::string cookie;
+#define CLASS_NAME_CallDataGetMetrics "CallDataGetMetrics"
+        // Take in the "service" instance (in this case representing an asynchronous
+        // server) and the completion queue "cq" used for asynchronous communication
+        // with the gRPC runtime.
+        CallDataGetMetrics( credentialsfetcher::CredentialsFetcherService::AsyncService* service,
+                            grpc::ServerCompletionQueue* cq )
+            : service_( service )
+            , cq_( cq )
+            , get_metrics_responder_( &get_metrics_ctx_ )
+            , status_( CREATE )
+            , rpc_timer_( creds_fetcher::METRIC_RPC_GET_METRICS, false )
+        {
+            cookie = CLASS_NAME_CallDataGetMetrics;
+            // Invoke the serving logic right away.
+            Proceed();
+        }
+
         void Proceed()
         {
-            if ( cookie.compare( CLASS_NAME_CallDataHealthCheck ) != 0 )
+            if ( cookie.compare( CLASS_NAME_CallDataGetMetrics ) != 0 )
             {
                 return;
             }
-            printf( "CallHealthCheck %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataGetMetrics", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
                 status_ = PROCESS;
 
-                // As part of the initial CREATE state, we *request* that the system
-                // start processing RequestHealthCheck requests. In this request, "this" acts
-                // are the tag uniquely identifying the request (so that different CallData
-                // instances can serve different requests concurrently), in this case
-                // the memory address of this CallData instance.
-
-                service_->RequestHealthCheck( &health_check_ctx_, &health_check_request_,
-                                                      &health_check_responder_, cq_, cq_, this );
+                service_->RequestGetMetrics( &get_metrics_ctx_, &get_metrics_request_,
+                                             &get_metrics_responder_, cq_, cq_, this );
             }
             else if ( status_ == PROCESS )
             {
                 // Spawn a new CallData instance to serve new clients while we process
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
-                new CallDataHealthCheck( service_, cq_ );
+                new CallDataGetMetrics( service_, cq_ );
+                rpc_timer_.start();
 
-                // The actual processing.
-                health_check_reply_.set_status( "OK" );
+                // The metrics are only read from memory, they are collected on the
+                // completion queue thread.
+                SetReply( get_daemon_metrics() );
 
-                // And we are done! Let the gRPC runtime know we've finished, using the
-                // memory address of this instance as the uniquely identifying tag for
-                // the event.
                 status_ = FINISH;
-                health_check_responder_.Finish( health_check_reply_, grpc::Status::OK, this );
+                rpc_timer_.stop( true );
+                get_metrics_responder_.Finish( get_metrics_reply_, grpc::Status::OK, this );
             }
             else
             {
@@ -197,7 +697,58 @@ class CredentialsFetcherImpl final
             return;
         }
 
-    private:
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataGetMetrics (cancelled)", this, status_ );
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
+
+      private:
+        void SetReply( const creds_fetcher::daemon_metrics_t& metrics )
+        {
+            get_metrics_reply_.set_leases( metrics.leases );
+            get_metrics_reply_.set_tickets_scheduled( metrics.tickets_scheduled );
+            get_metrics_reply_.set_tickets_renewing( metrics.tickets_renewing );
+            get_metrics_reply_.set_tickets_retrying( metrics.tickets_retrying );
+            get_metrics_reply_.set_renewal_backlog( metrics.renewal_backlog );
+            get_metrics_reply_.set_next_renewal_time( metrics.next_renewal_time );
+            get_metrics_reply_.set_rpc_queue_depth( metrics.rpc_queue_depth );
+            get_metrics_reply_.set_rpc_active_workers( metrics.rpc_active_workers );
+            get_metrics_reply_.set_log_records_dropped( metrics.log_records_dropped );
+            for ( const auto& stage : metrics.latencies.stages )
+            {
+                credentialsfetcher::StageLatency* stage_latency = get_metrics_reply_.add_stages();
+                stage_latency->set_name( stage.name );
+                stage_latency->set_count( stage.count );
+                stage_latency->set_errors( stage.errors );
+                stage_latency->set_sum_micros( stage.sum_micros );
+                stage_latency->set_max_micros( stage.max_micros );
+                stage_latency->set_p50_micros( stage.p50_micros );
+                stage_latency->set_p90_micros( stage.p90_micros );
+                stage_latency->set_p99_micros( stage.p99_micros );
+                stage_latency->set_p999_micros( stage.p999_micros );
+                for ( const auto& bucket : stage.buckets )
+                {
+                    credentialsfetcher::LatencyBucket* latency_bucket =
+                        stage_latency->add_buckets();
+                    latency_bucket->set_upper_bound_micros( bucket.first );
+                    latency_bucket->set_count( bucket.second );
+                }
+            }
+            for ( const auto& counter : metrics.latencies.counters )
+            {
+                credentialsfetcher::MetricCounter* metric_counter =
+                    get_metrics_reply_.add_counters();
+                metric_counter->set_name( counter.first );
+                metric_counter->set_value( counter.second );
+            }
+        }
+
         // The means of communication with the gRPC runtime for an asynchronous
         // server.
         credentialsfetcher::CredentialsFetcherService::AsyncService* service_;
@@ -206,16 +757,16 @@ class CredentialsFetcherImpl final
         // Context for the rpc, allowing to tweak aspects of it such as the use
         // of compression, authentication, as well as to send metadata back to the
         // client.
-        grpc::ServerContext health_check_ctx_;
+        grpc::ServerContext get_metrics_ctx_;
 
         // What we get from the client.
-        credentialsfetcher::HealthCheckRequest health_check_request_;
+        credentialsfetcher::GetMetricsRequest get_metrics_request_;
         // What we send back to the client.
-        credentialsfetcher::HealthCheckResponse health_check_reply_;
+        credentialsfetcher::GetMetricsResponse get_metrics_reply_;
 
         // The means to get back to the client.
-        grpc::ServerAsyncResponseWriter<credentialsfetcher::HealthCheckResponse>
-                health_check_responder_;
+        grpc::ServerAsyncResponseWriter<credentialsfetcher::GetMetricsResponse>
+            get_metrics_responder_;
 
         // Let's implement a tiny state machine with the following states.
         enum CallStatus
@@ -225,6 +776,8 @@ class CredentialsFetcherImpl final
             FINISH
         };
         CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
     };
 
     // Class encompasing the state and logic needed to serve a request.
@@ -243,6 +796,7 @@ class CredentialsFetcherImpl final
             , cq_( cq )
             , create_krb_responder_( &add_krb_ctx_ )
             , status_( CREATE )
+            , rpc_timer_( creds_fetcher::METRIC_RPC_ADD_KERBEROS_LEASE, false )
         {
             cookie = CLASS_NAME_CallDataCreateKerberosLease;
             // Invoke the serving logic right away.
@@ -257,7 +811,7 @@ class CredentialsFetcherImpl final
                 return;
             }
 
-            printf( "CallDataCreateKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataCreateKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -278,140 +832,175 @@ class CredentialsFetcherImpl final
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
                 new CallDataCreateKerberosLease( service_, cq_ );
-                // The actual processing.
-                std::string lease_id = generate_lease_id();
-                std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list;
-                std::unordered_set<std::string> krb_ticket_dirs;
+                rpc_timer_.start();
+                // The actual processing is done in the worker pool, this completion
+                // queue thread resumes this instance once the alarm set by the worker
+                // fires.
+                status_ = COMPLETE;
+                grpc::Status submit_status = submit_rpc_work(
+                    [this, krb_files_dir, &cf_logger, aws_sm_secret_name]()
+                    {
+                        run_rpc_process( reply_status_, [&]() {
+                            Process( krb_files_dir, cf_logger, aws_sm_secret_name );
+                        } );
+                        // always resume the rpc, it would never be finished otherwise
+                        alarm_.Set( cq_, gpr_now( GPR_CLOCK_MONOTONIC ), this );
+                    }  );
+                if ( !submit_status.ok() )
+                {
+                    status_ = FINISH;
+                    rpc_timer_.stop( false );
+                    create_krb_responder_.Finish( create_krb_reply_, submit_status, this );
+                }
+            }
+            else if ( status_ == COMPLETE )
+            {
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                create_krb_responder_.Finish( create_krb_reply_, reply_status_, this );
+            }
+            else
+            {
+                GPR_ASSERT( status_ == FINISH );
+                // Once in the FINISH state, deallocate ourselves (CallData).
+                delete this;
+            }
 
-                std::string err_msg;
-                create_krb_reply_.set_lease_id( lease_id );
-                for ( int i = 0; i < create_krb_request_.credspec_contents_size(); i++ )
+            return;
+        }
+
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataCreateKerberosLease (cancelled)", this, status_ );
+            if ( status_ == COMPLETE )
+            {
+                // the worker is done, the rpc is still finished with its reply
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                create_krb_responder_.Finish( create_krb_reply_, reply_status_, this );
+                return;
+            }
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
+
+        /**
+         * Process - the blocking part of the rpc, run in the worker pool
+         */
+        void Process( std::string krb_files_dir, creds_fetcher::CF_logger& cf_logger,
+                      std::string aws_sm_secret_name )
+        {
+            std::string lease_id = generate_lease_id();
+            std::vector<creds_fetcher::krb_ticket_info> krb_ticket_info_list;
+            std::unordered_set<std::string> krb_ticket_dirs;
+
+            std::string err_msg;
+            create_krb_reply_.set_lease_id( lease_id );
+            krb_ticket_info_list.reserve( create_krb_request_.credspec_contents_size() );
+            for ( int i = 0; i < create_krb_request_.credspec_contents_size(); i++ )
+            {
+                creds_fetcher::krb_ticket_info krb_ticket_info;
+                int parse_result = parse_cred_spec( create_krb_request_.credspec_contents( i ),
+                                                    krb_ticket_info );
+
+                // only add the ticket info if the parsing is successful
+                if ( parse_result == 0 )
                 {
-                    creds_fetcher::krb_ticket_info* krb_ticket_info =
-                        new creds_fetcher::krb_ticket_info;
-                    int parse_result = parse_cred_spec( create_krb_request_.credspec_contents( i ),
-                                                        krb_ticket_info );
+                    std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
+                                                 krb_ticket_info.service_account_name;
+                    krb_ticket_info.krb_file_path = krb_files_path;
+                    krb_ticket_info.domainless_user = "";
 
-                    // only add the ticket info if the parsing is successful
-                    if ( parse_result == 0 )
+                    // handle duplicate service accounts
+                    if ( !krb_ticket_dirs.count( krb_files_path ) )
                     {
-                        std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
-                                                     krb_ticket_info->service_account_name;
-                        krb_ticket_info->krb_file_path = krb_files_path;
-                        krb_ticket_info->domainless_user = "";
+                        krb_ticket_dirs.insert( krb_files_path );
+                        krb_ticket_info_list.push_back( std::move( krb_ticket_info ) );
+                    }
+                }
+                else
+                {
+                    err_msg = "Error: credential spec provided is not properly formatted";
+                    break;
+                }
+            }
+            if ( err_msg.empty() )
+            {
+                // the host credential is acquired once per domain, then the gMSA tickets
+                // of the domain are fetched in parallel, the tickets stay in the lease
+                std::map<std::string, std::vector<creds_fetcher::krb_ticket_info*>>
+                    krb_tickets_by_domain;
+                for ( auto& krb_ticket : krb_ticket_info_list )
+                {
+                    krb_tickets_by_domain[krb_ticket.domain_name].push_back( &krb_ticket );
+                }
 
-                        // handle duplicate service accounts
-                        if ( !krb_ticket_dirs.count( krb_files_path ) )
+                for ( auto& domain_krb_tickets : krb_tickets_by_domain )
+                {
+                    const std::string& domain_name = domain_krb_tickets.first;
+                    // invoke to get machine ticket
+                    int status = 0;
+                    creds_fetcher::host_tgt_ref_t host_tgt;
+                    if ( aws_sm_secret_name.length() != 0 )
+                    {
+                        status = get_user_krb_ticket( domain_name, aws_sm_secret_name, host_tgt,
+                                                      cf_logger );
+                        for ( auto krb_ticket : domain_krb_tickets.second )
                         {
-                            krb_ticket_dirs.insert( krb_files_path );
-                            krb_ticket_info_list.push_back( krb_ticket_info );
+                            krb_ticket->domainless_user =
+                                "awsdomainlessusersecret:" + aws_sm_secret_name;
                         }
                     }
                     else
                     {
-                        err_msg = "Error: credential spec provided is not properly formatted";
-                        break;
+                        status = get_machine_krb_ticket( domain_name, host_tgt, cf_logger );
                     }
-                }
-                if ( err_msg.empty() )
-                {
-                    // create the kerberos tickets for the service accounts
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    if ( status < 0 )
                     {
-                        // invoke to get machine ticket
-                        int status = 0;
-                        if ( aws_sm_secret_name.length() != 0 )
-                        {
-                            status = get_user_krb_ticket( krb_ticket->domain_name,
-                                                          aws_sm_secret_name, cf_logger );
-                            krb_ticket->domainless_user =
-                                "awsdomainlessusersecret:"+aws_sm_secret_name;
-                        }
-                        else
-                        {
-                            status = get_machine_krb_ticket( krb_ticket->domain_name, cf_logger );
-                        }
-                        if ( status < 0 )
-                        {
-                            cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket",
-                                              status );
-                            err_msg = "ERROR: cannot get machine krb ticket";
-                            break;
-                        }
-
-                        std::string krb_file_path = krb_ticket->krb_file_path;
-                        if ( std::filesystem::exists( krb_file_path ) )
-                        {
-                            cf_logger.logger( LOG_INFO,
-                                              "Directory already exists: "
-                                              "%s",
-+                                              krb_file_path.c_str() );
-                            break;
-                        }
-                        std::filesystem::create_directories( krb_file_path );
-
-                        std::string krb_ccname_str = krb_ticket->krb_file_path + "/krb5cc";
-
-                        if ( !std::filesystem::exists( krb_ccname_str ) )
-                        {
-                            std::ofstream file( krb_ccname_str );
-                            file.close();
-
-                            krb_ticket->krb_file_path = krb_ccname_str;
-                        }
-
-                        std::pair<int, std::string> gmsa_ticket_result = get_gmsa_krb_ticket(
-                            krb_ticket->domain_name, krb_ticket->service_account_name,
-                            krb_ccname_str, cf_logger );
-                        if ( gmsa_ticket_result.first != 0 )
-                        {
-                            err_msg = "ERROR: Cannot get gMSA krb ticket";
-                            std::cout << err_msg << std::endl;
-                            cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket",
-                                              status );
-                            break;
-                        }
-                        else
-                        {
-                            cf_logger.logger( LOG_INFO, "gMSA ticket is at %s",
-                                              gmsa_ticket_result.second.c_str() );
-                            std::cout << "gMSA ticket is at " << gmsa_ticket_result.second
-                                      << std::endl;
-                        }
-                        create_krb_reply_.add_created_kerberos_file_paths( krb_file_path );
+                        cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket",
+                                          status );
+                        err_msg = "ERROR: cannot get machine krb ticket";
+                        break;
                     }
-                }
-                // And we are done! Let the gRPC runtime know we've finished, using the
-                // memory address of this instance as the uniquely identifying tag for
-                // the event.
-                if ( !err_msg.empty() )
-                {
-                    // remove the directories on failure
-                    for ( auto krb_ticket : krb_ticket_info_list )
+
+                    err_msg = create_gmsa_krb_tickets( domain_krb_tickets.second, "", host_tgt,
+                                                       MAX_PARALLEL_TICKETS_PER_LEASE,
+                                                       cf_logger );
+                    if ( !err_msg.empty() )
                     {
-                        std::filesystem::remove_all( krb_ticket->krb_file_path );
+                        break;
                     }
-                    status_ = FINISH;
-                    create_krb_responder_.Finish(
-                        create_krb_reply_, grpc::Status( grpc::StatusCode::INTERNAL, err_msg ),
-                        this );
-                }
-                else
-                {
-                    // write the ticket information to meta data file
-                    write_meta_data_json( krb_ticket_info_list, lease_id, krb_files_dir );
-                    status_ = FINISH;
-                    create_krb_responder_.Finish( create_krb_reply_, grpc::Status::OK, this );
                 }
             }
+            if ( !err_msg.empty() )
+            {
+                // all or nothing, remove the tickets created so far
+                std::filesystem::remove_all( krb_files_dir + "/" + lease_id );
+                reply_status_ = grpc::Status( grpc::StatusCode::INTERNAL, err_msg );
+            }
             else
             {
-                GPR_ASSERT( status_ == FINISH );
-                // Once in the FINISH state, deallocate ourselves (CallData).
-                delete this;
+                for ( const auto& krb_ticket : krb_ticket_info_list )
+                {
+                    std::filesystem::path krb_ccname( krb_ticket.krb_file_path );
+                    create_krb_reply_.add_created_kerberos_file_paths(
+                        krb_ccname.parent_path().string() );
+                }
+                for ( const auto& krb_ticket : krb_ticket_info_list )
+                {
+                    schedule_krb_ticket_renewal( krb_ticket );
+                }
+                // the lease is logged to the lease journal
+                lease_registry.add_lease( lease_id, std::move( krb_ticket_info_list ) );
+                reply_status_ = grpc::Status::OK;
             }
-
-            return;
         }
 
         void Proceed()
@@ -420,7 +1009,7 @@ class CredentialsFetcherImpl final
             {
                 return;
             }
-            printf( "CallDataCreateKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataCreateKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -480,14 +1069,22 @@ class CredentialsFetcherImpl final
         grpc::ServerAsyncResponseWriter<credentialsfetcher::CreateKerberosLeaseResponse>
             create_krb_responder_;
 
+        // Status of the rpc, set by the worker that processed it.
+        grpc::Status reply_status_;
+        // Brings this instance back to its completion queue once processed.
+        grpc::Alarm alarm_;
+
         // Let's implement a tiny state machine with the following states.
         enum CallStatus
         {
             CREATE,
             PROCESS,
+            COMPLETE,
             FINISH
         };
         CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
     };
 
     // Class encompasing the state and logic needed to serve a request.
@@ -507,6 +1104,7 @@ class CredentialsFetcherImpl final
             , cq_( cq )
             , handle_krb_responder_( &add_krb_ctx_ )
             , status_( CREATE )
+            , rpc_timer_( creds_fetcher::METRIC_RPC_ADD_NON_DOMAIN_JOINED_KERBEROS_LEASE, false )
         {
             cookie = CLASS_NAME_CallDataAddNonDomainJoinedKerberosLease;
             // Invoke the serving logic right away.
@@ -521,7 +1119,7 @@ class CredentialsFetcherImpl final
                 return;
             }
 
-            printf( "AddNonDomainJoinedKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataAddNonDomainJoinedKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -543,166 +1141,172 @@ class CredentialsFetcherImpl final
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
                 new CallDataAddNonDomainJoinedKerberosLease(service_, cq_ );
-                // The actual processing.
-                std::string lease_id = generate_lease_id();
-                std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list;
-                std::unordered_set<std::string> krb_ticket_dirs;
-                std::string username = create_domainless_krb_request_.username();
-                std::string password = create_domainless_krb_request_.password();
-                std::string domain = create_domainless_krb_request_.domain();
-
-                std::string err_msg;
-                if(!contains_invalid_characters_in_credentials(domain))
-                {
-                    if ( !username.empty() && !password.empty() && !domain.empty() && username.length() < INPUT_CREDENTIALS_LENGTH && password.length() <
-                                                                                                                                          INPUT_CREDENTIALS_LENGTH )
-                    {
-                        create_domainless_krb_reply_.set_lease_id( lease_id );
-                        for ( int i = 0;
-                              i < create_domainless_krb_request_.credspec_contents_size(); i++ )
-                        {
-                            creds_fetcher::krb_ticket_info* krb_ticket_info =
-                                new creds_fetcher::krb_ticket_info;
-                            int parse_result = parse_cred_spec(
-                                create_domainless_krb_request_.credspec_contents( i ),
-                                krb_ticket_info );
-
-                            // only add the ticket info if the parsing is successful
-                            if ( parse_result == 0 )
-                            {
-                                std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
-                                                             krb_ticket_info->service_account_name;
-                                krb_ticket_info->krb_file_path = krb_files_path;
-                                krb_ticket_info->domainless_user = username;
-
-                                // handle duplicate service accounts
-                                if ( !krb_ticket_dirs.count( krb_files_path ) )
-                                {
-                                    krb_ticket_dirs.insert( krb_files_path );
-                                    krb_ticket_info_list.push_back( krb_ticket_info );
-                                }
-                            }
-                            else
-                            {
-                                err_msg = "Error: credential spec provided is not properly "
-                                          "formatted";
-                                break;
-                            }
-                        }
-                    }
-                    else
+                rpc_timer_.start();
+                // The actual processing is done in the worker pool, this completion
+                // queue thread resumes this instance once the alarm set by the worker
+                // fires.
+                status_ = COMPLETE;
+                grpc::Status submit_status = submit_rpc_work(
+                    [this, krb_files_dir, &cf_logger, aws_sm_secret_name]()
                     {
-                        err_msg = "Error: domainless AD user credentials is not valid/ "
-                                  "credentials should not be more than 256 charaters";
-                    }
-                }
-                else
+                        run_rpc_process( reply_status_, [&]() {
+                            Process( krb_files_dir, cf_logger, aws_sm_secret_name );
+                        } );
+                        // always resume the rpc, it would never be finished otherwise
+                        alarm_.Set( cq_, gpr_now( GPR_CLOCK_MONOTONIC ), this );
+                    }  );
+                if ( !submit_status.ok() )
                 {
-                   err_msg = "Error: invalid domainName";
+                    status_ = FINISH;
+                    rpc_timer_.stop( false );
+                    handle_krb_responder_.Finish( create_domainless_krb_reply_, submit_status, this );
                 }
-                if ( err_msg.empty() )
-                {
-                    // create the kerberos tickets for the service accounts
-                    for ( auto krb_ticket : krb_ticket_info_list )
-                    {
-                        // invoke to get machine ticket
-                        int status = 0;
-                        if ( username.empty()  ||  password.empty() )
-                        {
-                            cf_logger.logger( LOG_ERR, "Invalid credentials for "
-                                                       "domainless user ", username.c_str());
-                            err_msg = "ERROR: Invalid credentials for mainless user";
-                            break;
-                        }
-                        status = get_domainless_user_krb_ticket( domain,
-                                                                 username, password,
-                                                                     cf_logger );
-                        if ( status < 0 )
-                        {
-                            cf_logger.logger( LOG_ERR, "Error %d: cannot domainless user kerberos tickets",
-                                              status );
-                            err_msg = "ERROR: cannot domainless user kerberos tickets";
-                            break;
-                        }
-
-                        std::string krb_file_path = krb_ticket->krb_file_path;
-                        if ( std::filesystem::exists( krb_file_path ) )
-                        {
-                            cf_logger.logger( LOG_INFO,
-                                              "Directory already exists: "
-                                              "%s",
-                                              krb_file_path.c_str() );
-                            break;
-                        }
-                        std::filesystem::create_directories( krb_file_path );
+            }
+            else if ( status_ == COMPLETE )
+            {
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                handle_krb_responder_.Finish( create_domainless_krb_reply_, reply_status_, this );
+            }
+            else
+            {
+                GPR_ASSERT( status_ == FINISH );
+                // Once in the FINISH state, deallocate ourselves (CallData).
+                delete this;
+            }
 
-                        std::string krb_ccname_str = krb_ticket->krb_file_path + "/krb5cc";
+            return;
+        }
 
-                        if ( !std::filesystem::exists( krb_ccname_str ) )
-                        {
-                            std::ofstream file( krb_ccname_str );
-                            file.close();
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataAddNonDomainJoinedKerberosLease (cancelled)", this, status_ );
+            if ( status_ == COMPLETE )
+            {
+                // the worker is done, the rpc is still finished with its reply
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                handle_krb_responder_.Finish( create_domainless_krb_reply_, reply_status_, this );
+                return;
+            }
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
 
-                            krb_ticket->krb_file_path = krb_ccname_str;
-                        }
+        /**
+         * Process - the blocking part of the rpc, run in the worker pool
+         */
+        void Process( std::string krb_files_dir, creds_fetcher::CF_logger& cf_logger,
+                      std::string aws_sm_secret_name )
+        {
+            std::string lease_id = generate_lease_id();
+            std::vector<creds_fetcher::krb_ticket_info> krb_ticket_info_list;
+            std::unordered_set<std::string> krb_ticket_dirs;
+            std::string username = create_domainless_krb_request_.username();
+            std::string password = create_domainless_krb_request_.password();
+            std::string domain = create_domainless_krb_request_.domain();
+
+            std::string err_msg;
+            if(!contains_invalid_characters_in_credentials(domain))
+            {
+                if ( !username.empty() && !password.empty() && !domain.empty() && username.length() < INPUT_CREDENTIALS_LENGTH && password.length() <
+                                                                                                                                      INPUT_CREDENTIALS_LENGTH )
+                {
+                    create_domainless_krb_reply_.set_lease_id( lease_id );
+                    for ( int i = 0;
+                          i < create_domainless_krb_request_.credspec_contents_size(); i++ )
+                    {
+                        creds_fetcher::krb_ticket_info krb_ticket_info;
+                        int parse_result = parse_cred_spec(
+                            create_domainless_krb_request_.credspec_contents( i ),
+                            krb_ticket_info );
 
-                        std::pair<int, std::string> gmsa_ticket_result = get_gmsa_krb_ticket(
-                            domain, krb_ticket->service_account_name,
-                            krb_ccname_str, cf_logger );
-                        if ( gmsa_ticket_result.first != 0 )
+                        // only add the ticket info if the parsing is successful
+                        if ( parse_result == 0 )
                         {
-                            err_msg = "ERROR: Cannot get gMSA krb ticket";
-                            std::cout << err_msg << std::endl;
-                            cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket",
-                                              status );
-                            break;
+                            std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
+                                                         krb_ticket_info.service_account_name;
+                            krb_ticket_info.krb_file_path = krb_files_path;
+                            krb_ticket_info.domainless_user = username;
+
+                            // handle duplicate service accounts
+                            if ( !krb_ticket_dirs.count( krb_files_path ) )
+                            {
+                                krb_ticket_dirs.insert( krb_files_path );
+                                krb_ticket_info_list.push_back( std::move( krb_ticket_info ) );
+                            }
                         }
                         else
                         {
-                            cf_logger.logger( LOG_INFO, "gMSA ticket is at %s",
-                                              gmsa_ticket_result.second.c_str() );
-                            std::cout << "gMSA ticket is at " << gmsa_ticket_result.second
-                                      << std::endl;
+                            err_msg = "Error: credential spec provided is not properly "
+                                      "formatted";
+                            break;
                         }
-                        create_domainless_krb_reply_.add_created_kerberos_file_paths( krb_file_path );
                     }
                 }
-                // And we are done! Let the gRPC runtime know we've finished, using the
-                // memory address of this instance as the uniquely identifying tag for
-                // the event.
-                if ( !err_msg.empty() )
+                else
                 {
-                    username = "xxxx";
-                    password = "xxxx";
-                    // remove the directories on failure
-                    for ( auto krb_ticket : krb_ticket_info_list )
-                    {
-                        std::filesystem::remove_all( krb_ticket->krb_file_path );
-                    }
-                    status_ = FINISH;
-                    handle_krb_responder_.Finish(
-                        create_domainless_krb_reply_, grpc::Status( grpc::StatusCode::INTERNAL, err_msg ),
-                        this );
+                    err_msg = "Error: domainless AD user credentials is not valid/ "
+                              "credentials should not be more than 256 charaters";
+                }
+            }
+            else
+            {
+               err_msg = "Error: invalid domainName";
+            }
+            if ( err_msg.empty() && !krb_ticket_info_list.empty() )
+            {
+                // get the domainless user ticket once, then the gMSA tickets in parallel
+                creds_fetcher::host_tgt_ref_t host_tgt;
+                int status = get_domainless_user_krb_ticket( domain, username, password,
+                                                             host_tgt, cf_logger );
+                if ( status < 0 )
+                {
+                    cf_logger.logger( LOG_ERR, "Error %d: cannot domainless user kerberos tickets",
+                                      status );
+                    err_msg = "ERROR: cannot domainless user kerberos tickets";
                 }
                 else
                 {
-                    username = "xxxx";
-                    password = "xxxx";
-                    // write the ticket information to meta data file
-                    write_meta_data_json( krb_ticket_info_list, lease_id, krb_files_dir );
-                    status_ = FINISH;
-                    handle_krb_responder_.Finish( create_domainless_krb_reply_, grpc::Status::OK,
-                                                             this );
+                    std::vector<creds_fetcher::krb_ticket_info*> krb_tickets;
+                    for ( auto& krb_ticket : krb_ticket_info_list )
+                    {
+                        krb_tickets.push_back( &krb_ticket );
+                    }
+                    err_msg = create_gmsa_krb_tickets( krb_tickets, domain, host_tgt,
+                                                       MAX_PARALLEL_TICKETS_PER_LEASE,
+                                                       cf_logger );
                 }
             }
+            if ( !err_msg.empty() )
+            {
+                username = "xxxx";
+                password = "xxxx";
+                // all or nothing, remove the tickets created so far
+                std::filesystem::remove_all( krb_files_dir + "/" + lease_id );
+                reply_status_ = grpc::Status( grpc::StatusCode::INTERNAL, err_msg );
+            }
             else
             {
-                GPR_ASSERT( status_ == FINISH );
-                // Once in the FINISH state, deallocate ourselves (CallData).
-                delete this;
+                for ( const auto& krb_ticket : krb_ticket_info_list )
+                {
+                    std::filesystem::path krb_ccname( krb_ticket.krb_file_path );
+                    create_domainless_krb_reply_.add_created_kerberos_file_paths(
+                        krb_ccname.parent_path().string() );
+                }
+                username = "xxxx";
+                password = "xxxx";
+                // the lease is logged to the lease journal
+                lease_registry.add_lease( lease_id, std::move( krb_ticket_info_list ) );
+                reply_status_ = grpc::Status::OK;
             }
-
-            return;
         }
 
         void Proceed()
@@ -711,7 +1315,7 @@ class CredentialsFetcherImpl final
             {
                 return;
             }
-            printf( "AddNonDomainJoinedKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataAddNonDomainJoinedKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -775,14 +1379,22 @@ class CredentialsFetcherImpl final
                                         ::CreateNonDomainJoinedKerberosLeaseResponse>
             handle_krb_responder_;
 
+        // Status of the rpc, set by the worker that processed it.
+        grpc::Status reply_status_;
+        // Brings this instance back to its completion queue once processed.
+        grpc::Alarm alarm_;
+
         // Let's implement a tiny state machine with the following states.
         enum CallStatus
         {
             CREATE,
             PROCESS,
+            COMPLETE,
             FINISH
         };
         CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
     };
 
     // Class encompasing the state and logic needed to serve a request.
@@ -802,6 +1414,7 @@ class CredentialsFetcherImpl final
             , cq_( cq )
             , handle_krb_responder_( &add_krb_ctx_ )
             , status_( CREATE )
+            , rpc_timer_( creds_fetcher::METRIC_RPC_RENEW_NON_DOMAIN_JOINED_KERBEROS_LEASE, false )
         {
             cookie = CLASS_NAME_CallDataRenewNonDomainJoinedKerberosLease;
             // Invoke the serving logic right away.
@@ -816,7 +1429,7 @@ class CredentialsFetcherImpl final
                 return;
             }
 
-            printf( "RenewNonDomainJoinedKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataRenewNonDomainJoinedKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -838,66 +1451,114 @@ class CredentialsFetcherImpl final
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
                 new CallDataRenewNonDomainJoinedKerberosLease( service_, cq_ );
-                // The actual processing.
-                std::string lease_id = generate_lease_id();
-                std::string username = renew_domainless_krb_request_.username();
-                std::string password = renew_domainless_krb_request_.password();
-                std::string domain = renew_domainless_krb_request_.domain();
-
-                std::string err_msg;
-                if(!contains_invalid_characters_in_credentials(domain))
-                {
-                    if ( !username.empty() && !password.empty() && !domain.empty() && username.length() < INPUT_CREDENTIALS_LENGTH && password.length() <
-                                                                                                                                          INPUT_CREDENTIALS_LENGTH )
-                    {
-                        std::list<std::string> renewed_krb_file_paths =
-                            renew_kerberos_tickets_domainless( krb_files_dir, domain, username,
-                                                               password, cf_logger );
-
-                        for ( auto renewed_krb_path : renewed_krb_file_paths )
-                        {
-                            renew_domainless_krb_reply_.add_renewed_kerberos_file_paths(
-                                renewed_krb_path );
-                        }
-                    }
-                    else
+                rpc_timer_.start();
+                // The actual processing is done in the worker pool, this completion
+                // queue thread resumes this instance once the alarm set by the worker
+                // fires.
+                status_ = COMPLETE;
+                grpc::Status submit_status = submit_rpc_work(
+                    [this, krb_files_dir, &cf_logger, aws_sm_secret_name]()
                     {
-                        err_msg = "Error: domainless AD user credentials is not valid/ "
-                                  "credentials should not be more than 256 charaters";
-                    }
-                }
-                else
+                        run_rpc_process( reply_status_, [&]() {
+                            Process( krb_files_dir, cf_logger, aws_sm_secret_name );
+                        } );
+                        // always resume the rpc, it would never be finished otherwise
+                        alarm_.Set( cq_, gpr_now( GPR_CLOCK_MONOTONIC ), this );
+                    }  );
+                if ( !submit_status.ok() )
                 {
-                    err_msg = "Error: invalid domainName";
+                    status_ = FINISH;
+                    rpc_timer_.stop( false );
+                    handle_krb_responder_.Finish( renew_domainless_krb_reply_, submit_status, this );
                 }
-
-                username = "xxxx";
-                password = "xxxx";
-
+            }
+            else if ( status_ == COMPLETE )
+            {
                 // And we are done! Let the gRPC runtime know we've finished, using the
                 // memory address of this instance as the uniquely identifying tag for
                 // the event.
-                if ( !err_msg.empty() )
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                handle_krb_responder_.Finish( renew_domainless_krb_reply_, reply_status_, this );
+            }
+            else
+            {
+                GPR_ASSERT( status_ == FINISH );
+                // Once in the FINISH state, deallocate ourselves (CallData).
+                delete this;
+            }
+
+            return;
+        }
+
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataRenewNonDomainJoinedKerberosLease (cancelled)", this, status_ );
+            if ( status_ == COMPLETE )
+            {
+                // the worker is done, the rpc is still finished with its reply
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                handle_krb_responder_.Finish( renew_domainless_krb_reply_, reply_status_, this );
+                return;
+            }
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
+
+        /**
+         * Process - the blocking part of the rpc, run in the worker pool
+         */
+        void Process( std::string krb_files_dir, creds_fetcher::CF_logger& cf_logger,
+                      std::string aws_sm_secret_name )
+        {
+            std::string lease_id = generate_lease_id();
+            std::string username = renew_domainless_krb_request_.username();
+            std::string password = renew_domainless_krb_request_.password();
+            std::string domain = renew_domainless_krb_request_.domain();
+
+            std::string err_msg;
+            if(!contains_invalid_characters_in_credentials(domain))
+            {
+                if ( !username.empty() && !password.empty() && !domain.empty() && username.length() < INPUT_CREDENTIALS_LENGTH && password.length() <
+                                                                                                                                      INPUT_CREDENTIALS_LENGTH )
                 {
-                    status_ = FINISH;
-                    handle_krb_responder_.Finish(
-                        renew_domainless_krb_reply_, grpc::Status( grpc::StatusCode::INTERNAL, err_msg ),
-                        this );
+                    std::list<std::string> renewed_krb_file_paths =
+                        renew_kerberos_tickets_domainless( krb_files_dir, domain, username,
+                                                           password, cf_logger );
+
+                    for ( auto renewed_krb_path : renewed_krb_file_paths )
+                    {
+                        renew_domainless_krb_reply_.add_renewed_kerberos_file_paths(
+                            renewed_krb_path );
+                    }
                 }
                 else
                 {
-                    status_ = FINISH;
-                    handle_krb_responder_.Finish( renew_domainless_krb_reply_, grpc::Status::OK, this );
+                    err_msg = "Error: domainless AD user credentials is not valid/ "
+                              "credentials should not be more than 256 charaters";
                 }
             }
             else
             {
-                GPR_ASSERT( status_ == FINISH );
-                // Once in the FINISH state, deallocate ourselves (CallData).
-                delete this;
+                err_msg = "Error: invalid domainName";
             }
 
-            return;
+            username = "xxxx";
+            password = "xxxx";
+
+            if ( !err_msg.empty() )
+            {
+                reply_status_ = grpc::Status( grpc::StatusCode::INTERNAL, err_msg );
+            }
+            else
+            {
+                reply_status_ = grpc::Status::OK;
+            }
         }
 
         void Proceed()
@@ -906,7 +1567,7 @@ class CredentialsFetcherImpl final
             {
                 return;
             }
-            printf( "RenewNonDomainJoinedKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataRenewNonDomainJoinedKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -971,14 +1632,22 @@ class CredentialsFetcherImpl final
                                         ::RenewNonDomainJoinedKerberosLeaseResponse>
             handle_krb_responder_;
 
+        // Status of the rpc, set by the worker that processed it.
+        grpc::Status reply_status_;
+        // Brings this instance back to its completion queue once processed.
+        grpc::Alarm alarm_;
+
         // Let's implement a tiny state machine with the following states.
         enum CallStatus
         {
             CREATE,
             PROCESS,
+            COMPLETE,
             FINISH
         };
         CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
     };
 
     // Class encompasing the state and logic needed to serve a request.
@@ -999,6 +1668,7 @@ class CredentialsFetcherImpl final
             , cq_( cq )
             , delete_krb_responder_( &del_krb_ctx_ )
             , status_( CREATE )
+            , rpc_timer_( creds_fetcher::METRIC_RPC_DELETE_KERBEROS_LEASE, false )
         {
             cookie = CLASS_NAME_CallDataDeleteKerberosLease;
             // Invoke the serving logic right away.
@@ -1012,7 +1682,7 @@ class CredentialsFetcherImpl final
             {
                 return;
             }
-            printf( "CallDataDeleteKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataDeleteKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -1033,42 +1703,35 @@ class CredentialsFetcherImpl final
                 // the one for this CallData. The instance will deallocate itself as
                 // part of its FINISH state.
                 new CallDataDeleteKerberosLease( service_, cq_ );
-
-                // The actual processing.
-                std::string lease_id = delete_krb_request_.lease_id();
-                std::string err_msg;
-
-                if ( !lease_id.empty() )
-                {
-                    std::vector<std::string> deleted_krb_file_paths =
-                        delete_krb_tickets( krb_files_dir, lease_id );
-
-                    for ( auto deleted_krb_path : deleted_krb_file_paths )
+                rpc_timer_.start();
+                // The actual processing is done in the worker pool, this completion
+                // queue thread resumes this instance once the alarm set by the worker
+                // fires.
+                status_ = COMPLETE;
+                grpc::Status submit_status = submit_rpc_work(
+                    [this, krb_files_dir, &cf_logger, aws_sm_secret_name]()
                     {
-                        delete_krb_reply_.add_deleted_kerberos_file_paths( deleted_krb_path );
-                    }
-                    delete_krb_reply_.set_lease_id( lease_id );
-                }
-                else
+                        run_rpc_process( reply_status_, [&]() {
+                            Process( krb_files_dir, cf_logger, aws_sm_secret_name );
+                        } );
+                        // always resume the rpc, it would never be finished otherwise
+                        alarm_.Set( cq_, gpr_now( GPR_CLOCK_MONOTONIC ), this );
+                    }  );
+                if ( !submit_status.ok() )
                 {
-                    err_msg = "Error: lease_id is not valid";
+                    status_ = FINISH;
+                    rpc_timer_.stop( false );
+                    delete_krb_responder_.Finish( delete_krb_reply_, submit_status, this );
                 }
-
+            }
+            else if ( status_ == COMPLETE )
+            {
                 // And we are done! Let the gRPC runtime know we've finished, using the
                 // memory address of this instance as the uniquely identifying tag for
                 // the event.
-                if ( !err_msg.empty() )
-                {
-                    status_ = FINISH;
-                    delete_krb_responder_.Finish(
-                        delete_krb_reply_, grpc::Status( grpc::StatusCode::INTERNAL, err_msg ),
-                        this );
-                }
-                else
-                {
-                    status_ = FINISH;
-                    delete_krb_responder_.Finish( delete_krb_reply_, grpc::Status::OK, this );
-                }
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                delete_krb_responder_.Finish( delete_krb_reply_, reply_status_, this );
             }
             else
             {
@@ -1079,13 +1742,69 @@ class CredentialsFetcherImpl final
 
             return;
         }
+        /**
+         * Cancel - the event of this instance did not complete, the request was never
+         * received or the reply was not sent because the server is shutting down
+         */
+        void Cancel()
+        {
+            log_rpc_state( "CallDataDeleteKerberosLease (cancelled)", this, status_ );
+            if ( status_ == COMPLETE )
+            {
+                // the worker is done, the rpc is still finished with its reply
+                status_ = FINISH;
+                rpc_timer_.stop( reply_status_.ok() );
+                delete_krb_responder_.Finish( delete_krb_reply_, reply_status_, this );
+                return;
+            }
+            // no new instance is spawned, the server does not accept requests anymore
+            delete this;
+        }
+
+        /**
+         * Process - the blocking part of the rpc, run in the worker pool
+         */
+        void Process( std::string krb_files_dir, creds_fetcher::CF_logger& cf_logger,
+                      std::string aws_sm_secret_name )
+        {
+
+            std::string lease_id = delete_krb_request_.lease_id();
+            std::string err_msg;
+
+            if ( !lease_id.empty() )
+            {
+                std::vector<std::string> deleted_krb_file_paths =
+                    delete_krb_tickets( krb_files_dir, lease_id );
+
+                for ( auto deleted_krb_path : deleted_krb_file_paths )
+                {
+                    krb_renewal_scheduler.remove( deleted_krb_path );
+                    delete_krb_reply_.add_deleted_kerberos_file_paths( deleted_krb_path );
+                }
+                delete_krb_reply_.set_lease_id( lease_id );
+            }
+            else
+            {
+                err_msg = "Error: lease_id is not valid";
+            }
+
+            if ( !err_msg.empty() )
+            {
+                reply_status_ = grpc::Status( grpc::StatusCode::INTERNAL, err_msg );
+            }
+            else
+            {
+                reply_status_ = grpc::Status::OK;
+            }
+        }
+
         void Proceed()
         {
             if ( cookie.compare( CLASS_NAME_CallDataDeleteKerberosLease ) != 0 )
             {
                 return;
             }
-            printf( "CallDataDeleteKerberosLease %p status: %d\n", this, status_ );
+            log_rpc_state( "CallDataDeleteKerberosLease", this, status_ );
             if ( status_ == CREATE )
             {
                 // Make this instance progress to the PROCESS state.
@@ -1146,75 +1865,175 @@ class CredentialsFetcherImpl final
         grpc::ServerAsyncResponseWriter<credentialsfetcher::DeleteKerberosLeaseResponse>
             delete_krb_responder_;
 
+        // Status of the rpc, set by the worker that processed it.
+        grpc::Status reply_status_;
+        // Brings this instance back to its completion queue once processed.
+        grpc::Alarm alarm_;
+
         // Let's implement a tiny state machine with the following states.
         enum CallStatus
         {
             CREATE,
             PROCESS,
+            COMPLETE,
             FINISH
         };
         CallStatus status_; // The current serving state.
+        // Time from the request to the reply, recorded in the rpc metrics.
+        creds_fetcher::StageTimer rpc_timer_;
     };
 
-    // This can be run in multiple threads if needed.
-    void HandleRpcs( std::string krb_files_dir, creds_fetcher::CF_logger& cf_logger,
-                     std::string aws_sm_secret_name )
+    // This is run in one thread per completion queue.
+    void HandleRpcs( grpc::ServerCompletionQueue* cq, std::string krb_files_dir,
+                     creds_fetcher::CF_logger& cf_logger, std::string aws_sm_secret_name )
+    {
+        void* got_tag; // uniquely identifies a request.
+        bool ok;
+
+        // Every completion queue gets its own set of CallData instances, so that
+        // incoming calls are spread across all the queues.
+        new CallDataCreateKerberosLease( &service_, cq );
+        new CallDataAddNonDomainJoinedKerberosLease ( &service_, cq );
+        new CallDataRenewNonDomainJoinedKerberosLease ( &service_, cq );
+        new CallDataDeleteKerberosLease( &service_, cq );
+
+        // Spawn a new CallData instance to serve new clients.
+        // Block waiting to read the next event from the completion queue. The
+        // event is uniquely identified by its tag, which in this case is the
+        // memory address of a CallData instance.
+        // The return value of Next should always be checked. This return value
+        // tells us whether there is any kind of event or cq is shutting down.
+        while ( cq->Next( &got_tag, &ok ) )
+        {
+            // the instance can delete itself in Proceed, only the instance of the type
+            // named by its cookie is resumed, an event that did not complete (ok is
+            // false once the server shuts down) is handed to Cancel to free the instance
+            const std::string& cookie =
+                static_cast<CallDataCreateKerberosLease*>( got_tag )->cookie;
+            if ( cookie.compare( CLASS_NAME_CallDataCreateKerberosLease ) == 0 )
+            {
+                auto* call_data = static_cast<CallDataCreateKerberosLease*>( got_tag );
+                if ( ok )
+                {
+                    call_data->Proceed( krb_files_dir, cf_logger, aws_sm_secret_name );
+                }
+                else
+                {
+                    call_data->Cancel();
+                }
+            }
+            else if ( cookie.compare( CLASS_NAME_CallDataAddNonDomainJoinedKerberosLease ) == 0 )
+            {
+                auto* call_data = static_cast<CallDataAddNonDomainJoinedKerberosLease*>( got_tag );
+                if ( ok )
+                {
+                    call_data->Proceed( krb_files_dir, cf_logger, aws_sm_secret_name );
+                }
+                else
+                {
+                    call_data->Cancel();
+                }
+            }
+            else if ( cookie.compare( CLASS_NAME_CallDataRenewNonDomainJoinedKerberosLease ) == 0 )
+            {
+                auto* call_data =
+                    static_cast<CallDataRenewNonDomainJoinedKerberosLease*>( got_tag );
+                if ( ok )
+                {
+                    call_data->Proceed( krb_files_dir, cf_logger, aws_sm_secret_name );
+                }
+                else
+                {
+                    call_data->Cancel();
+                }
+            }
+            else if ( cookie.compare( CLASS_NAME_CallDataDeleteKerberosLease ) == 0 )
+            {
+                auto* call_data = static_cast<CallDataDeleteKerberosLease*>( got_tag );
+                if ( ok )
+                {
+                    call_data->Proceed( krb_files_dir, cf_logger, aws_sm_secret_name );
+                }
+                else
+                {
+                    call_data->Cancel();
+                }
+            }
+        }
+    }
+
+    // This is run in the thread of the health completion queue. HealthCheck and
+    // GetMetrics only read memory, they get their own queue so that they are answered
+    // right away however many lease rpcs are waiting on the other queues.
+    void HandleHealthRpcs( grpc::ServerCompletionQueue* cq )
     {
         void* got_tag; // uniquely identifies a request.
         bool ok;
 
-        new CallDataCreateKerberosLease( &service_, cq_.get() );
-        new CallDataAddNonDomainJoinedKerberosLease ( &service_, cq_.get() );
-        new CallDataRenewNonDomainJoinedKerberosLease ( &service_, cq_.get() );
-        new CallDataDeleteKerberosLease( &service_, cq_.get() );
-        new CallDataHealthCheck( &service_, cq_.get() );
+        new CallDataHealthCheck( &service_, cq );
+        new CallDataGetMetrics( &service_, cq );
 
-        while ( pthread_shutdown_signal != nullptr && !( *pthread_shutdown_signal ) )
+        while ( cq->Next( &got_tag, &ok ) )
         {
-            // Spawn a new CallData instance to serve new clients.
-            // Block waiting to read the next event from the completion queue. The
-            // event is uniquely identified by its tag, which in this case is the
-            // memory address of a CallData instance.
-            // The return value of Next should always be checked. This return value
-            // tells us whether there is any kind of event or cq_ is shutting down.
-            GPR_ASSERT( cq_->Next( &got_tag, &ok ) );
-            GPR_ASSERT( ok );
-
-            static_cast<CallDataCreateKerberosLease*>( got_tag )->Proceed( krb_files_dir, cf_logger,
-                                                                           aws_sm_secret_name );
-            static_cast<CallDataAddNonDomainJoinedKerberosLease*>( got_tag )->Proceed(
-                krb_files_dir, cf_logger,
-                                                                           aws_sm_secret_name );
-            static_cast<CallDataRenewNonDomainJoinedKerberosLease*>( got_tag )->Proceed(
-                krb_files_dir, cf_logger,
-                aws_sm_secret_name );
-            static_cast<CallDataDeleteKerberosLease*>( got_tag )->Proceed( krb_files_dir, cf_logger,
-                                                                           aws_sm_secret_name );
-            static_cast<CallDataHealthCheck*>( got_tag )->Proceed( cf_logger);
+            // the instance can delete itself in Proceed, its cookie is read first, an
+            // event that did not complete is handed to Cancel to free the instance
+            CallDataHealthCheck* health_check = static_cast<CallDataHealthCheck*>( got_tag );
+            if ( health_check->cookie.compare( CLASS_NAME_CallDataHealthCheck ) == 0 )
+            {
+                if ( ok )
+                {
+                    health_check->Proceed();
+                }
+                else
+                {
+                    health_check->Cancel();
+                }
+            }
+            else
+            {
+                CallDataGetMetrics* get_metrics = static_cast<CallDataGetMetrics*>( got_tag );
+                if ( ok )
+                {
+                    get_metrics->Proceed();
+                }
+                else
+                {
+                    get_metrics->Cancel();
+                }
+            }
         }
     }
 
-    std::unique_ptr<grpc::ServerCompletionQueue> cq_;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+    // serves HealthCheck and GetMetrics only
+    std::unique_ptr<grpc::ServerCompletionQueue> health_cq_;
     credentialsfetcher::CredentialsFetcherService::AsyncService service_;
     std::unique_ptr<grpc::Server> server_;
+    std::unique_ptr<creds_fetcher::WorkerPool> worker_pool_;
+    bool shut_down_ = false;
 };
 
 /**
  * RunGrpcServer - Runs the grpc initializes and runs the grpc server
  * @param unix_socket_dir - path for the unix socket creation
  * @param cf_logger - log to systemd daemon
- * @param shutdown_signal - sigterm from systemd
+ * @param shutdown_fd - readable when the daemon shuts down
+ * @param num_completion_queues - number of completion queues/threads serving rpcs
+ * @param num_rpc_workers - number of threads doing the blocking work of the rpcs
+ * @param max_queued_rpcs - rpcs that can wait for a worker before new ones are rejected
  * @return - return 0 when server exits
  */
 int RunGrpcServer( std::string unix_socket_dir, std::string krb_files_dir,
-                   creds_fetcher::CF_logger& cf_logger, volatile sig_atomic_t* shutdown_signal,
-                   std::string aws_sm_secret_name )
+                   creds_fetcher::CF_logger& cf_logger, int shutdown_fd,
+                   std::string aws_sm_secret_name, int num_completion_queues,
+                   int num_rpc_workers, int max_queued_rpcs )
 {
     CredentialsFetcherImpl creds_fetcher_grpc;
+    rpc_logger = &cf_logger;
 
-    pthread_shutdown_signal = shutdown_signal;
-
-    creds_fetcher_grpc.RunServer( unix_socket_dir, krb_files_dir, cf_logger, aws_sm_secret_name );
+    creds_fetcher_grpc.RunServer( unix_socket_dir, krb_files_dir, cf_logger, aws_sm_secret_name,
+                                  num_completion_queues, num_rpc_workers, max_queued_rpcs,
+                                  shutdown_fd );
 
     // TBD:: Add return status for errors
     return 0;
@@ -1251,7 +2070,7 @@ std::string generate_lease_id()
  * @param krb_ticket_info - return service account info
  * @return
  */
-int parse_cred_spec( std::string credspec_data, creds_fetcher::krb_ticket_info* krb_ticket_info )
+int parse_cred_spec( std::string credspec_data, creds_fetcher::krb_ticket_info& krb_ticket_info )
 {
     try
     {
@@ -1280,8 +2099,8 @@ int parse_cred_spec( std::string credspec_data, creds_fetcher::krb_ticket_info*
         if (service_account_name.empty() || domain_name.empty())
             return -1;
 
-        krb_ticket_info->domain_name = domain_name;
-        krb_ticket_info->service_account_name = service_account_name;
+        krb_ticket_info.domain_name = domain_name;
+        krb_ticket_info.service_account_name = service_account_name;
     }
     catch ( ... )
     {
@@ -1307,7 +2126,9 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
     std::string credspec_contents;
     int status;
     
-    cf_logger.logger( LOG_INFO, "Generating lease id %s", cred_file_lease_id );
+    creds_fetcher::log_fields_t log_fields;
+    log_fields.lease_id = cred_file_lease_id;
+    cf_logger.logger( LOG_INFO, log_fields, "Generating lease id %s", cred_file_lease_id.c_str() );
 
     if ( !std::filesystem::exists( credspec_filepath ) ){
         std::cerr << "The credential spec file " << credspec_filepath << " was not found!" << std::endl;
@@ -1326,22 +2147,23 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
     } 
     else 
     {
-        cf_logger.logger( LOG_ERR, "Unable to open credential spec file: %s", credspec_filepath);
+        cf_logger.logger( LOG_ERR, "Unable to open credential spec file: %s",
+                          credspec_filepath.c_str() );
         std::cerr << "Unable to open credential spec file: " << credspec_filepath << std::endl;
 
         return EXIT_FAILURE;
     }
 
-    creds_fetcher::krb_ticket_info* krb_ticket_info = new creds_fetcher::krb_ticket_info;
+    creds_fetcher::krb_ticket_info krb_ticket_info;
     int parse_result = parse_cred_spec( credspec_contents, krb_ticket_info );
 
     // only add the ticket info if the parsing is successful
     if ( parse_result == EXIT_SUCCESS )
     {
         std::string krb_files_path = krb_files_dir + "/" + cred_file_lease_id + "/" +
-                                        krb_ticket_info->service_account_name;
-        krb_ticket_info->krb_file_path = krb_files_path;
-        krb_ticket_info->domainless_user = "";
+                                        krb_ticket_info.service_account_name;
+        krb_ticket_info.krb_file_path = krb_files_path;
+        krb_ticket_info.domainless_user = "";
     }
     else
     {
@@ -1351,17 +2173,16 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
     if ( err_msg.empty() )
     {
         // invoke to get machine ticket
-        status = get_machine_krb_ticket( krb_ticket_info->domain_name, cf_logger );
+        creds_fetcher::host_tgt_ref_t host_tgt;
+        status = get_machine_krb_ticket( krb_ticket_info.domain_name, host_tgt, cf_logger );
         if ( status < 0 )
         {
             cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket",
                                 status );
-            delete krb_ticket_info;      
-                  
             return EXIT_FAILURE;
         }
 
-        std::string krb_file_path = krb_ticket_info->krb_file_path;
+        std::string krb_file_path = krb_ticket_info.krb_file_path;
         if ( std::filesystem::exists( krb_file_path ) )
         {
             cf_logger.logger( LOG_INFO,
@@ -1372,19 +2193,14 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
         }
         std::filesystem::create_directories( krb_file_path );
 
-        std::string krb_ccname_str = krb_ticket_info->krb_file_path + "/krb5cc";
+        std::string krb_ccname_str = krb_ticket_info.krb_file_path + "/krb5cc";
 
-        if ( !std::filesystem::exists( krb_ccname_str ) )
-        {
-            std::ofstream file( krb_ccname_str );
-            file.close();
-
-            krb_ticket_info->krb_file_path = krb_ccname_str;
-        }
+        // the ccache file is created when the ticket is published
+        krb_ticket_info.krb_file_path = krb_ccname_str;
 
         std::pair<int, std::string> gmsa_ticket_result = get_gmsa_krb_ticket(
-            krb_ticket_info->domain_name, krb_ticket_info->service_account_name,
-            krb_ccname_str, cf_logger );
+            krb_ticket_info.domain_name, krb_ticket_info.service_account_name,
+            krb_ccname_str, host_tgt, cf_logger );
         if ( gmsa_ticket_result.first != 0 )
         {
             err_msg = "ERROR: Cannot get gMSA krb ticket";
@@ -1409,19 +2225,17 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
     if ( !err_msg.empty() )
     {
         // remove the directory on failure
-        std::filesystem::remove_all( krb_ticket_info->krb_file_path );
+        std::filesystem::remove_all( krb_ticket_info.krb_file_path );
 
         std::cerr << err_msg << std::endl;
         cf_logger.logger( LOG_ERR, "%s", err_msg.c_str() );
-        delete krb_ticket_info;
 
         return EXIT_FAILURE;
     }
     
-    // write the ticket information to meta data file
-    write_meta_data_json( krb_ticket_info, cred_file_lease_id, krb_files_dir );
-
-    delete krb_ticket_info;
+    // the lease is logged to the lease journal
+    schedule_krb_ticket_renewal( krb_ticket_info );
+    lease_registry.add_lease( cred_file_lease_id, { krb_ticket_info } );
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
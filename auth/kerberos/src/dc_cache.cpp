@@ -0,0 +1,349 @@
+#include "dc_cache.h"
+#include <algorithm>
+#include <arpa/nameser.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <resolv.h>
+
+// large enough for the SRV answers of a domain with many domain controllers
+#define DNS_ANSWER_BUFFER_SIZE 65536
+
+/**
+ * Parse the SRV records of a DNS answer, ordered by priority and weight (RFC 2782)
+ * @param answer - DNS message
+ * @param answer_len - length of the DNS message
+ * @return - SRV records, empty if the message cannot be parsed
+ */
+std::vector<creds_fetcher::srv_record_t> creds_fetcher::parse_srv_answer(
+    const unsigned char* answer, int answer_len )
+{
+    std::vector<creds_fetcher::srv_record_t> records;
+    ns_msg msg;
+
+    if ( ns_initparse( answer, answer_len, &msg ) != 0 )
+    {
+        return records;
+    }
+
+    for ( int i = 0; i < ns_msg_count( msg, ns_s_an ); i++ )
+    {
+        ns_rr rr;
+        if ( ns_parserr( &msg, ns_s_an, i, &rr ) != 0 )
+        {
+            break;
+        }
+        // priority, weight and port followed by the target name
+        if ( ns_rr_type( rr ) != ns_t_srv || ns_rr_rdlen( rr ) < 3 * NS_INT16SZ + 1 )
+        {
+            continue;
+        }
+
+        const unsigned char* rdata = ns_rr_rdata( rr );
+        char target[NS_MAXDNAME];
+        if ( dn_expand( ns_msg_base( msg ), ns_msg_end( msg ), rdata + 3 * NS_INT16SZ, target,
+                        sizeof( target ) ) < 0 )
+        {
+            continue;
+        }
+
+        creds_fetcher::srv_record_t record;
+        record.priority = ns_get16( rdata );
+        record.weight = ns_get16( rdata + NS_INT16SZ );
+        record.port = ns_get16( rdata + 2 * NS_INT16SZ );
+        record.target = target;
+        record.ttl = ns_rr_ttl( rr );
+
+        // "." means the service is not available in the domain
+        if ( !record.target.empty() && record.target != "." )
+        {
+            records.push_back( record );
+        }
+    }
+
+    std::stable_sort( records.begin(), records.end(),
+                      []( const creds_fetcher::srv_record_t& a,
+                          const creds_fetcher::srv_record_t& b ) {
+                          if ( a.priority != b.priority )
+                          {
+                              return a.priority < b.priority;
+                          }
+                          return a.weight > b.weight;
+                      } );
+
+    return records;
+}
+
+/**
+ * Query the SRV records of a name with libresolv
+ * @param srv_name - Like '_ldap._tcp.dc._msdcs.contoso.com'
+ * @return - pair of result and the SRV records, 0 if successful
+ */
+static std::pair<int, std::vector<creds_fetcher::srv_record_t>> query_srv_records(
+    const std::string& srv_name )
+{
+    std::vector<creds_fetcher::srv_record_t> records;
+    struct __res_state res_state = {};
+
+    if ( res_ninit( &res_state ) != 0 )
+    {
+        return std::make_pair( -1, records );
+    }
+
+    std::vector<unsigned char> answer( DNS_ANSWER_BUFFER_SIZE );
+    int answer_len =
+        res_nquery( &res_state, srv_name.c_str(), ns_c_in, ns_t_srv, answer.data(), answer.size() );
+    res_nclose( &res_state );
+    if ( answer_len <= 0 )
+    {
+        return std::make_pair( -1, records );
+    }
+
+    records = creds_fetcher::parse_srv_answer( answer.data(), answer_len );
+    if ( records.empty() )
+    {
+        return std::make_pair( -1, records );
+    }
+
+    return std::make_pair( EXIT_SUCCESS, records );
+}
+
+/**
+ * Look up the domain controllers of a domain, the kerberos SRV records are used
+ * when the domain does not publish the AD specific ldap records
+ * @param domain_name - Like 'contoso.com'
+ * @return - pair of result and the SRV records, 0 if successful
+ */
+static std::pair<int, std::vector<creds_fetcher::srv_record_t>> lookup_domain_controllers(
+    const std::string& domain_name )
+{
+    std::pair<int, std::vector<creds_fetcher::srv_record_t>> result =
+        query_srv_records( "_ldap._tcp.dc._msdcs." + domain_name );
+    if ( result.first == 0 )
+    {
+        return result;
+    }
+
+    return query_srv_records( "_kerberos._tcp." + domain_name );
+}
+
+creds_fetcher::DomainControllerCache::~DomainControllerCache()
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        stopped_ = true;
+    }
+    refresh_cond_.notify_all();
+    if ( refresh_thread_.joinable() )
+    {
+        refresh_thread_.join();
+    }
+}
+
+/**
+ * Store the result of a lookup, a failed lookup keeps the previous domain controllers
+ * until they are too stale. Called with mutex_ held.
+ */
+void creds_fetcher::DomainControllerCache::update_entry(
+    const std::string& domain_name, const std::pair<int, std::vector<srv_record_t>>& lookup )
+{
+    dc_cache_entry_t& entry = entries_[domain_name];
+    time_t now = time( nullptr );
+
+    entry.resolving = false;
+    if ( lookup.first != 0 )
+    {
+        if ( entry.domain_controllers.empty() ||
+             now - entry.fetched_at > DC_CACHE_MAX_STALE_SECONDS )
+        {
+            entry.domain_controllers.clear();
+            entry.expires_at = now + DC_CACHE_NEGATIVE_TTL_SECONDS;
+        }
+        entry.refresh_at = now + DC_CACHE_NEGATIVE_TTL_SECONDS;
+        return;
+    }
+
+    uint32_t ttl = DC_CACHE_MAX_TTL_SECONDS;
+    entry.domain_controllers.clear();
+    for ( const auto& record : lookup.second )
+    {
+        ttl = std::min( ttl, record.ttl );
+        if ( std::find( entry.domain_controllers.begin(), entry.domain_controllers.end(),
+                        record.target ) == entry.domain_controllers.end() )
+        {
+            entry.domain_controllers.push_back( record.target );
+        }
+    }
+    ttl = std::max( ttl, (uint32_t)DC_CACHE_MIN_TTL_SECONDS );
+
+    entry.fetched_at = now;
+    entry.expires_at = now + ttl;
+    // refresh when three quarters of the TTL have passed
+    entry.refresh_at = now + ( ttl * 3 ) / 4;
+}
+
+std::pair<int, std::vector<std::string>> creds_fetcher::DomainControllerCache::
+    get_domain_controllers( const std::string& domain_name )
+{
+    std::string domain = domain_name;
+    std::transform( domain.begin(), domain.end(), domain.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if ( !refresh_thread_.joinable() && !stopped_ )
+    {
+        refresh_thread_ = std::thread( [this]() { refresh_loop(); } );
+    }
+
+    while ( true )
+    {
+        auto it = entries_.find( domain );
+        time_t now = time( nullptr );
+        if ( it != entries_.end() )
+        {
+            it->second.last_used = now;
+        }
+        if ( it != entries_.end() && !it->second.domain_controllers.empty() &&
+             now - it->second.fetched_at <= DC_CACHE_MAX_STALE_SECONDS )
+        {
+            // served from the cache, the refresh thread keeps it current
+            return std::make_pair( EXIT_SUCCESS, it->second.domain_controllers );
+        }
+        if ( it != entries_.end() && it->second.domain_controllers.empty() &&
+             now < it->second.expires_at )
+        {
+            // negative entry, do not query DNS again yet
+            return std::make_pair( -1, std::vector<std::string>() );
+        }
+        if ( it == entries_.end() || !it->second.resolving )
+        {
+            break;
+        }
+        // a lookup of the same domain is in flight, wait for its answer
+        resolved_cond_.wait( lock );
+    }
+
+    entries_[domain].resolving = true;
+    entries_[domain].last_used = time( nullptr );
+    lock.unlock();
+    std::pair<int, std::vector<srv_record_t>> lookup = lookup_domain_controllers( domain );
+    lock.lock();
+
+    update_entry( domain, lookup );
+    resolved_cond_.notify_all();
+    refresh_cond_.notify_all();
+
+    const dc_cache_entry_t& entry = entries_[domain];
+    if ( entry.domain_controllers.empty() )
+    {
+        return std::make_pair( -1, std::vector<std::string>() );
+    }
+    return std::make_pair( EXIT_SUCCESS, entry.domain_controllers );
+}
+
+void creds_fetcher::DomainControllerCache::invalidate( const std::string& domain_name )
+{
+    std::string domain = domain_name;
+    std::transform( domain.begin(), domain.end(), domain.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+
+    std::lock_guard<std::mutex> lock( mutex_ );
+    auto it = entries_.find( domain );
+    if ( it != entries_.end() && !it->second.resolving )
+    {
+        entries_.erase( it );
+    }
+}
+
+/**
+ * Refresh the entries that are due, one domain at a time, outside the lock
+ */
+void creds_fetcher::DomainControllerCache::refresh_loop()
+{
+    std::unique_lock<std::mutex> lock( mutex_ );
+    while ( !stopped_ )
+    {
+        time_t now = time( nullptr );
+        time_t next_refresh = now + DC_CACHE_MAX_TTL_SECONDS;
+        std::string due_domain;
+
+        for ( auto it = entries_.begin(); it != entries_.end(); )
+        {
+            // stop refreshing domains that are no longer looked up
+            if ( !it->second.resolving && now - it->second.last_used > DC_CACHE_MAX_STALE_SECONDS )
+            {
+                it = entries_.erase( it );
+                continue;
+            }
+            auto& entry = *it++;
+            if ( entry.second.resolving )
+            {
+                continue;
+            }
+            if ( entry.second.refresh_at <= now )
+            {
+                due_domain = entry.first;
+                break;
+            }
+            next_refresh = std::min( next_refresh, entry.second.refresh_at );
+        }
+
+        if ( due_domain.empty() )
+        {
+            refresh_cond_.wait_until( lock, std::chrono::system_clock::from_time_t( next_refresh ) );
+            continue;
+        }
+
+        entries_[due_domain].resolving = true;
+        lock.unlock();
+        std::pair<int, std::vector<srv_record_t>> lookup = lookup_domain_controllers( due_domain );
+        lock.lock();
+
+        update_entry( due_domain, lookup );
+        resolved_cond_.notify_all();
+    }
+}
+
+/**
+ * Test the parsing of a SRV answer with two domain controllers
+ */
+int test_dns_srv_parse()
+{
+    // _ldap._tcp.dc._msdcs.contoso.com SRV: 0 100 389 dc2.contoso.com, 0 50 389 dc1.contoso.com
+    const unsigned char srv_answer[] = {
+        // header: id, flags, 1 question, 2 answers
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+        // question
+        0x05, '_', 'l', 'd', 'a', 'p', 0x04, '_', 't', 'c', 'p', 0x02, 'd', 'c', 0x06, '_', 'm',
+        's', 'd', 'c', 's', 0x07, 'c', 'o', 'n', 't', 'o', 's', 'o', 0x03, 'c', 'o', 'm', 0x00,
+        0x00, 0x21, 0x00, 0x01,
+        // answer 1: name pointer to the question, SRV, IN, ttl 600
+        0xC0, 0x0C, 0x00, 0x21, 0x00, 0x01, 0x00, 0x00, 0x02, 0x58, 0x00, 0x0C,
+        0x00, 0x00, 0x00, 0x32, 0x01, 0x85, 0x03, 'd', 'c', '1', 0xC0, 0x21,
+        // answer 2: ttl 300, higher weight
+        0xC0, 0x0C, 0x00, 0x21, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x00, 0x0C,
+        0x00, 0x00, 0x00, 0x64, 0x01, 0x85, 0x03, 'd', 'c', '2', 0xC0, 0x21 };
+
+    std::vector<creds_fetcher::srv_record_t> records =
+        creds_fetcher::parse_srv_answer( srv_answer, sizeof( srv_answer ) );
+    if ( records.size() != 2 || records[0].target != "dc2.contoso.com" ||
+         records[1].target != "dc1.contoso.com" || records[0].port != 389 ||
+         records[0].ttl != 300 || records[1].weight != 50 )
+    {
+        std::cout << "Test dns srv parse failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // a truncated answer must not be parsed
+    records = creds_fetcher::parse_srv_answer( srv_answer, 20 );
+    if ( !records.empty() )
+    {
+        std::cout << "Test dns srv parse of truncated answer failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Test dns srv parse succeeded" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -1,24 +1,44 @@
 #include "daemon.h"
+#include "dc_cache.h"
+#include "health.h"
+#include "lease_registry.h"
+#include "ldap_client.h"
+#include "metrics.h"
+#include "renewal_scheduler.h"
+#include "single_flight.h"
+#include "tgt_cache.h"
+#include <fcntl.h>
 #include <fstream>
+#include <atomic>
 #include <filesystem>
-#include <dirent.h>
+#include <mutex>
 #include <openssl/crypto.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <regex>
 
-// renew the ticket 1 hrs before the expiration
-#define RENEW_TICKET_HOURS 1
-#define SECONDS_IN_HOUR 3600
 // Active Directory uses NetBIOS computer names that do not exceed 15 characters.
 // https://learn.microsoft.com/en-us/troubleshoot/windows-server/identity/naming-conventions-for-computer-domain-site-ou
 #define HOST_NAME_LENGTH_LIMIT 15
+// renewable lifetime requested for the tickets, 7 days is the Active Directory default
+#define TICKET_RENEW_LIFETIME_SECONDS ( 7 * 24 * SECONDS_IN_HOUR )
 
-static const std::string install_path_for_decode_exe =
-    "/usr/sbin/credentials_fetcher_utf16_private.exe";
 static const std::string install_path_for_aws_cli = "/usr/bin/aws";
+static const char* machine_keytab = "/etc/krb5.keytab";
 
-extern "C" int my_kinit_main(int, char **);
+// bound connections to the domain controllers, reused across gMSA password lookups
+static creds_fetcher::LdapConnectionPool ldap_connection_pool( DEFAULT_LDAP_MAX_IDLE_CONNECTIONS,
+                                                               DEFAULT_LDAP_IDLE_TIMEOUT_SECONDS );
+
+// domain controllers of the domains from DNS SRV records, refreshed in the background
+static creds_fetcher::DomainControllerCache domain_controller_cache;
+
+creds_fetcher::RenewalScheduler krb_renewal_scheduler;
+
+// gMSA ticket requests in flight, keyed by the gMSA principal and the ldap bind credentials
+static creds_fetcher::SingleFlight<std::pair<int, std::string>> gmsa_ticket_flights;
+
+// machine or domainless user TGTs the ldap searches bind with
+creds_fetcher::TgtCache host_tgt_cache( HOST_TGT_CCACHE_PREFIX, HOST_TGT_REFRESH_MARGIN_SECONDS );
 
 /**
  * Check if binary is writable other than root
@@ -43,6 +63,33 @@ bool check_file_permissions( std::string filename )
     return true;
 }
 
+static std::pair<int, std::string> exec_shell_cmd( std::string cmd );
+
+/**
+ * Check that a tool run by the daemon is owned and writable only by root. The tools
+ * are looked up once, they are not expected to change while the daemon runs.
+ * @param tool - Like 'kinit'
+ * @return - true or false
+ */
+static bool check_tool_path( const std::string& tool )
+{
+    static std::mutex tool_paths_mutex;
+    static std::map<std::string, bool> checked_tools;
+
+    std::lock_guard<std::mutex> lock( tool_paths_mutex );
+    auto it = checked_tools.find( tool );
+    if ( it != checked_tools.end() )
+    {
+        return it->second;
+    }
+
+    std::pair<int, std::string> cmd = exec_shell_cmd( "which " + tool );
+    rtrim( cmd.second );
+    bool is_valid = check_file_permissions( cmd.second );
+    checked_tools[tool] = is_valid;
+    return is_valid;
+}
+
 /**
  * Execute a shell command such as "ls /tmp/"
  * output is a pair of error code and output log
@@ -71,6 +118,117 @@ static std::pair<int, std::string> exec_shell_cmd( std::string cmd )
     return result;
 }
 
+/**
+ * Get a TGT with the krb5 library and store it in the ccache, this is what
+ * 'kinit -kt <keytab> <principal>' or 'echo <password> | kinit <principal>' does.
+ * @param principal_name - Like 'EC2AMAZ-Q5VJZQ$@CONTOSO.COM'
+ * @param keytab_name - keytab holding the keys of the principal, nullptr to use the password
+ * @param password - password of the principal, used when there is no keytab
+ * @param krb_cc_name - ccache to store the ticket in, empty for the default ccache
+ * @return result pair(krb5 error-code - 0 if successful, error message)
+ */
+static std::pair<int, std::string> acquire_krb_ticket( const std::string& principal_name,
+                                                       const char* keytab_name,
+                                                       const char* password,
+                                                       const std::string& krb_cc_name )
+{
+    krb5_context context = nullptr;
+    krb5_principal principal = nullptr;
+    krb5_keytab keytab = nullptr;
+    krb5_ccache ccache = nullptr;
+    krb5_get_init_creds_opt* opt = nullptr;
+    krb5_creds creds;
+    bool have_creds = false;
+    std::string err_msg;
+
+    memset( &creds, 0, sizeof( creds ) );
+
+    krb5_error_code ret = krb5_init_context( &context );
+    if ( ret != 0 )
+    {
+        return std::make_pair( ret, std::string( "cannot initialize krb5 context" ) );
+    }
+
+    ret = krb5_parse_name( context, principal_name.c_str(), &principal );
+    if ( ret == 0 )
+    {
+        if ( krb_cc_name.empty() )
+        {
+            ret = krb5_cc_default( context, &ccache );
+        }
+        else
+        {
+            ret = krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache );
+        }
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_get_init_creds_opt_alloc( context, &opt );
+    }
+    if ( ret == 0 )
+    {
+        // the ccache is initialized with the principal and the ticket is stored on success
+        ret = krb5_get_init_creds_opt_set_out_ccache( context, opt, ccache );
+    }
+    if ( ret == 0 )
+    {
+        // ask for a renewable ticket so that renew_krb_ticket can extend it, the KDC
+        // caps this at its own policy
+        krb5_get_init_creds_opt_set_renew_life( opt, TICKET_RENEW_LIFETIME_SECONDS );
+    }
+    if ( ret == 0 )
+    {
+        if ( keytab_name != nullptr )
+        {
+            ret = krb5_kt_resolve( context, keytab_name, &keytab );
+            if ( ret == 0 )
+            {
+                ret = krb5_get_init_creds_keytab( context, &creds, principal, keytab, 0, nullptr,
+                                                  opt );
+            }
+        }
+        else
+        {
+            ret = krb5_get_init_creds_password( context, &creds, principal, password, nullptr,
+                                                nullptr, 0, nullptr, opt );
+        }
+        have_creds = ( ret == 0 );
+    }
+
+    if ( ret != 0 )
+    {
+        const char* krb5_err_msg = krb5_get_error_message( context, ret );
+        err_msg = krb5_err_msg;
+        krb5_free_error_message( context, krb5_err_msg );
+        creds_fetcher::HealthMonitor::instance().record_kdc_error( principal_name + ": " +
+                                                                   err_msg );
+    }
+
+    if ( have_creds )
+    {
+        krb5_free_cred_contents( context, &creds );
+    }
+    if ( opt != nullptr )
+    {
+        krb5_get_init_creds_opt_free( context, opt );
+    }
+    if ( keytab != nullptr )
+    {
+        krb5_kt_close( context, keytab );
+    }
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( context, ccache );
+    }
+    if ( principal != nullptr )
+    {
+        krb5_free_principal( context, principal );
+    }
+    krb5_free_context( context );
+
+    return std::make_pair( ret, err_msg );
+}
+
 /**
  * If the host is domain-joined, the result is of the form EC2AMAZ-Q5VJZQ$@CONTOSO.COM'
  * @param domain_name: Expected domain name as per configuration
@@ -132,107 +290,98 @@ static std::pair<int, std::string> get_machine_principal( std::string domain_nam
 }
 
 /**
- * This function generates the kerberos ticket for the host machine.
- * It uses machine keytab located at /etc/krb5.keytab to generate the ticket.
- * @param cf_daemon - parent daemon object
- * @return error-code - 0 if successful
+ * Machine principal of the host for the domain, it is looked up once and kept
+ * since the host name and the realm do not change while the daemon runs
+ * @param domain_name: Expected domain name as per configuration
+ * @return result pair<int, std::string> (error-code - 0 if successful
+ *                          string of the form EC2AMAZ-Q5VJZQ$@CONTOSO.COM')
  */
-int get_machine_krb_ticket( std::string domain_name, creds_fetcher::CF_logger& cf_logger )
+static std::pair<int, std::string> get_host_identity( const std::string& domain_name,
+                                                      creds_fetcher::CF_logger& cf_logger )
 {
-    std::pair<int, std::string> result;
+    static std::mutex host_identity_mutex;
+    static std::map<std::string, std::string> machine_principals;
 
-    std::pair<int, std::string> cmd = exec_shell_cmd( "which hostname" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
+    std::lock_guard<std::mutex> lock( host_identity_mutex );
+    auto it = machine_principals.find( domain_name );
+    if ( it != machine_principals.end() )
     {
-        return -1;
+        return std::make_pair( EXIT_SUCCESS, it->second );
     }
 
-    cmd = exec_shell_cmd( "which realm" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
+    std::pair<int, std::string> result = get_machine_principal( domain_name, cf_logger );
+    if ( result.first == 0 )
     {
-        return -1;
+        std::transform( result.second.begin(), result.second.end(), result.second.begin(),
+                        []( unsigned char c ) { return std::toupper( c ); } );
+        machine_principals[domain_name] = result.second;
     }
+    return result;
+}
 
-    cmd = exec_shell_cmd( "which kinit" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
+/**
+ * This function generates the kerberos ticket for the host machine.
+ * It uses machine keytab located at /etc/krb5.keytab to generate the ticket.
+ * The ticket is kept in host_tgt_cache and only acquired again near its expiry.
+ * @param cf_daemon - parent daemon object
+ * @param host_tgt - set to the machine TGT, held until the ldap searches are done
+ * @return error-code - 0 if successful
+ */
+int get_machine_krb_ticket( std::string domain_name, creds_fetcher::host_tgt_ref_t& host_tgt,
+                            creds_fetcher::CF_logger& cf_logger )
+{
+    std::pair<int, std::string> result;
+    creds_fetcher::StageTimer machine_ticket_timer( creds_fetcher::METRIC_MACHINE_TICKET );
 
-    cmd = exec_shell_cmd( "which ldapsearch" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
+    if ( !check_tool_path( "hostname" ) || !check_tool_path( "realm" ) )
     {
         return -1;
     }
 
-    if ( !check_file_permissions( install_path_for_decode_exe ) )
+    std::pair<int, std::string> machine_principal = get_host_identity( domain_name, cf_logger );
+    if ( machine_principal.first != 0 )
     {
-        return -1;
+        std::cout << "ERROR: " << __func__ << ":" << __LINE__ << " invalid machine principal" << std::endl;
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d invalid machine principal", __func__, __LINE__ );
+        return machine_principal.first;
     }
 
-    result = get_machine_principal( std::move( domain_name ), cf_logger );
+    // same as kinit -kt /etc/krb5.keytab  'EC2AMAZ-GG97ZL$'@CONTOSO.COM
+    result = host_tgt_cache.get( "host:" + machine_principal.second,
+                                 [&machine_principal]( const std::string& krb_cc_name ) {
+                                     return acquire_krb_ticket( machine_principal.second,
+                                                                machine_keytab, nullptr,
+                                                                krb_cc_name );
+                                 },
+                                 host_tgt );
     if ( result.first != 0 )
     {
-        std::cout << "ERROR: " << __func__ << ":" << __LINE__ << " invalid machine principal" << std::endl;
-        cf_logger.logger( LOG_ERR, "ERROR: %s:%d invalid machine principal", __func__, __LINE__ );
-        return result.first;
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot get machine krb ticket: %s", __func__,
+                          __LINE__, result.second.c_str() );
+        return -1;
     }
-    
-    // kinit -kt /etc/krb5.keytab  'EC2AMAZ-GG97ZL$'@CONTOSO.COM
-    std::transform( result.second.begin(), result.second.end(), result.second.begin(),
-                    []( unsigned char c ) { return std::toupper( c ); } );
-    std::string kinit_cmd = "kinit -kt /etc/krb5.keytab '" + result.second + "'";
-    result = exec_shell_cmd( kinit_cmd );
 
-    return result.first;
+    machine_ticket_timer.stop( true );
+    return 0;
 }
 
 /**
  * This function generates kerberos ticket with user credentials
  * User credentials must have adequate privileges to read gMSA passwords
- * This is an alternative to the machine credentials approach above
+ * This is an alternative to the machine credentials approach above.
+ * The ticket is kept in host_tgt_cache, the secret is only read from AWS
+ * Secrets Manager when a new ticket is needed.
  * @param cf_daemon - parent daemon object
+ * @param host_tgt - set to the user TGT, held until the ldap searches are done
  * @return error-code - 0 if successful
  */
 int get_user_krb_ticket( std::string domain_name, std::string aws_sm_secret_name,
+                         creds_fetcher::host_tgt_ref_t& host_tgt,
                          creds_fetcher::CF_logger& cf_logger )
 {
     std::pair<int, std::string> result;
-    int ret;
-
-    std::pair<int, std::string> cmd = exec_shell_cmd( "which hostname" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
-
-    cmd = exec_shell_cmd( "which realm" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
-
-    cmd = exec_shell_cmd( "which kinit" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
-
-    cmd = exec_shell_cmd( "which ldapsearch" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
 
-    if ( !check_file_permissions( install_path_for_decode_exe ) )
+    if ( !check_tool_path( "hostname" ) || !check_tool_path( "realm" ) )
     {
         return -1;
     }
@@ -242,78 +391,62 @@ int get_user_krb_ticket( std::string domain_name, std::string aws_sm_secret_name
         return -1;
     }
 
-    std::string command =
-        install_path_for_aws_cli + std::string( " secretsmanager get-secret-value --secret-id " ) + aws_sm_secret_name + " --query 'SecretString' --output text";
-    // /usr/bin/aws secretsmanager get-secret-value --secret-id aws/directoryservices/d-xxxxxxxxxx/gmsa --query 'SecretString' --output text
-    result = exec_shell_cmd( command );
-
-    // deserialize json to krb_ticket_info object
-    Json::Value root;
-    Json::CharReaderBuilder reader;
-    std::istringstream string_stream(result.second);
-    std::string errors;
-    Json::parseFromStream(reader, string_stream, &root, &errors);
-    // {"username":"user","password":"passw0rd"}
-    std::string username = root["username"].asString();
-    std::string password = root["password"].asString();
-
     std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
                     []( unsigned char c ) { return std::toupper( c ); } );
 
-    // kinit using api interface
-    char *kinit_argv[3];
-
-    kinit_argv[0] = (char *)"my_kinit";
-    username = username + "@" + domain_name;
-    kinit_argv[1] = (char *)username.c_str();
-    kinit_argv[2] = (char *)password.c_str();
-    ret = my_kinit_main(2, kinit_argv);
-#if 0
-    /* The old way */
-    std::string kinit_cmd = "echo '"  + password +  "' | kinit -V " + username + "@" +
-                            domain_name;
-    username = "xxxx";
-    password = "xxxx";
-    result = exec_shell_cmd( kinit_cmd );
-    kinit_cmd = "xxxx";
-    return result.first;
-#endif
+    result = host_tgt_cache.get(
+        "secret:" + aws_sm_secret_name + "@" + domain_name,
+        [&aws_sm_secret_name, &domain_name]( const std::string& krb_cc_name ) {
+            std::string command =
+                install_path_for_aws_cli + std::string( " secretsmanager get-secret-value --secret-id " ) + aws_sm_secret_name + " --query 'SecretString' --output text";
+            // /usr/bin/aws secretsmanager get-secret-value --secret-id aws/directoryservices/d-xxxxxxxxxx/gmsa --query 'SecretString' --output text
+            std::pair<int, std::string> secret_result = exec_shell_cmd( command );
+
+            // deserialize json to krb_ticket_info object
+            Json::Value root;
+            Json::CharReaderBuilder reader;
+            std::istringstream string_stream( secret_result.second );
+            std::string errors;
+            Json::parseFromStream( reader, string_stream, &root, &errors );
+            // {"username":"user","password":"passw0rd"}
+            std::string username = root["username"].asString();
+            std::string password = root["password"].asString();
+
+            // same as echo <password> | kinit <username>@<domain_name>
+            std::pair<int, std::string> kinit_result = acquire_krb_ticket(
+                username + "@" + domain_name, nullptr, password.c_str(), krb_cc_name );
+            OPENSSL_cleanse( &password[0], password.size() );
+            return kinit_result;
+        },
+        host_tgt );
+    if ( result.first != 0 )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot get user krb ticket: %s", __func__,
+                          __LINE__, result.second.c_str() );
+        return -1;
+    }
 
-    return ret;
+    return 0;
 }
 
 
 /**
  * This function generates kerberos ticket with user with access to gMSA password credentials
  * User credentials must have adequate privileges to read gMSA passwords
- * This is an alternative to the machine credentials approach above
+ * This is an alternative to the machine credentials approach above.
+ * The ticket is kept in host_tgt_cache, it is acquired again if the password changes.
  * @param cf_daemon - parent daemon object
+ * @param host_tgt - set to the user TGT, held until the ldap searches are done
  * @return error-code - 0 if successful
  */
 int get_domainless_user_krb_ticket( std::string domain_name, std::string username, std::string
                                                                                        password,
+                         creds_fetcher::host_tgt_ref_t& host_tgt,
                          creds_fetcher::CF_logger& cf_logger )
 {
     std::pair<int, std::string> result;
-    int ret;
-
-    std::pair<int, std::string> cmd = exec_shell_cmd( "which hostname" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
-
-    cmd = exec_shell_cmd( "which kinit" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
-    {
-        return -1;
-    }
 
-    cmd = exec_shell_cmd( "which ldapsearch" );
-    rtrim( cmd.second );
-    if ( !check_file_permissions( cmd.second ) )
+    if ( !check_tool_path( "hostname" ) )
     {
         return -1;
     }
@@ -321,19 +454,32 @@ int get_domainless_user_krb_ticket( std::string domain_name, std::string usernam
     std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
                     []( unsigned char c ) { return std::toupper( c ); } );
 
-    // kinit using api interface
-    char *kinit_argv[3];
-
-    kinit_argv[0] = (char *)"my_kinit";
     username = username + "@" + domain_name;
-    kinit_argv[1] = (char *)username.c_str();
-    kinit_argv[2] = (char *)password.c_str();
-    ret = my_kinit_main(2, kinit_argv);
+    // the cached ticket is only used with the password it was acquired with
+    gchar* password_digest =
+        g_compute_checksum_for_string( G_CHECKSUM_SHA256, password.c_str(), -1 );
+    std::string credentials_key = "user:" + username + ":" +
+                                  std::string( password_digest != nullptr ? password_digest : "" );
+    g_free( password_digest );
+
+    // same as echo <password> | kinit <username>@<domain_name>
+    result = host_tgt_cache.get( credentials_key,
+                                 [&username, &password]( const std::string& krb_cc_name ) {
+                                     return acquire_krb_ticket( username, nullptr,
+                                                                password.c_str(), krb_cc_name );
+                                 },
+                                 host_tgt );
     username = "xxxx";
     password = "xxxx";
+    if ( result.first != 0 )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot get user krb ticket: %s", __func__,
+                          __LINE__, result.second.c_str() );
+        return -1;
+    }
 
     //TODO: nit - return pair later
-    return ret;
+    return 0;
 }
 
 
@@ -343,7 +489,7 @@ int get_domainless_user_krb_ticket( std::string domain_name, std::string usernam
  * @param base64_decode_len - Length after decode
  * @return buffer with base64 decoded contents
  */
-static uint8_t* base64_decode( const std::string& password, gsize* base64_decode_len )
+uint8_t* base64_decode( const std::string& password, gsize* base64_decode_len )
 {
     if ( base64_decode_len == nullptr || password.empty() )
     {
@@ -375,7 +521,14 @@ static uint8_t* base64_decode( const std::string& password, gsize* base64_decode
     return (uint8_t*)secure_mem;
 }
 
-static std::pair<size_t, void*> find_password( std::string ldap_search_result )
+/**
+ * find_password - Find the msDS-ManagedPassword attribute in an ldap search result and
+ * decode it
+ * @param ldap_search_result - ldif lines of the search separated by '#'
+ * @return - pair of length and password blob, (0, nullptr) if not found. Free with
+ *           OPENSSL_free
+ */
+std::pair<size_t, void*> find_password( std::string ldap_search_result )
 {
     size_t base64_decode_len = 0;
     std::vector<std::string> results;
@@ -400,11 +553,19 @@ static std::pair<size_t, void*> find_password( std::string ldap_search_result )
     if ( password_found )
     {
         blob_base64_decoded = base64_decode( password, &base64_decode_len );
-        if ( blob_base64_decoded == nullptr )
-        {
-            std::cout << "ERROR: base64 buffer is null" << std::endl;
-            return std::make_pair( 0, nullptr );
-        }
+    }
+
+    // the base64 copies of the blob are not needed anymore
+    OPENSSL_cleanse( &password[0], password.length() );
+    for ( auto& result : results )
+    {
+        OPENSSL_cleanse( &result[0], result.length() );
+    }
+
+    if ( password_found && blob_base64_decoded == nullptr )
+    {
+        std::cout << "ERROR: base64 buffer is null" << std::endl;
+        return std::make_pair( 0, nullptr );
     }
 
     return std::make_pair( base64_decode_len, blob_base64_decoded );
@@ -425,8 +586,6 @@ int test_utf16_decode()
         "B4+wVbOUZuMXrKkDVh8XUOUBdGhznntRWnDM2DhwBoFEisBr133Vo8aRcedYqwNj/LEsrimEJaeuY"
         "AAAQCCBrPFgAABKQ3Z84WAAA= #";
 
-    uint8_t test_password_buf[1024];
-
     const uint8_t test_gmsa_utf8_password[] = {
         0xE8, 0xB3, 0x88, 0xE2, 0xAA, 0x84, 0xEB, 0xB8, 0x9F, 0xE5, 0x86, 0x8D, 0xE4, 0xA7, 0xA2,
         0xE6, 0x88, 0x95, 0xEF, 0xB5, 0xAE, 0xE1, 0xB1, 0xA9, 0xE5, 0x86, 0xAC, 0xEA, 0xB3, 0x83,
@@ -454,8 +613,6 @@ int test_utf16_decode()
         0xAB, 0x9D, 0xE6, 0xA4, 0xBC, 0xE1, 0xB8, 0x97, 0xE8, 0xA9, 0xB5, 0xE3, 0x9A, 0xB0, 0xEC,
         0xAC, 0xBF, 0xEC, 0xA8, 0x92, 0xE9, 0xA3, 0xA2, 0xE5, 0xA9, 0x82, 0xEE, 0x99, 0xBA };
 
-    std::string decoded_password_file = "./decoded_password_file";
-
     std::pair<size_t, void*> base64_decoded_password_blob =
         find_password( test_msds_managed_password );
     if ( base64_decoded_password_blob.first == 0 || base64_decoded_password_blob.second == nullptr )
@@ -463,64 +620,31 @@ int test_utf16_decode()
         return EXIT_FAILURE;
     }
 
-    struct stat st;
-    std::string decode_exe_path;
-
-    if ( stat( install_path_for_decode_exe.c_str(), &st ) == 0 )
-    {
-        decode_exe_path = install_path_for_decode_exe;
-    }
-    else
-    {
-        // For test during rpmbuild
-        decode_exe_path = "./decode.exe";
-    }
-
-    // Use decode.exe in build directory
-    std::string decode_cmd = decode_exe_path + std::string( "  > " ) + decoded_password_file;
-    creds_fetcher::blob_t* blob = ( (creds_fetcher::blob_t*)base64_decoded_password_blob.second );
-    FILE* fp = popen( decode_cmd.c_str(), "w" );
-    if ( fp == nullptr )
-    {
-        std::cout << "Self test failed" << std::endl;
-        OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-        OPENSSL_free( base64_decoded_password_blob.second );
-        return EXIT_FAILURE;
-    }
-    fwrite( blob->current_password, 1, GMSA_PASSWORD_SIZE, fp );
-    if ( pclose( fp ) < 0 )
-    {
-        std::cout << "Self test failed" << std::endl;
-        OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-        OPENSSL_free( base64_decoded_password_blob.second );
-        return EXIT_FAILURE;
-    }
+    std::pair<size_t, char*> utf8_password = get_gmsa_utf8_password(
+        base64_decoded_password_blob.second, base64_decoded_password_blob.first );
+    OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
+    OPENSSL_free( base64_decoded_password_blob.second );
 
-    fp = fopen( decoded_password_file.c_str(), "rb" );
-    if ( fp == nullptr )
+    if ( utf8_password.second == nullptr || utf8_password.first < GMSA_PASSWORD_SIZE )
     {
         std::cout << "Self test failed" << std::endl;
-        OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-        OPENSSL_free( base64_decoded_password_blob.second );
         return EXIT_FAILURE;
     }
-    fread( test_password_buf, 1, GMSA_PASSWORD_SIZE, fp );
 
-    if ( memcmp( test_gmsa_utf8_password, test_password_buf, GMSA_PASSWORD_SIZE ) == 0 )
+    int result = EXIT_FAILURE;
+    if ( memcmp( test_gmsa_utf8_password, utf8_password.second, GMSA_PASSWORD_SIZE ) == 0 )
     {
         // utf16->utf8 conversion works as expected
         std::cout << "Self test is successful" << std::endl;
-        OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-        OPENSSL_free( base64_decoded_password_blob.second );
-        unlink( decoded_password_file.c_str() );
-        return EXIT_SUCCESS;
+        result = EXIT_SUCCESS;
+    }
+    else
+    {
+        std::cout << "Self test failed" << std::endl;
     }
+    OPENSSL_clear_free( utf8_password.second, utf8_password.first );
 
-    std::cout << "Self test failed" << std::endl;
-    OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-    OPENSSL_free( base64_decoded_password_blob.second );
-    unlink( decoded_password_file.c_str() );
-    return EXIT_FAILURE;
+    return result;
 }
 
 /**
@@ -594,146 +718,591 @@ std::pair<int, std::string> get_fqdn_from_domain_ip( std::string domain_ip,
 }
 
 /**
- * This function fetches the gmsa password and creates a krb ticket
- * It uses the existing krb ticket of machine to run ldap query over
- * kerberos and do the appropriate UTF decoding.
- *
+ * Find the domain controllers of the domain, DOMAIN_CONTROLLER_GMSA from the ECS config
+ * takes precedence. The DNS SRV records are served from the domain controller cache,
+ * the forward and reverse lookups with dig are the fallback.
  * @param domain_name - Like 'contoso.com'
- * @param gmsa_account_name - Like 'webapp01'
- * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
  * @param cf_logger - log to systemd daemon
- * @return result code and kinit log, 0 if successful, -1 on failure
+ * @return result code and fqdns of the domain controllers like 'win-m744.contoso.com'
  */
-std::pair<int, std::string> get_gmsa_krb_ticket( std::string domain_name,
-                                                 const std::string& gmsa_account_name,
-                                                 const std::string& krb_cc_name,
-                                                 creds_fetcher::CF_logger& cf_logger )
+static std::pair<int, std::vector<std::string>> get_domain_controller_fqdns(
+    const std::string& domain_name, creds_fetcher::CF_logger& cf_logger )
 {
     std::string domain_controller_gmsa( "DOMAIN_CONTROLLER_GMSA" );
-    std::vector<std::string> results;
-
-    if ( domain_name.empty() || gmsa_account_name.empty() )
+    std::string fqdn;
+    fqdn = retrieve_secret_from_ecs_config(domain_controller_gmsa);
+    if ( !fqdn.empty() )
     {
-        cf_logger.logger( LOG_ERR, "ERROR: %s:%d null args", __func__, __LINE__ );
-        return std::make_pair( -1, std::string( "" ) );
+        return std::make_pair( EXIT_SUCCESS, std::vector<std::string>{ fqdn } );
     }
 
-    results = split_string(domain_name, '.');
-    std::string base_dn; /* Distinguished name */
-    for ( auto& result : results )
+    std::pair<int, std::vector<std::string>> domain_controllers =
+        domain_controller_cache.get_domain_controllers( domain_name );
+    if ( domain_controllers.first == 0 )
     {
-        base_dn += "DC=" + result + ",";
+        return domain_controllers;
     }
-    base_dn.pop_back(); // Remove last comma
-
 
-    std::string fqdn;
-    fqdn = retrieve_secret_from_ecs_config(domain_controller_gmsa);
-
-    if(fqdn.empty())
+    std::pair<int, std::vector<std::string>> domain_ips = get_domain_ips( domain_name );
+    if ( domain_ips.first != 0 )
     {
-        std::pair<int, std::vector<std::string>> domain_ips = get_domain_ips( domain_name );
-        if ( domain_ips.first != 0 )
-        {
-            cf_logger.logger( LOG_ERR, "ERROR: Cannot resolve domain IPs of %s", __func__, __LINE__,
-                              domain_name.c_str() );
-            return std::make_pair( -1, std::string( "" ) );
-        }
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d Cannot resolve domain IPs of %s", __func__,
+                          __LINE__, domain_name.c_str() );
+        return std::make_pair( -1, std::vector<std::string>() );
+    }
 
-        for ( auto domain_ip : domain_ips.second )
-        {
-            auto fqdn_result = get_fqdn_from_domain_ip( domain_ip, domain_name );
-            if ( fqdn_result.first == 0 )
-            {
-                fqdn = fqdn_result.second;
-                break;
-            }
-        }
-        if ( fqdn.empty() )
+    for ( auto domain_ip : domain_ips.second )
+    {
+        auto fqdn_result = get_fqdn_from_domain_ip( domain_ip, domain_name );
+        if ( fqdn_result.first == 0 )
         {
-            std::cout << "************ERROR***********" << std::endl;
-            return std::make_pair( -1, std::string( "" ) );
+            fqdn = fqdn_result.second;
+            break;
         }
     }
-
-    /**
-     * ldapsearch -H ldap://<fqdn> -b 'CN=webapp01,CN=Managed Service
-     *   Accounts,DC=contoso,DC=com' -s sub  "(objectClass=msDs-GroupManagedServiceAccount)"
-     *   msDS-ManagedPassword
-     */
-    std::string cmd = std::string( "ldapsearch -H ldap://" ) + fqdn;
-    cmd += std::string( " -b 'CN=" ) + gmsa_account_name +
-           std::string( ",CN=Managed Service Accounts," ) + base_dn + std::string( "'" ) +
-           std::string( " -s sub  \"(objectClass=msDs-GroupManagedServiceAccount)\" "
-                        " msDS-ManagedPassword" );
-
-    cf_logger.logger( LOG_INFO, "%s", cmd.c_str() );
-    std::cout << cmd << std::endl;
-    std::pair<int, std::string> ldap_search_result = exec_shell_cmd( cmd );
-    if ( ldap_search_result.first != 0 )
-    {
-        cf_logger.logger( LOG_ERR, "ERROR: %s:%d ldapsearch failed", __func__, __LINE__ );
-        return std::make_pair( -1, std::string( "" ) );
+    if ( fqdn.empty() )
+    {
+        std::cout << "************ERROR***********" << std::endl;
+        return std::make_pair( -1, std::vector<std::string>() );
     }
 
-    std::pair<size_t, void*> password_found_result = find_password( ldap_search_result.second );
+    return std::make_pair( EXIT_SUCCESS, std::vector<std::string>{ fqdn } );
+}
 
-    if ( password_found_result.first == 0 || password_found_result.second == nullptr )
+/**
+ * Read the msDS-ManagedPassword blob of a gMSA account of a domain. The search
+ * is sent over a bound ldap connection that is kept for the next calls.
+ *
+ * @param domain_name - Like 'contoso.com'
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param host_tgt - machine or user TGT to bind with, see get_machine_krb_ticket
+ * @param password - pair of length and password blob, (0, nullptr) if not found.
+ *                   Free with OPENSSL_clear_free
+ * @param cf_logger - log to systemd daemon
+ * @return result code, 0 if the domain controller could be searched, -1 on failure
+ */
+int fetch_gmsa_password( const std::string& domain_name, const std::string& gmsa_account_name,
+                         const creds_fetcher::host_tgt_ref_t& host_tgt,
+                         std::pair<size_t, void*>& password, creds_fetcher::CF_logger& cf_logger )
+{
+    password = std::make_pair( 0, nullptr );
+    if ( domain_name.empty() || gmsa_account_name.empty() || host_tgt == nullptr )
     {
-        std::cout << "ERROR: Password not found" << std::endl;
-        return std::make_pair( -1, std::string( "" ) );
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d null args", __func__, __LINE__ );
+        return -1;
     }
 
-    creds_fetcher::blob_t* blob = ( (creds_fetcher::blob_t*)password_found_result.second );
-    auto* blob_password = (uint8_t*)blob->current_password;
-
-    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
-                    []( unsigned char c ) { return std::toupper( c ); } );
-    std::string default_principal = "'" + gmsa_account_name + "$'" + "@" + domain_name;
-
-    /* Pipe password to the utf16 decoder and kinit */
-    std::string kinit_cmd = std::string("dotnet ") + std::string( install_path_for_decode_exe ) +
-                            std::string( " | kinit " ) + std::string( " -c " ) + krb_cc_name +
-                            " -V " + default_principal;
-    std::cout << kinit_cmd << std::endl;
-    FILE* fp = popen( kinit_cmd.c_str(), "w" );
-    if ( fp == nullptr )
-    {
-        perror( "kinit failed" );
-        OPENSSL_cleanse( password_found_result.second, password_found_result.first );
-        OPENSSL_free( password_found_result.second );
-        cf_logger.logger( LOG_ERR, "ERROR: %s:%d kinit failed", __func__, __LINE__ );
-        return std::make_pair( -1, std::string( "" ) );
+    std::vector<std::string> results = split_string( domain_name, '.' );
+    std::string base_dn; /* Distinguished name */
+    for ( auto& result : results )
+    {
+        base_dn += "DC=" + result + ",";
     }
-    fwrite( blob_password, 1, GMSA_PASSWORD_SIZE, fp );
-    int error_code = pclose( fp );
+    base_dn.pop_back(); // Remove last comma
 
-    // kinit output
-    std::cout << "kinit return value = " << error_code << std::endl;
+    creds_fetcher::StageTimer dc_discovery_timer( creds_fetcher::METRIC_DC_DISCOVERY );
+    std::pair<int, std::vector<std::string>> fqdns =
+        get_domain_controller_fqdns( domain_name, cf_logger );
+    dc_discovery_timer.stop( fqdns.first == 0 );
+    if ( fqdns.first != 0 )
+    {
+        creds_fetcher::HealthMonitor::instance().record_domain_controller(
+            domain_name, false, "cannot find the domain controllers" );
+        return -1;
+    }
 
-    OPENSSL_cleanse( password_found_result.second, password_found_result.first );
-    OPENSSL_free( password_found_result.second );
+    // try the domain controllers in SRV order until one answers
+    creds_fetcher::StageTimer ldap_search_timer( creds_fetcher::METRIC_LDAP_SEARCH );
+    int ret = LDAP_SERVER_DOWN;
+    for ( const auto& fqdn : fqdns.second )
+    {
+        cf_logger.logger( LOG_INFO, "ldap search of gMSA account %s on %s",
+                          gmsa_account_name.c_str(), fqdn.c_str() );
+        ret = ldap_connection_pool.search_gmsa_password( fqdn, base_dn, gmsa_account_name,
+                                                         host_tgt->krb_cc_name,
+                                                         host_tgt->credentials_key, password );
+        if ( ret == LDAP_SUCCESS )
+        {
+            break;
+        }
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d ldap search on %s failed: %s", __func__,
+                          __LINE__, fqdn.c_str(), ldap_err2string( ret ) );
+    }
+    ldap_search_timer.stop( ret == LDAP_SUCCESS );
+    // a domain controller that rejects the search still answered
+    bool reachable = ret != LDAP_SERVER_DOWN && ret != LDAP_TIMEOUT && ret != LDAP_CONNECT_ERROR;
+    creds_fetcher::HealthMonitor::instance().record_domain_controller(
+        domain_name, reachable, ret == LDAP_SUCCESS ? "" : ldap_err2string( ret ) );
+    if ( ret != LDAP_SUCCESS )
+    {
+        if ( !reachable )
+        {
+            // none of the domain controllers answered, look them up again next time
+            domain_controller_cache.invalidate( domain_name );
+        }
+        return -1;
+    }
 
-    return std::make_pair( error_code, krb_cc_name );
+    return 0;
 }
 
 /**
- * Parses the string that is a result of the klist command for the ticket experation date and time
- * @param klist_ticket_info  - String output of the klist command to parse
- * @return - returns the date and time of the ticket experation otherwise an empty string
+ * Copy the tickets of a ccache into another one, the destination is reinitialized
+ * @param src_cc_name - ccache holding the tickets
+ * @param dst_cc_name - ccache to copy the tickets to
+ * @return - krb5 error code, 0 if successful
  */
-std::string get_ticket_expiration( std::string klist_ticket_info )
+static krb5_error_code copy_krb_ccache( const std::string& src_cc_name,
+                                        const std::string& dst_cc_name )
 {
-    std::regex pattern(".+\n.{21}(.{19}).+");
-    std::smatch expires_match;
+    krb5_context context = nullptr;
+    krb5_ccache src_ccache = nullptr;
+    krb5_ccache dst_ccache = nullptr;
+    krb5_principal principal = nullptr;
 
-    if (!std::regex_search(klist_ticket_info, expires_match, pattern))
+    krb5_error_code ret = krb5_init_context( &context );
+    if ( ret != 0 )
     {
-        std::cout << "Unable to parse klist for ticket experation: " << klist_ticket_info << std::endl;
-        return std::string("");
+        return ret;
     }
 
-    return std::string(expires_match[1]);
+    ret = krb5_cc_resolve( context, src_cc_name.c_str(), &src_ccache );
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_get_principal( context, src_ccache, &principal );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_resolve( context, dst_cc_name.c_str(), &dst_ccache );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_initialize( context, dst_ccache, principal );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_copy_creds( context, src_ccache, dst_ccache );
+    }
+
+    if ( principal != nullptr )
+    {
+        krb5_free_principal( context, principal );
+    }
+    if ( dst_ccache != nullptr )
+    {
+        krb5_cc_close( context, dst_ccache );
+    }
+    if ( src_ccache != nullptr )
+    {
+        krb5_cc_close( context, src_ccache );
+    }
+    krb5_free_context( context );
+
+    return ret;
+}
+
+/**
+ * Destroy a ccache, used for the MEMORY ccaches the tickets are staged in
+ * @param krb_cc_name - ccache to destroy
+ */
+static void destroy_krb_ccache( const std::string& krb_cc_name )
+{
+    krb5_context context = nullptr;
+    krb5_ccache ccache = nullptr;
+
+    if ( krb5_init_context( &context ) != 0 )
+    {
+        return;
+    }
+    if ( krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache ) == 0 )
+    {
+        krb5_cc_destroy( context, ccache );
+    }
+    krb5_free_context( context );
+}
+
+/**
+ * @return - name of a new MEMORY ccache to stage tickets in before they are published
+ */
+static std::string get_staging_ccache_name()
+{
+    static std::atomic<uint64_t> staging_ccache_counter( 0 );
+    return "MEMORY:credentials_fetcher_staging_" + std::to_string( ++staging_ccache_counter );
+}
+
+/**
+ * @return - path of a FILE ccache, Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ */
+static std::string get_ccache_file_path( const std::string& krb_cc_name )
+{
+    const std::string file_prefix = "FILE:";
+    if ( krb_cc_name.compare( 0, file_prefix.size(), file_prefix ) == 0 )
+    {
+        return krb_cc_name.substr( file_prefix.size() );
+    }
+    return krb_cc_name;
+}
+
+/**
+ * Flush the entries of the directory of a file, a rename in it is only durable then
+ * @param file_path - file in the directory
+ * @return - 0 if successful, -1 otherwise
+ */
+static int fsync_parent_directory( const std::string& file_path )
+{
+    std::string dir_path = std::filesystem::path( file_path ).parent_path().string();
+    int dir_fd = open( dir_path.empty() ? "." : dir_path.c_str(), O_RDONLY | O_DIRECTORY );
+    if ( dir_fd < 0 )
+    {
+        return -1;
+    }
+    int ret = fsync( dir_fd );
+    close( dir_fd );
+
+    return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Replace a file through a temporary file in the same directory that is renamed over
+ * it, readers see either the old or the new contents but never a partial file. The
+ * permissions of the file being replaced are kept, a new file is only readable by the
+ * owner since it can hold kerberos credentials. The new contents are on disk, rename
+ * included, when 0 is returned.
+ * @param file_path - file to write
+ * @param contents - new contents of the file
+ * @return - 0 if successful, -1 otherwise
+ */
+int write_file_atomically( const std::string& file_path, const std::string& contents )
+{
+    std::string tmp_path = file_path + ".XXXXXX";
+    int fd = mkstemp( &tmp_path[0] );
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+
+    struct stat st;
+    mode_t mode = S_IRUSR | S_IWUSR;
+    if ( stat( file_path.c_str(), &st ) == 0 )
+    {
+        mode = st.st_mode & ( S_IRWXU | S_IRWXG | S_IRWXO );
+    }
+    bool is_written = ( fchmod( fd, mode ) == 0 );
+
+    size_t written = 0;
+    while ( is_written && written < contents.size() )
+    {
+        ssize_t n = write( fd, contents.data() + written, contents.size() - written );
+        if ( n < 0 )
+        {
+            is_written = ( errno == EINTR );
+            continue;
+        }
+        written += n;
+    }
+    is_written = is_written && ( fsync( fd ) == 0 );
+    is_written = ( close( fd ) == 0 ) && is_written;
+
+    if ( !is_written || rename( tmp_path.c_str(), file_path.c_str() ) != 0 )
+    {
+        unlink( tmp_path.c_str() );
+        return -1;
+    }
+
+    return fsync_parent_directory( file_path );
+}
+
+/**
+ * Serialize a ccache in the FILE ccache format, a temporary FILE ccache is written
+ * next to the ccache the tickets are published to and removed again
+ * @param src_cc_name - ccache holding the tickets, Like 'MEMORY:...'
+ * @param krb_cc_name - ccache the tickets are published to
+ * @return - pair of krb5 error code and the ccache file contents, 0 if successful
+ */
+static std::pair<int, std::string> serialize_krb_ccache( const std::string& src_cc_name,
+                                                         const std::string& krb_cc_name )
+{
+    std::string tmp_path = get_ccache_file_path( krb_cc_name ) + ".XXXXXX";
+    int fd = mkstemp( &tmp_path[0] );
+    if ( fd < 0 )
+    {
+        return std::make_pair( -1, std::string( "" ) );
+    }
+    close( fd );
+
+    std::string ccache_contents;
+    krb5_error_code ret = copy_krb_ccache( src_cc_name, "FILE:" + tmp_path );
+    if ( ret == 0 )
+    {
+        std::ifstream ccache_file( tmp_path, std::ios::binary );
+        ccache_contents.assign( std::istreambuf_iterator<char>( ccache_file ),
+                                std::istreambuf_iterator<char>() );
+        if ( ccache_file.bad() || ccache_contents.empty() )
+        {
+            ret = -1;
+        }
+    }
+    unlink( tmp_path.c_str() );
+
+    return std::make_pair( ret, ccache_contents );
+}
+
+/**
+ * Publish the tickets staged in a ccache to a FILE ccache in one rename, the
+ * containers reading the ccache never see it empty or half written
+ * @param src_cc_name - ccache holding the tickets, Like 'MEMORY:...'
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @return - pair of result and the ccache file contents, 0 if successful. The
+ *           contents can be published to other ccaches with write_file_atomically.
+ */
+static std::pair<int, std::string> publish_krb_ccache( const std::string& src_cc_name,
+                                                       const std::string& krb_cc_name )
+{
+    std::pair<int, std::string> ccache_contents =
+        serialize_krb_ccache( src_cc_name, krb_cc_name );
+    if ( ccache_contents.first != 0 )
+    {
+        return ccache_contents;
+    }
+    if ( write_file_atomically( get_ccache_file_path( krb_cc_name ), ccache_contents.second ) !=
+         0 )
+    {
+        return std::make_pair( -1, std::string( "" ) );
+    }
+    return ccache_contents;
+}
+
+/**
+ * Fetch the gmsa password and create the krb ticket, see get_gmsa_krb_ticket.
+ * The ticket is acquired into a MEMORY ccache and then published to krb_cc_name.
+ * @return result code and the published ccache file contents, 0 if successful
+ */
+static std::pair<int, std::string> acquire_gmsa_krb_ticket( std::string domain_name,
+                                                            const std::string& gmsa_account_name,
+                                                            const std::string& krb_cc_name,
+                                                            const creds_fetcher::host_tgt_ref_t&
+                                                                host_tgt,
+                                                            creds_fetcher::CF_logger& cf_logger )
+{
+    if ( domain_name.empty() || gmsa_account_name.empty() )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d null args", __func__, __LINE__ );
+        return std::make_pair( -1, std::string( "" ) );
+    }
+
+    std::pair<size_t, void*> password_found_result;
+    if ( fetch_gmsa_password( domain_name, gmsa_account_name, host_tgt, password_found_result,
+                              cf_logger ) != 0 )
+    {
+        return std::make_pair( -1, std::string( "" ) );
+    }
+
+    if ( password_found_result.first == 0 || password_found_result.second == nullptr )
+    {
+        std::cout << "ERROR: Password not found" << std::endl;
+        return std::make_pair( -1, std::string( "" ) );
+    }
+
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+    std::string default_principal = gmsa_account_name + "$" + "@" + domain_name;
+
+    /* Decode the utf16 password and kinit in-process */
+    creds_fetcher::StageTimer password_decode_timer( creds_fetcher::METRIC_PASSWORD_DECODE );
+    std::pair<size_t, char*> utf8_password =
+        get_gmsa_utf8_password( password_found_result.second, password_found_result.first );
+    password_decode_timer.stop( utf8_password.second != nullptr );
+
+    OPENSSL_cleanse( password_found_result.second, password_found_result.first );
+    OPENSSL_free( password_found_result.second );
+
+    if ( utf8_password.second == nullptr )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot decode gMSA password", __func__,
+                          __LINE__ );
+        return std::make_pair( -1, std::string( "" ) );
+    }
+
+    std::string staging_cc_name = get_staging_ccache_name();
+    creds_fetcher::StageTimer kinit_timer( creds_fetcher::METRIC_KINIT );
+    std::pair<int, std::string> kinit_result =
+        acquire_krb_ticket( default_principal, nullptr, utf8_password.second, staging_cc_name );
+    kinit_timer.stop( kinit_result.first == 0 );
+    OPENSSL_clear_free( utf8_password.second, utf8_password.first );
+
+    if ( kinit_result.first != 0 )
+    {
+        destroy_krb_ccache( staging_cc_name );
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d kinit failed for %s: %s", __func__, __LINE__,
+                          default_principal.c_str(), kinit_result.second.c_str() );
+        std::cout << "kinit return value = " << kinit_result.first << std::endl;
+        return std::make_pair( kinit_result.first, std::string( "" ) );
+    }
+
+    std::pair<int, std::string> publish_result = publish_krb_ccache( staging_cc_name, krb_cc_name );
+    destroy_krb_ccache( staging_cc_name );
+    if ( publish_result.first != 0 )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot write the ticket to %s", __func__,
+                          __LINE__, krb_cc_name.c_str() );
+        return std::make_pair( publish_result.first, std::string( "" ) );
+    }
+
+    return std::make_pair( EXIT_SUCCESS, publish_result.second );
+}
+
+/**
+ * This function fetches the gmsa password and creates a krb ticket
+ * It uses the krb ticket of the machine or user to run ldap query over
+ * kerberos and do the appropriate UTF decoding.
+ * Concurrent calls for the same gMSA account with the same machine or user
+ * credentials share one ldap search and kinit, the serialized ticket is then
+ * published to the ccache of each caller.
+ *
+ * @param domain_name - Like 'contoso.com'
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @param host_tgt - machine or user TGT to bind with, see get_machine_krb_ticket
+ * @param cf_logger - log to systemd daemon
+ * @return result code and ccache name, 0 if successful, -1 on failure
+ */
+std::pair<int, std::string> get_gmsa_krb_ticket( std::string domain_name,
+                                                 const std::string& gmsa_account_name,
+                                                 const std::string& krb_cc_name,
+                                                 const creds_fetcher::host_tgt_ref_t& host_tgt,
+                                                 creds_fetcher::CF_logger& cf_logger )
+{
+    creds_fetcher::StageTimer gmsa_ticket_timer( creds_fetcher::METRIC_GMSA_TICKET );
+    std::string principal = gmsa_account_name + "$@" + domain_name;
+    std::transform( principal.begin(), principal.end(), principal.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+
+    // a request binding with other credentials can be refused the password, it does
+    // not share the result of this one
+    std::string flight_key =
+        principal + "|" + ( host_tgt != nullptr ? host_tgt->credentials_key : "" );
+    std::pair<std::pair<int, std::string>, bool> flight_result = gmsa_ticket_flights.run(
+        flight_key, [&]() {
+            return acquire_gmsa_krb_ticket( domain_name, gmsa_account_name, krb_cc_name,
+                                            host_tgt, cf_logger );
+        } );
+    std::pair<int, std::string> gmsa_ticket_result = flight_result.first;
+    if ( gmsa_ticket_result.first != 0 )
+    {
+        return std::make_pair( gmsa_ticket_result.first, std::string( "" ) );
+    }
+
+    // the ticket was created by the concurrent request for the same account
+    if ( !flight_result.second )
+    {
+        if ( write_file_atomically( get_ccache_file_path( krb_cc_name ),
+                                    gmsa_ticket_result.second ) != 0 )
+        {
+            cf_logger.logger( LOG_ERR, "ERROR: %s:%d cannot write the ticket to %s", __func__,
+                              __LINE__, krb_cc_name.c_str() );
+            return std::make_pair( -1, std::string( "" ) );
+        }
+        cf_logger.logger( LOG_INFO, "gMSA ticket of %s shared with %s", principal.c_str(),
+                          krb_cc_name.c_str() );
+        creds_fetcher::Metrics::instance().increment( creds_fetcher::METRIC_GMSA_TICKET_SHARED );
+    }
+
+    gmsa_ticket_timer.stop( true );
+    return std::make_pair( EXIT_SUCCESS, krb_cc_name );
+}
+
+/**
+ * Read the lifetime of the TGT in a ccache, the gMSA service tickets are obtained with it
+ * @param context - krb5 context, shared when many ccaches are read
+ * @param krb_cc_name  - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @return - pair of result and ticket times, 0 if successful
+ */
+static std::pair<int, creds_fetcher::krb_ticket_times> read_ticket_times(
+    krb5_context context, const std::string& krb_cc_name )
+{
+    krb5_ccache ccache = nullptr;
+    krb5_cc_cursor cursor = nullptr;
+    krb5_creds creds;
+    creds_fetcher::krb_ticket_times ticket_times;
+
+    krb5_error_code ret = krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache );
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_start_seq_get( context, ccache, &cursor );
+    }
+    if ( ret == 0 )
+    {
+        while ( krb5_cc_next_cred( context, ccache, &cursor, &creds ) == 0 )
+        {
+            if ( !krb5_is_config_principal( context, creds.server ) &&
+                 creds.server->length == 2 && creds.server->data[0].length == KRB5_TGS_NAME_SIZE &&
+                 memcmp( creds.server->data[0].data, KRB5_TGS_NAME, KRB5_TGS_NAME_SIZE ) == 0 &&
+                 (time_t)creds.times.endtime > ticket_times.endtime )
+            {
+                ticket_times.endtime = creds.times.endtime;
+                ticket_times.renew_till = creds.times.renew_till;
+            }
+            krb5_free_cred_contents( context, &creds );
+        }
+        krb5_cc_end_seq_get( context, ccache, &cursor );
+    }
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( context, ccache );
+    }
+
+    if ( ret != 0 )
+    {
+        return std::make_pair( ret, ticket_times );
+    }
+    if ( ticket_times.endtime == 0 )
+    {
+        // no TGT in the ccache
+        return std::make_pair( -1, ticket_times );
+    }
+
+    return std::make_pair( EXIT_SUCCESS, ticket_times );
+}
+
+/**
+ * Lifetime of the TGT in a ccache, read with the krb5 api instead of parsing klist
+ * @param krb_cc_name  - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @return - pair of result and ticket times, 0 if successful
+ */
+std::pair<int, creds_fetcher::krb_ticket_times> get_ticket_times( const std::string& krb_cc_name )
+{
+    std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> ticket_times =
+        get_ticket_times( std::vector<std::string>{ krb_cc_name } );
+    return ticket_times[0];
+}
+
+/**
+ * Lifetime of the TGTs in many ccaches, one krb5 context is used for all of them
+ * @param krb_cc_names  - ccaches to read
+ * @return - pair of result and ticket times for each ccache, in the same order
+ */
+std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> get_ticket_times(
+    const std::vector<std::string>& krb_cc_names )
+{
+    std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> ticket_times;
+    ticket_times.reserve( krb_cc_names.size() );
+
+    krb5_context context = nullptr;
+    krb5_error_code ret = krb5_init_context( &context );
+    if ( ret != 0 )
+    {
+        ticket_times.assign( krb_cc_names.size(),
+                             std::make_pair( ret, creds_fetcher::krb_ticket_times() ) );
+        return ticket_times;
+    }
+
+    for ( const auto& krb_cc_name : krb_cc_names )
+    {
+        ticket_times.push_back( read_ticket_times( context, krb_cc_name ) );
+    }
+    krb5_free_context( context );
+
+    return ticket_times;
 }
 
 /**
@@ -742,69 +1311,228 @@ std::string get_ticket_expiration( std::string klist_ticket_info )
  * @return - is renewal needed - true or false
  */
 
-bool is_ticket_ready_for_renewal( creds_fetcher::krb_ticket_info* krb_ticket_info )
+bool is_ticket_ready_for_renewal( const creds_fetcher::krb_ticket_info& krb_ticket_info )
 {
-    std::string cmd = "export KRB5CCNAME=" + krb_ticket_info->krb_file_path + " &&  klist";
-    std::pair<int, std::string> krb_ticket_info_result = exec_shell_cmd( cmd );
-    if ( krb_ticket_info_result.first != 0 )
+    std::pair<int, creds_fetcher::krb_ticket_times> ticket_times =
+        get_ticket_times( krb_ticket_info.krb_file_path );
+    if ( ticket_times.first != 0 )
     {
         // we need to check if meta file exists to recreate the ticket
-        std::cout << "ERROR: klist failed for command " << cmd << std::endl;
+        std::cout << "ERROR: cannot read the ticket in " << krb_ticket_info.krb_file_path
+                  << std::endl;
         return false;
     }
 
-    std::vector<std::string> results;
+    // calculate the time difference in hours
+    double hours = std::difftime( ticket_times.second.endtime, time( nullptr ) ) / SECONDS_IN_HOUR;
 
-    results = split_string(krb_ticket_info_result.second, '#');
-    std::string renew_until = "renew until";
-    bool is_ready_for_renewal = false;
-    
-    for ( auto& result : results )
-    {
-        auto found = result.find( renew_until );
-        if ( found != std::string::npos )
-        {
-            std::string renewal_date_time;
+    // check of the ticket need to be renewed
+    return hours <= RENEW_TICKET_HOURS;
+}
 
-            renewal_date_time = get_ticket_expiration(result);
+/**
+ * Time when the ticket must be renewed, RENEW_TICKET_HOURS before the TGT in the ccache
+ * expires.
+ * @param krb_cc_name  - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @return - pair of result and renewal deadline, 0 if successful
+ */
+std::pair<int, time_t> get_ticket_renewal_deadline( const std::string& krb_cc_name )
+{
+    std::pair<int, creds_fetcher::krb_ticket_times> ticket_times = get_ticket_times( krb_cc_name );
+    if ( ticket_times.first != 0 )
+    {
+        return std::make_pair( ticket_times.first, 0 );
+    }
 
-            char renewal_date[80];
-            char renewal_time[80];
+    return std::make_pair( EXIT_SUCCESS,
+                           ticket_times.second.endtime - RENEW_TICKET_HOURS * SECONDS_IN_HOUR );
+}
 
-            sscanf( renewal_date_time.c_str(), "%s %s", renewal_date, renewal_time );
+/**
+ * Renew the TGT in a ccache with a TGS request, this is what 'kinit -R' does. It is a
+ * single round trip to the KDC, no ldap search or password is needed as long as the
+ * ticket is within its renewable lifetime.
+ * @param krb_cc_name  - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @return result pair(krb5 error-code - 0 if successful, error message), -1 if the
+ *         ticket can no longer be renewed and must be acquired again
+ */
+std::pair<int, std::string> renew_krb_ticket( const std::string& krb_cc_name )
+{
+    krb5_context context = nullptr;
+    krb5_ccache ccache = nullptr;
+    krb5_ccache staging_ccache = nullptr;
+    krb5_principal principal = nullptr;
+    krb5_creds creds;
+    bool have_creds = false;
+    std::string err_msg;
+
+    memset( &creds, 0, sizeof( creds ) );
+
+    krb5_error_code ret = krb5_init_context( &context );
+    if ( ret != 0 )
+    {
+        return std::make_pair( ret, std::string( "cannot initialize krb5 context" ) );
+    }
 
-            renew_until = std::string( renewal_date ) + " " + std::string( renewal_time );
-            // trim extra spaces
-            ltrim( renew_until );
-            rtrim( renew_until );
+    std::pair<int, creds_fetcher::krb_ticket_times> ticket_times =
+        read_ticket_times( context, krb_cc_name );
+    // a renewed ticket does not outlive renew_till, it would be due again right away
+    if ( ticket_times.first != 0 || ticket_times.second.endtime <= time( nullptr ) ||
+         ticket_times.second.renew_till <=
+             time( nullptr ) + RENEW_TICKET_HOURS * SECONDS_IN_HOUR )
+    {
+        krb5_free_context( context );
+        return std::make_pair( -1, std::string( "ticket is not renewable" ) );
+    }
 
-            // next renewal time for the ticket
-            struct tm tm;
+    ret = krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache );
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_get_principal( context, ccache, &principal );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_get_renewed_creds( context, &creds, principal, ccache, nullptr );
+        have_creds = ( ret == 0 );
+    }
+    // the renewed ticket is staged and published like a new one
+    std::string staging_cc_name = get_staging_ccache_name();
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_resolve( context, staging_cc_name.c_str(), &staging_ccache );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_initialize( context, staging_ccache, principal );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_store_cred( context, staging_ccache, &creds );
+    }
+    if ( ret == 0 )
+    {
+        ret = publish_krb_ccache( staging_cc_name, krb_cc_name ).first;
+    }
 
-            // if the string is not date time format, return false
-            if ( strptime( renew_until.c_str(), "%m/%d/%Y %T", &tm ) == NULL )
-                return false;
+    if ( ret != 0 )
+    {
+        const char* krb5_err_msg = krb5_get_error_message( context, ret );
+        err_msg = krb5_err_msg;
+        krb5_free_error_message( context, krb5_err_msg );
+        creds_fetcher::HealthMonitor::instance().record_kdc_error( krb_cc_name + ": " +
+                                                                   err_msg );
+    }
 
-            std::time_t next_renewal_time = mktime( &tm );
+    if ( have_creds )
+    {
+        krb5_free_cred_contents( context, &creds );
+    }
+    if ( staging_ccache != nullptr )
+    {
+        krb5_cc_destroy( context, staging_ccache );
+    }
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( context, ccache );
+    }
+    if ( principal != nullptr )
+    {
+        krb5_free_principal( context, principal );
+    }
+    krb5_free_context( context );
 
-            // get the current system time
-            std::time_t t = std::time( NULL );
-            std::tm* now = std::localtime( &t );
-            std::time_t current_time = mktime( now );
+    return std::make_pair( ret, err_msg );
+}
 
-            // calculate the time difference in hours
-            double hours = std::difftime( next_renewal_time, current_time ) / SECONDS_IN_HOUR;
+/**
+ * Ticket times diagnostic: a TGT stored in a memory ccache is found among the
+ * other credentials and its times are read back
+ * @return - 0 (pass) or 1 (fail)
+ */
+int test_ticket_times()
+{
+    krb5_context context = nullptr;
+    krb5_ccache ccache = nullptr;
+    krb5_principal client = nullptr;
+    const char* krb_cc_name = "MEMORY:credentials_fetcher_test_ticket_times";
+    const char* server_names[] = { "krbtgt/EXAMPLE.COM@EXAMPLE.COM",
+                                   "ldap/dc1.example.com@EXAMPLE.COM" };
+    const time_t endtimes[] = { 1700010000, 1700020000 };
+    int status = EXIT_FAILURE;
+
+    if ( krb5_init_context( &context ) != 0 )
+    {
+        return EXIT_FAILURE;
+    }
+    if ( krb5_cc_resolve( context, krb_cc_name, &ccache ) != 0 ||
+         krb5_parse_name( context, "WEBAPP01$@EXAMPLE.COM", &client ) != 0 ||
+         krb5_cc_initialize( context, ccache, client ) != 0 )
+    {
+        goto cleanup;
+    }
+    for ( int i = 0; i < 2; i++ )
+    {
+        krb5_creds creds;
+        memset( &creds, 0, sizeof( creds ) );
+        creds.client = client;
+        creds.times.endtime = endtimes[i];
+        creds.times.renew_till = endtimes[i] + SECONDS_IN_HOUR;
+        if ( krb5_parse_name( context, server_names[i], &creds.server ) != 0 )
+        {
+            goto cleanup;
+        }
+        krb5_error_code ret = krb5_cc_store_cred( context, ccache, &creds );
+        krb5_free_principal( context, creds.server );
+        if ( ret != 0 )
+        {
+            goto cleanup;
+        }
+    }
 
-            // check of the ticket need to be renewed
-            if ( hours <= RENEW_TICKET_HOURS )
-            {
-                is_ready_for_renewal = true;
-            }
-            break;
+    {
+        // the service ticket outlives the TGT and must not be picked up
+        std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> ticket_times =
+            get_ticket_times( std::vector<std::string>{ krb_cc_name, "MEMORY:not_found" } );
+        if ( ticket_times.size() == 2 && ticket_times[0].first == 0 &&
+             ticket_times[0].second.endtime == endtimes[0] &&
+             ticket_times[0].second.renew_till == endtimes[0] + SECONDS_IN_HOUR &&
+             ticket_times[1].first != 0 )
+        {
+            status = EXIT_SUCCESS;
         }
     }
 
-    return is_ready_for_renewal;
+cleanup:
+    if ( ccache != nullptr )
+    {
+        krb5_cc_destroy( context, ccache );
+    }
+    if ( client != nullptr )
+    {
+        krb5_free_principal( context, client );
+    }
+    krb5_free_context( context );
+
+    std::cout << "ticket times test is " << ( status == 0 ? "successful" : "failed" ) << std::endl;
+    return status;
+}
+
+/**
+ * Add the ticket of a lease to the renewal scheduler. A ticket whose deadline
+ * cannot be read is scheduled right away so that it gets recreated.
+ * @param krb_ticket_info - ticket information of the lease
+ */
+void schedule_krb_ticket_renewal( const creds_fetcher::krb_ticket_info& krb_ticket_info )
+{
+    // tickets of domainless leases are renewed by RenewNonDomainJoinedKerberosLease
+    if ( !krb_ticket_info.domainless_user.empty() )
+    {
+        return;
+    }
+
+    std::pair<int, time_t> deadline = get_ticket_renewal_deadline( krb_ticket_info.krb_file_path );
+    krb_renewal_scheduler.schedule( krb_ticket_info,
+                                    deadline.first == 0 ? deadline.second : time( nullptr ) );
 }
 
 /**
@@ -820,47 +1548,46 @@ std::list<std::string> renew_kerberos_tickets_domainless(std::string krb_files_d
                                                creds_fetcher::CF_logger& cf_logger )
 {
     std::list<std::string> renewed_krb_ticket_paths;
-    // identify the metadata files in the krb directory
-    std::vector<std::string> metadatafiles;
-    for ( std::filesystem::recursive_directory_iterator end, dir( krb_files_dir );
-          dir != end; ++dir )
-    {
-        auto path = dir->path();
-        if ( std::filesystem::is_regular_file( path ) )
-        {
-            // find the file with metadata extension
-            std::string filename = path.filename().string();
-            if ( !filename.empty() && filename.find( "_metadata" ) != std::string::npos )
-            {
-                std::string filepath = path.parent_path().string() + "/" + filename;
-                metadatafiles.push_back( filepath );
-            }
-        }
-    }
+    // user TGT the ldap searches bind with, acquired when a ticket needs a new gMSA password
+    creds_fetcher::host_tgt_ref_t host_tgt;
 
-    // read the information of service account from the files
-    for ( auto file_path : metadatafiles )
+    // refresh the kerberos tickets created in domainless mode with the user
+    if ( !username.empty() )
     {
-        std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list =
-            read_meta_data_json( file_path );
-
-        // refresh the kerberos tickets for the service accounts, if tickets ready for
-        // renewal
-        for ( auto krb_ticket : krb_ticket_info_list )
+        for ( auto& domainless_ticket : lease_registry.get_tickets_by_domainless_user( username ) )
         {
-            std::string domainlessuser = krb_ticket->domainless_user;
+            const creds_fetcher::krb_ticket_info& krb_ticket = domainless_ticket;
+            std::string domainlessuser = krb_ticket.domainless_user;
             if(!username.empty()  && username == domainlessuser)
             {
                 std::pair<int, std::string> gmsa_ticket_result;
-                std::string krb_cc_name = krb_ticket->krb_file_path;
+                std::string krb_cc_name = krb_ticket.krb_file_path;
+                // a TGS renewal is enough while the ticket is within its renewable lifetime
+                if ( renew_krb_ticket( krb_cc_name ).first == 0 )
+                {
+                    renewed_krb_ticket_paths.push_back( krb_cc_name );
+                    continue;
+                }
                 // gMSA kerberos ticket generation needs to have ldap over kerberos
                 // if the ticket exists for the machine/user already reuse it for getting gMSA password else retry the ticket creation again after generating user/machine kerberos ticket
                 int num_retries = 2;
                 for ( int i = 0; i < num_retries; i++ )
                 {
-                    gmsa_ticket_result = get_gmsa_krb_ticket( krb_ticket->domain_name,
-                                                              krb_ticket->service_account_name,
-                                                              krb_cc_name, cf_logger );
+                    if ( host_tgt == nullptr )
+                    {
+                        int status = get_domainless_user_krb_ticket( domain_name, username,
+                                                                     password, host_tgt,
+                                                                     cf_logger );
+                        if ( status < 0 )
+                        {
+                            cf_logger.logger( LOG_ERR, "Error %d: Cannot get user krb ticket",
+                                              status );
+                            break;
+                        }
+                    }
+                    gmsa_ticket_result = get_gmsa_krb_ticket( krb_ticket.domain_name,
+                                                              krb_ticket.service_account_name,
+                                                              krb_cc_name, host_tgt, cf_logger );
                     if ( gmsa_ticket_result.first != 0 )
                     {
                         if ( num_retries == 0 )
@@ -869,25 +1596,20 @@ std::list<std::string> renew_kerberos_tickets_domainless(std::string krb_files_d
                                               "WARNING: Cannot get gMSA krb ticket "
                                               "because of expired user/machine ticket, "
                                               "will be retried automatically, service_account_name = %s",
-                                              krb_ticket->service_account_name.c_str() );
+                                              krb_ticket.service_account_name.c_str() );
                         }
                         else
                         {
                             cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
-                                                krb_ticket->service_account_name.c_str() );
+                                                krb_ticket.service_account_name.c_str() );
                         }
                         // if tickets are created in domainless mode
-                        std::string domainless_user = krb_ticket->domainless_user;
+                        std::string domainless_user = krb_ticket.domainless_user;
                         if ( !domainless_user.empty() && domainless_user == username )
                         {
-                            int status = get_domainless_user_krb_ticket( domain_name, username,
-                                                                         password, cf_logger );
-
-                            if ( status < 0 )
-                            {
-                                cf_logger.logger( LOG_ERR, "Error %d: Cannot get user krb ticket",
-                                                  status );
-                            }
+                            // the user ticket can have been rejected, get a new one
+                            host_tgt_cache.invalidate( host_tgt );
+                            host_tgt.reset();
                         }
                         else
                         {
@@ -921,54 +1643,40 @@ std::vector<std::string> delete_krb_tickets( std::string krb_files_dir, std::str
 
     std::string krb_tickets_path = krb_files_dir + "/" + lease_id;
 
-    DIR* curr_dir;
-    struct dirent* file;
-    // open the directory
-    curr_dir = opendir( krb_tickets_path.c_str() );
     try
     {
-        if ( curr_dir )
+        std::vector<creds_fetcher::krb_ticket_info> krb_tickets =
+            lease_registry.remove_lease( lease_id );
+        if ( krb_tickets.empty() )
         {
-            while ( ( file = readdir( curr_dir ) ) != NULL )
-            {
-                std::string filename = file->d_name;
-                if ( !filename.empty() && filename.find( "_metadata" ) != std::string::npos )
-                {
-                    std::string file_path = krb_tickets_path + "/" + filename;
-                    std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list =
-                        read_meta_data_json( file_path );
+            // the lease is not in the registry, read its metadata file
+            std::string file_path = krb_tickets_path + "/" + lease_id + METADATA_FILE_SUFFIX;
+            krb_tickets = read_meta_data_json( file_path );
+        }
 
-                    for ( auto krb_ticket : krb_ticket_info_list )
-                    {
-                        std::string krb_file_path = krb_ticket->krb_file_path;
-                        std::string cmd = "export KRB5CCNAME=" + krb_file_path + " && kdestroy";
+        for ( const auto& krb_ticket : krb_tickets )
+        {
+            std::string krb_file_path = krb_ticket.krb_file_path;
+            std::string cmd = "export KRB5CCNAME=" + krb_file_path + " && kdestroy";
 
-                        std::pair<int, std::string> krb_ticket_destroy_result =
-                            exec_shell_cmd( cmd );
-                        if ( krb_ticket_destroy_result.first == 0 )
-                        {
-                            delete_krb_ticket_paths.push_back( krb_file_path );
-                        }
-                        else
-                        {
-                            // log ticket deletion failure
-                            std::cout << "Delete kerberos ticket failed" + krb_file_path
-                                      << std::endl;
-                        }
-                    }
-                }
+            std::pair<int, std::string> krb_ticket_destroy_result = exec_shell_cmd( cmd );
+            if ( krb_ticket_destroy_result.first == 0 )
+            {
+                delete_krb_ticket_paths.push_back( krb_file_path );
+            }
+            else
+            {
+                // log ticket deletion failure
+                std::cout << "Delete kerberos ticket failed" + krb_file_path << std::endl;
             }
-            // close directory
-            closedir( curr_dir );
-
-            // finally delete lease file and directory
-            std::filesystem::remove_all( krb_tickets_path );
         }
+
+        // finally delete lease file and directory
+        std::filesystem::remove_all( krb_tickets_path );
     }
     catch ( ... )
     {
         fprintf( stderr, SD_CRIT "deleting kerberos tickets failed" );
-        closedir( curr_dir );
         return delete_krb_ticket_paths;
     }
     return delete_krb_ticket_paths;
@@ -0,0 +1,299 @@
+#include "ldap_client.h"
+#include <cstring>
+#include <gssapi/gssapi_krb5.h>
+#include <openssl/crypto.h>
+#include <sasl/sasl.h>
+
+static const char* gmsa_password_attribute = "msDS-ManagedPassword";
+static const char* gmsa_search_filter = "(objectClass=msDs-GroupManagedServiceAccount)";
+
+/**
+ * GSSAPI does not prompt for anything, accept the defaults
+ */
+static int sasl_interact( LDAP* ld, unsigned flags, void* defaults, void* sasl_interact_list )
+{
+    auto* interact = (sasl_interact_t*)sasl_interact_list;
+    while ( interact != nullptr && interact->id != SASL_CB_LIST_END )
+    {
+        interact->result = interact->defresult ? interact->defresult : "";
+        interact->len = interact->defresult ? strlen( interact->defresult ) : 0;
+        interact++;
+    }
+
+    return LDAP_SUCCESS;
+}
+
+/**
+ * Escape the characters that are special in a distinguished name (RFC 4514)
+ * @param value - attribute value such as 'webapp01'
+ * @return - escaped value
+ */
+static std::string escape_dn_value( const std::string& value )
+{
+    std::string escaped;
+    for ( char c : value )
+    {
+        if ( strchr( ",+\"\\<>;=#", c ) != nullptr )
+        {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+/**
+ * Connect and bind to the domain controller with SASL/GSSAPI
+ * @param fqdn - domain controller such as 'win-m744.contoso.com'
+ * @param krb_cc_name - ccache holding the TGT to bind with
+ * @return - pair of ldap error code and bound connection
+ */
+static std::pair<int, LDAP*> ldap_connect( const std::string& fqdn,
+                                           const std::string& krb_cc_name )
+{
+    LDAP* ld = nullptr;
+    std::string uri = "ldap://" + fqdn;
+
+    int ret = ldap_initialize( &ld, uri.c_str() );
+    if ( ret != LDAP_SUCCESS )
+    {
+        return std::make_pair( ret, nullptr );
+    }
+
+    int protocol_version = LDAP_VERSION3;
+    struct timeval network_timeout = { LDAP_NETWORK_TIMEOUT_SECONDS, 0 };
+    ldap_set_option( ld, LDAP_OPT_PROTOCOL_VERSION, &protocol_version );
+    ldap_set_option( ld, LDAP_OPT_REFERRALS, LDAP_OPT_OFF );
+    ldap_set_option( ld, LDAP_OPT_NETWORK_TIMEOUT, &network_timeout );
+
+    // the GSSAPI ccache is set for the calling thread only, the binds of other threads
+    // with other credentials are not affected
+    OM_uint32 minor_status = 0;
+    if ( gss_krb5_ccache_name( &minor_status, krb_cc_name.c_str(), nullptr ) != GSS_S_COMPLETE )
+    {
+        ldap_unbind_ext_s( ld, nullptr, nullptr );
+        return std::make_pair( LDAP_LOCAL_ERROR, nullptr );
+    }
+
+    // same as KRB5CCNAME=<krb_cc_name> ldapsearch -Y GSSAPI
+    ret = ldap_sasl_interactive_bind_s( ld, nullptr, "GSSAPI", nullptr, nullptr, LDAP_SASL_QUIET,
+                                        sasl_interact, nullptr );
+    gss_krb5_ccache_name( &minor_status, nullptr, nullptr );
+    if ( ret != LDAP_SUCCESS )
+    {
+        ldap_unbind_ext_s( ld, nullptr, nullptr );
+        return std::make_pair( ret, nullptr );
+    }
+
+    return std::make_pair( LDAP_SUCCESS, ld );
+}
+
+/**
+ * Copy the password from the search result, the ldap buffers are cleansed
+ * @return - pair of length and password blob allocated with OPENSSL_malloc
+ */
+static std::pair<size_t, void*> get_password_from_entry( LDAP* ld, LDAPMessage* search_result )
+{
+    LDAPMessage* entry = ldap_first_entry( ld, search_result );
+    if ( entry == nullptr )
+    {
+        return std::make_pair( 0, nullptr );
+    }
+
+    struct berval** values = ldap_get_values_len( ld, entry, gmsa_password_attribute );
+    if ( values == nullptr )
+    {
+        return std::make_pair( 0, nullptr );
+    }
+
+    std::pair<size_t, void*> password = std::make_pair( 0, nullptr );
+    if ( values[0] != nullptr && values[0]->bv_len > 0 )
+    {
+        void* secure_mem = OPENSSL_malloc( values[0]->bv_len );
+        if ( secure_mem != nullptr )
+        {
+            memcpy( secure_mem, values[0]->bv_val, values[0]->bv_len );
+            password = std::make_pair( (size_t)values[0]->bv_len, secure_mem );
+        }
+    }
+    for ( int i = 0; values[i] != nullptr; i++ )
+    {
+        OPENSSL_cleanse( values[i]->bv_val, values[i]->bv_len );
+    }
+    ldap_value_free_len( values );
+
+    return password;
+}
+
+/**
+ * Search the msDS-ManagedPassword of a gMSA account
+ * @param password - pair of length and password blob, (0, nullptr) if not found
+ * @return - 0 if the search completed, ldap error code otherwise
+ */
+static int gmsa_search( LDAP* ld, const std::string& base_dn, const std::string& gmsa_account_name,
+                        std::pair<size_t, void*>& password )
+{
+    char* attributes[] = { (char*)gmsa_password_attribute, nullptr };
+
+    /**
+     * Same as ldapsearch -b 'CN=webapp01,CN=Managed Service Accounts,DC=contoso,DC=com'
+     *   -s sub "(objectClass=msDs-GroupManagedServiceAccount)" msDS-ManagedPassword
+     */
+    std::string search_base = "CN=" + escape_dn_value( gmsa_account_name ) +
+                              ",CN=Managed Service Accounts," + base_dn;
+    int msgid = -1;
+    int ret = ldap_search_ext( ld, search_base.c_str(), LDAP_SCOPE_SUBTREE, gmsa_search_filter,
+                               attributes, 0, nullptr, nullptr, nullptr, LDAP_NO_LIMIT, &msgid );
+    if ( ret != LDAP_SUCCESS )
+    {
+        return ret;
+    }
+
+    LDAPMessage* search_result = nullptr;
+    struct timeval search_timeout = { LDAP_SEARCH_TIMEOUT_SECONDS, 0 };
+    int result_type = ldap_result( ld, msgid, LDAP_MSG_ALL, &search_timeout, &search_result );
+    if ( result_type <= 0 )
+    {
+        ldap_msgfree( search_result );
+        ldap_abandon_ext( ld, msgid, nullptr, nullptr );
+        return ( result_type == 0 ) ? LDAP_TIMEOUT : LDAP_SERVER_DOWN;
+    }
+
+    // an account that is not found does not make the connection unusable
+    int search_ret = LDAP_SUCCESS;
+    ldap_parse_result( ld, search_result, &search_ret, nullptr, nullptr, nullptr, nullptr, 0 );
+    if ( search_ret == LDAP_SUCCESS )
+    {
+        password = get_password_from_entry( ld, search_result );
+    }
+    ldap_msgfree( search_result );
+
+    return LDAP_SUCCESS;
+}
+
+creds_fetcher::LdapConnectionPool::LdapConnectionPool( size_t max_idle_connections,
+                                                       int idle_timeout_seconds )
+    : max_idle_connections_( max_idle_connections ), idle_timeout_seconds_( idle_timeout_seconds )
+{
+}
+
+creds_fetcher::LdapConnectionPool::~LdapConnectionPool()
+{
+    clear();
+}
+
+void creds_fetcher::LdapConnectionPool::clear()
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    for ( auto& server : idle_connections_ )
+    {
+        for ( auto& connection : server.second )
+        {
+            ldap_unbind_ext_s( connection.ld, nullptr, nullptr );
+        }
+    }
+    idle_connections_.clear();
+}
+
+/**
+ * Take an idle connection for the key or bind a new one
+ * @param krb_cc_name - ccache to bind a new connection with
+ * @param reused - set to true if the connection was taken from the pool
+ */
+std::pair<int, LDAP*> creds_fetcher::LdapConnectionPool::checkout( const std::string& key,
+                                                                   const std::string& fqdn,
+                                                                   const std::string& krb_cc_name,
+                                                                   bool& reused )
+{
+    std::vector<LDAP*> expired;
+    LDAP* ld = nullptr;
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        auto& connections = idle_connections_[key];
+        time_t now = time( nullptr );
+        while ( !connections.empty() )
+        {
+            ldap_connection_t connection = connections.back();
+            connections.pop_back();
+            if ( now - connection.last_used > idle_timeout_seconds_ )
+            {
+                expired.push_back( connection.ld );
+                continue;
+            }
+            ld = connection.ld;
+            break;
+        }
+    }
+
+    // unbind outside the lock, it can block on the network
+    for ( LDAP* expired_ld : expired )
+    {
+        ldap_unbind_ext_s( expired_ld, nullptr, nullptr );
+    }
+
+    reused = ( ld != nullptr );
+    if ( ld != nullptr )
+    {
+        return std::make_pair( LDAP_SUCCESS, ld );
+    }
+
+    return ldap_connect( fqdn, krb_cc_name );
+}
+
+void creds_fetcher::LdapConnectionPool::checkin( const std::string& key, LDAP* ld )
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        auto& connections = idle_connections_[key];
+        if ( connections.size() < max_idle_connections_ )
+        {
+            connections.push_back( { ld, time( nullptr ) } );
+            return;
+        }
+    }
+
+    ldap_unbind_ext_s( ld, nullptr, nullptr );
+}
+
+int creds_fetcher::LdapConnectionPool::search_gmsa_password(
+    const std::string& fqdn, const std::string& base_dn, const std::string& gmsa_account_name,
+    const std::string& krb_cc_name, const std::string& credentials_key,
+    std::pair<size_t, void*>& password )
+{
+    password = std::make_pair( 0, nullptr );
+    if ( fqdn.empty() || gmsa_account_name.empty() )
+    {
+        return fqdn.empty() ? LDAP_CONNECT_ERROR : LDAP_SUCCESS;
+    }
+
+    // a connection is only reused by the searches with the credentials it was bound with
+    std::string key = fqdn + "|" + credentials_key;
+
+    // a pooled connection can have been closed by the server, retry once with a new bind
+    for ( int attempt = 0; attempt < 2; attempt++ )
+    {
+        bool reused = false;
+        std::pair<int, LDAP*> connection = checkout( key, fqdn, krb_cc_name, reused );
+        if ( connection.first != LDAP_SUCCESS )
+        {
+            return connection.first;
+        }
+
+        // the password is only set when the search completed
+        int ret = gmsa_search( connection.second, base_dn, gmsa_account_name, password );
+        if ( ret == LDAP_SUCCESS )
+        {
+            checkin( key, connection.second );
+            return LDAP_SUCCESS;
+        }
+
+        ldap_unbind_ext_s( connection.second, nullptr, nullptr );
+        if ( !reused )
+        {
+            return ret;
+        }
+    }
+
+    return LDAP_SERVER_DOWN;
+}
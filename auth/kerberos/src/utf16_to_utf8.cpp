@@ -0,0 +1,275 @@
+#include "daemon.h"
+#include <algorithm>
+#include <cstring>
+#include <openssl/crypto.h>
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+/**
+ * The gMSA password is 256 bytes of random UTF-16LE, most code units need 3 bytes
+ * in UTF-8. The fast path converts 8 code units at a time when they are all ASCII
+ * or all 3-byte characters, anything else (surrogates, NUL, mixed widths) goes
+ * through the scalar conversion.
+ */
+#define UTF16_BLOCK_UNITS 8
+
+// A UTF-16 code unit takes at most 3 bytes in UTF-8 (surrogate pairs take 4 bytes for 2 units)
+#define UTF8_BYTES_PER_UTF16_UNIT 3
+
+static inline uint32_t read_utf16_unit( const uint8_t* utf16_buf, size_t i )
+{
+    return utf16_buf[2 * i] | ( utf16_buf[2 * i + 1] << 8 );
+}
+
+/**
+ * Convert one code point (or surrogate pair) at index i
+ * @param utf16_buf - UTF-16LE input
+ * @param num_units - number of code units in utf16_buf
+ * @param i - index of the code unit, advanced past the converted units
+ * @param out - output position, advanced past the written bytes
+ * @return - false when a NUL code unit is found
+ */
+static inline bool utf16_unit_to_utf8( const uint8_t* utf16_buf, size_t num_units, size_t& i,
+                                       uint8_t*& out )
+{
+    uint32_t c = read_utf16_unit( utf16_buf, i );
+    if ( c == 0 )
+    {
+        return false;
+    }
+    i++;
+
+    if ( c >= 0xD800 && c <= 0xDBFF && i < num_units )
+    {
+        uint32_t low = read_utf16_unit( utf16_buf, i );
+        if ( low >= 0xDC00 && low <= 0xDFFF )
+        {
+            c = 0x10000 + ( ( c - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+            i++;
+        }
+    }
+    // Unpaired surrogates are replaced with U+FFFD, this is what the .NET decoder did
+    if ( c >= 0xD800 && c <= 0xDFFF )
+    {
+        c = 0xFFFD;
+    }
+
+    if ( c < 0x80 )
+    {
+        *out++ = c;
+    }
+    else if ( c < 0x800 )
+    {
+        *out++ = 0xC0 | ( c >> 6 );
+        *out++ = 0x80 | ( c & 0x3F );
+    }
+    else if ( c < 0x10000 )
+    {
+        *out++ = 0xE0 | ( c >> 12 );
+        *out++ = 0x80 | ( ( c >> 6 ) & 0x3F );
+        *out++ = 0x80 | ( c & 0x3F );
+    }
+    else
+    {
+        *out++ = 0xF0 | ( c >> 18 );
+        *out++ = 0x80 | ( ( c >> 12 ) & 0x3F );
+        *out++ = 0x80 | ( ( c >> 6 ) & 0x3F );
+        *out++ = 0x80 | ( c & 0x3F );
+    }
+
+    return true;
+}
+
+#if defined( __x86_64__ )
+/**
+ * Convert 8 code units that are all in U+0800..U+FFFF (no surrogates) to 24 bytes
+ * @param units - 8 UTF-16 code units
+ * @param out - 24 bytes of output
+ */
+__attribute__( ( target( "ssse3" ) ) ) static inline void utf16_block_to_utf8_3byte(
+    __m128i units, uint8_t* out )
+{
+    const __m128i mask_3f = _mm_set1_epi16( 0x3F );
+    __m128i b0 = _mm_or_si128( _mm_srli_epi16( units, 12 ), _mm_set1_epi16( 0xE0 ) );
+    __m128i b1 = _mm_or_si128( _mm_and_si128( _mm_srli_epi16( units, 6 ), mask_3f ),
+                               _mm_set1_epi16( 0x80 ) );
+    __m128i b2 = _mm_or_si128( _mm_and_si128( units, mask_3f ), _mm_set1_epi16( 0x80 ) );
+
+    // lead0..lead7 cont1_0..cont1_7 and cont2_0..cont2_7 (twice)
+    __m128i b01 = _mm_packus_epi16( b0, b1 );
+    __m128i b22 = _mm_packus_epi16( b2, b2 );
+
+    // interleave to lead0 cont1_0 cont2_0 lead1 ..., -1 zeroes the byte
+    const __m128i shuffle_lo_01 =
+        _mm_setr_epi8( 0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5 );
+    const __m128i shuffle_lo_22 =
+        _mm_setr_epi8( -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1 );
+    const __m128i shuffle_hi_01 =
+        _mm_setr_epi8( 13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+    const __m128i shuffle_hi_22 =
+        _mm_setr_epi8( -1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1 );
+
+    __m128i lo = _mm_or_si128( _mm_shuffle_epi8( b01, shuffle_lo_01 ),
+                               _mm_shuffle_epi8( b22, shuffle_lo_22 ) );
+    __m128i hi = _mm_or_si128( _mm_shuffle_epi8( b01, shuffle_hi_01 ),
+                               _mm_shuffle_epi8( b22, shuffle_hi_22 ) );
+
+    _mm_storeu_si128( (__m128i*)out, lo );
+    _mm_storel_epi64( (__m128i*)( out + 16 ), hi );
+}
+
+/**
+ * SIMD conversion of whole blocks, stops at the first block that needs the scalar path
+ * @return - number of code units converted
+ */
+__attribute__( ( target( "ssse3" ) ) ) static size_t utf16_blocks_to_utf8_ssse3(
+    const uint8_t* utf16_buf, size_t num_units, uint8_t*& out )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sign_flip = _mm_set1_epi16( (short)0x8000 );
+    size_t i = 0;
+
+    while ( i + UTF16_BLOCK_UNITS <= num_units )
+    {
+        __m128i units = _mm_loadu_si128( (const __m128i*)( utf16_buf + 2 * i ) );
+
+        // unsigned 16-bit compares through signed compares of the sign flipped values
+        __m128i flipped = _mm_xor_si128( units, sign_flip );
+        __m128i is_nul = _mm_cmpeq_epi16( units, zero );
+        __m128i is_ascii =
+            _mm_cmplt_epi16( flipped, _mm_xor_si128( _mm_set1_epi16( 0x80 ), sign_flip ) );
+        __m128i is_3byte =
+            _mm_cmpgt_epi16( flipped, _mm_xor_si128( _mm_set1_epi16( 0x7FF ), sign_flip ) );
+        __m128i is_surrogate = _mm_cmpeq_epi16( _mm_and_si128( units, _mm_set1_epi16( (short)0xF800 ) ),
+                                                _mm_set1_epi16( (short)0xD800 ) );
+
+        if ( _mm_movemask_epi8( is_nul ) != 0 )
+        {
+            break;
+        }
+        if ( _mm_movemask_epi8( is_ascii ) == 0xFFFF )
+        {
+            _mm_storel_epi64( (__m128i*)out, _mm_packus_epi16( units, units ) );
+            out += UTF16_BLOCK_UNITS;
+        }
+        else if ( _mm_movemask_epi8( _mm_andnot_si128( is_surrogate, is_3byte ) ) == 0xFFFF )
+        {
+            utf16_block_to_utf8_3byte( units, out );
+            out += UTF16_BLOCK_UNITS * 3;
+        }
+        else
+        {
+            break;
+        }
+        i += UTF16_BLOCK_UNITS;
+    }
+
+    return i;
+}
+#endif
+
+/**
+ * Convert UTF-16LE to UTF-8, the conversion stops at the first NUL code unit
+ * @param utf16_buf - UTF-16LE input
+ * @param utf16_len - length of utf16_buf in bytes
+ * @param utf8_buf - output, must hold 3 bytes per UTF-16 code unit plus the NUL terminator
+ * @return - length of the NUL terminated UTF-8 output
+ */
+size_t utf16le_to_utf8( const uint8_t* utf16_buf, size_t utf16_len, uint8_t* utf8_buf )
+{
+    uint8_t* out = utf8_buf;
+    size_t num_units = utf16_len / 2;
+    size_t i = 0;
+
+#if defined( __x86_64__ )
+    static const bool have_ssse3 = __builtin_cpu_supports( "ssse3" );
+#endif
+
+    while ( i < num_units )
+    {
+#if defined( __x86_64__ )
+        if ( have_ssse3 )
+        {
+            i += utf16_blocks_to_utf8_ssse3( utf16_buf + 2 * i, num_units - i, out );
+            if ( i >= num_units )
+            {
+                break;
+            }
+        }
+#endif
+        // scalar conversion of the block that cannot take the fast path
+        size_t block_end = std::min( i + UTF16_BLOCK_UNITS, num_units );
+        bool found_nul = false;
+        while ( i < block_end )
+        {
+            if ( !utf16_unit_to_utf8( utf16_buf, num_units, i, out ) )
+            {
+                found_nul = true;
+                break;
+            }
+        }
+        if ( found_nul )
+        {
+            break;
+        }
+    }
+    *out = 0;
+
+    return out - utf8_buf;
+}
+
+/**
+ * Get the current password of a msDS-ManagedPassword blob as UTF-8
+ * https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-adts/a9019740-3d73-46ef-a9ae-3ea8eb86ac2e
+ * @param blob_buf - base64 decoded blob, allocated with OPENSSL_malloc
+ * @param blob_len - length of the blob
+ * @return pair of password length and NUL terminated password, nullptr on failure.
+ *         The password is allocated with OPENSSL_malloc, free it with OPENSSL_clear_free
+ */
+std::pair<size_t, char*> get_gmsa_utf8_password( const void* blob_buf, size_t blob_len )
+{
+    const auto* blob = (const creds_fetcher::blob_t*)blob_buf;
+    if ( blob == nullptr || blob_len < offsetof( creds_fetcher::blob_t, current_password ) )
+    {
+        return std::make_pair( 0, nullptr );
+    }
+
+    size_t password_offset = blob->current_password_offset;
+    // the current password ends where the next field starts
+    size_t password_end = blob->previous_password_offset != 0
+                              ? blob->previous_password_offset
+                              : blob->query_password_interval_offset;
+    if ( password_end > blob_len || password_end == 0 )
+    {
+        password_end = blob_len;
+    }
+    if ( password_offset < offsetof( creds_fetcher::blob_t, current_password ) ||
+         password_offset >= password_end )
+    {
+        return std::make_pair( 0, nullptr );
+    }
+
+    const uint8_t* utf16_password = (const uint8_t*)blob_buf + password_offset;
+    size_t utf16_len = password_end - password_offset;
+    size_t utf8_size = ( utf16_len / 2 ) * UTF8_BYTES_PER_UTF16_UNIT + 1;
+
+    auto* utf8_password = (uint8_t*)OPENSSL_malloc( utf8_size );
+    if ( utf8_password == nullptr )
+    {
+        return std::make_pair( 0, nullptr );
+    }
+
+    size_t utf8_len = utf16le_to_utf8( utf16_password, utf16_len, utf8_password );
+    if ( utf8_len == 0 )
+    {
+        OPENSSL_clear_free( utf8_password, utf8_size );
+        return std::make_pair( 0, nullptr );
+    }
+
+    // the bytes past the NUL terminator are not needed
+    OPENSSL_cleanse( utf8_password + utf8_len, utf8_size - utf8_len );
+
+    return std::make_pair( utf8_len, (char*)utf8_password );
+}
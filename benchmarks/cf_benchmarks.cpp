@@ -0,0 +1,285 @@
+#include "daemon.h"
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <fstream>
+#include <openssl/crypto.h>
+
+/**
+ * Benchmarks of the parsing and metadata paths of the daemon, they do not need a domain
+ * controller or a KDC. Run with --benchmark_out=<file> --benchmark_out_format=json to keep
+ * the results, the run_benchmarks target does this.
+ */
+
+static const std::string credspec_sample =
+    "{\"CmsPlugins\":[\"ActiveDirectory\"],"
+    "\"DomainJoinConfig\":{\"Sid\":\"S-1-5-21-4217655605-3681839426-3493040985\","
+    "\"MachineAccountName\":\"WebApp01\",\"Guid\":\"af602f85-d754-4eea-9fa8-fd76810485f1\","
+    "\"DnsTreeName\":\"contoso.com\",\"DnsName\":\"contoso.com\",\"NetBiosName\":\"contoso\"},"
+    "\"ActiveDirectoryConfig\":{\"GroupManagedServiceAccounts\":["
+    "{\"Name\":\"WebApp01\",\"Scope\":\"contoso.com\"},"
+    "{\"Name\":\"WebApp01\",\"Scope\":\"contoso\"}]}}";
+
+// msDS-ManagedPassword blob of the utf16 self test, 290 bytes once decoded
+static const std::string managed_password_sample =
+    "msDS-ManagedPassword:: "
+    "AQAAACIBAAAQAAAAEgEaAciMhCofvo1R4kkVYm79aRysUcOs7NhhHvO"
+    "exhNTV9KXAn1v8AYMN1lMC/V6W0dZVrQRpGZ/EvWi33Lq2xoR5ANuJf623JQRj3pMZQBqQLRjRoPn"
+    "UJYY8H74aVysf0t+1M0moLkm0IPSCB52Mm0CC9flTT0D9KZV2Mvf4FpgvYpYoOQvUmd0UOV72Tk/d"
+    "leM8zTWjRL5ccfzwt5p8akMEl6W0RPj1pDbqxtbpJFQiLQd7HRlSkYPeBKDB9r6CItrQTo8j+pgJf"
+    "B4+wVbOUZuMXrKkDVh8XUOUBdGhznntRWnDM2DhwBoFEisBr133Vo8aRcedYqwNj/LEsrimEJaeuY"
+    "AAAQCCBrPFgAABKQ3Z84WAAA= ";
+
+// ldapsearch output of a gMSA account, the ldif lines are joined with '#'
+static const std::string ldap_search_result_sample =
+    "# extended LDIF#dn: CN=WebApp01,CN=Managed Service Accounts,DC=contoso,DC=com#" +
+    managed_password_sample + "##search result#search: 4#result: 0 Success#";
+
+static const std::string lease_id_sample = "73099acdb5807b4bbf91";
+
+/**
+ * Scratch directory of a benchmark, removed at the end of the benchmark
+ */
+class BenchmarkDir
+{
+  public:
+    explicit BenchmarkDir( const std::string& name )
+        : path_( std::filesystem::temp_directory_path() / ( "cf_benchmarks_" + name ) )
+    {
+        std::filesystem::remove_all( path_ );
+        std::filesystem::create_directories( path_ );
+    }
+
+    ~BenchmarkDir()
+    {
+        std::filesystem::remove_all( path_ );
+    }
+
+    std::string path() const
+    {
+        return path_.string();
+    }
+
+  private:
+    std::filesystem::path path_;
+};
+
+/**
+ * Tickets of a lease, the ccache files are created so that read_meta_data_json keeps them
+ */
+static std::vector<creds_fetcher::krb_ticket_info> make_lease_tickets( const std::string& krb_dir,
+                                                                       size_t num_tickets )
+{
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets;
+    std::string lease_dir = krb_dir + "/" + lease_id_sample;
+    std::filesystem::create_directories( lease_dir );
+    for ( size_t i = 0; i < num_tickets; i++ )
+    {
+        creds_fetcher::krb_ticket_info krb_ticket;
+        krb_ticket.service_account_name = "WebApp" + std::to_string( i );
+        krb_ticket.domain_name = "contoso.com";
+        krb_ticket.krb_file_path = lease_dir + "/ccname_" + krb_ticket.service_account_name;
+        std::ofstream( krb_ticket.krb_file_path );
+        krb_tickets.push_back( krb_ticket );
+    }
+    return krb_tickets;
+}
+
+/**
+ * Write a ccache holding a TGT, as get_ticket_times finds it after a kinit
+ * @return - 0 if successful
+ */
+static krb5_error_code write_tgt_ccache( const std::string& krb_cc_name )
+{
+    krb5_context context = nullptr;
+    krb5_ccache ccache = nullptr;
+    krb5_creds creds;
+    memset( &creds, 0, sizeof( creds ) );
+
+    krb5_error_code ret = krb5_init_context( &context );
+    if ( ret != 0 )
+    {
+        return ret;
+    }
+    ret = krb5_parse_name( context, "WebApp01$@CONTOSO.COM", &creds.client );
+    if ( ret == 0 )
+    {
+        ret = krb5_parse_name( context, "krbtgt/CONTOSO.COM@CONTOSO.COM", &creds.server );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_initialize( context, ccache, creds.client );
+    }
+    if ( ret == 0 )
+    {
+        time_t now = time( nullptr );
+        creds.times.authtime = now;
+        creds.times.starttime = now;
+        creds.times.endtime = now + 10 * SECONDS_IN_HOUR;
+        creds.times.renew_till = now + 7 * 24 * SECONDS_IN_HOUR;
+        creds.ticket_flags = TKT_FLG_RENEWABLE;
+        ret = krb5_cc_store_cred( context, ccache, &creds );
+    }
+
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( context, ccache );
+    }
+    if ( creds.client != nullptr )
+    {
+        krb5_free_principal( context, creds.client );
+    }
+    if ( creds.server != nullptr )
+    {
+        krb5_free_principal( context, creds.server );
+    }
+    krb5_free_context( context );
+    return ret;
+}
+
+static void BM_parse_cred_spec( benchmark::State& state )
+{
+    for ( auto _ : state )
+    {
+        creds_fetcher::krb_ticket_info krb_ticket;
+        benchmark::DoNotOptimize( parse_cred_spec( credspec_sample, krb_ticket ) );
+        benchmark::DoNotOptimize( krb_ticket );
+    }
+}
+BENCHMARK( BM_parse_cred_spec );
+
+static void BM_write_meta_data_json( benchmark::State& state )
+{
+    BenchmarkDir krb_dir( "write_meta_data_json" );
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets =
+        make_lease_tickets( krb_dir.path(), state.range( 0 ) );
+    for ( auto _ : state )
+    {
+        if ( write_meta_data_json( krb_tickets, lease_id_sample, krb_dir.path() ) != 0 )
+        {
+            state.SkipWithError( "cannot write the metadata file" );
+            break;
+        }
+    }
+    state.SetItemsProcessed( state.iterations() * state.range( 0 ) );
+}
+BENCHMARK( BM_write_meta_data_json )->Arg( 1 )->Arg( 100 )->Arg( 10000 );
+
+static void BM_read_meta_data_json( benchmark::State& state )
+{
+    BenchmarkDir krb_dir( "read_meta_data_json" );
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets =
+        make_lease_tickets( krb_dir.path(), state.range( 0 ) );
+    if ( write_meta_data_json( krb_tickets, lease_id_sample, krb_dir.path() ) != 0 )
+    {
+        state.SkipWithError( "cannot write the metadata file" );
+        return;
+    }
+    std::string metadata_file_path =
+        krb_dir.path() + "/" + lease_id_sample + "/" + lease_id_sample + METADATA_FILE_SUFFIX;
+    for ( auto _ : state )
+    {
+        std::vector<creds_fetcher::krb_ticket_info> read_tickets =
+            read_meta_data_json( metadata_file_path );
+        if ( read_tickets.size() != krb_tickets.size() )
+        {
+            state.SkipWithError( "the metadata file lost tickets" );
+            break;
+        }
+        benchmark::DoNotOptimize( read_tickets );
+    }
+    state.SetItemsProcessed( state.iterations() * state.range( 0 ) );
+}
+BENCHMARK( BM_read_meta_data_json )->Arg( 1 )->Arg( 100 )->Arg( 10000 );
+
+static void BM_find_password( benchmark::State& state )
+{
+    for ( auto _ : state )
+    {
+        std::pair<size_t, void*> password_blob = find_password( ldap_search_result_sample );
+        if ( password_blob.second == nullptr )
+        {
+            state.SkipWithError( "password not found" );
+            break;
+        }
+        OPENSSL_cleanse( password_blob.second, password_blob.first );
+        OPENSSL_free( password_blob.second );
+    }
+}
+BENCHMARK( BM_find_password );
+
+static void BM_base64_decode( benchmark::State& state )
+{
+    std::string password = managed_password_sample.substr( strlen( "msDS-ManagedPassword:: " ) );
+    for ( auto _ : state )
+    {
+        gsize base64_decode_len = 0;
+        uint8_t* password_blob = base64_decode( password, &base64_decode_len );
+        if ( password_blob == nullptr )
+        {
+            state.SkipWithError( "cannot decode the password" );
+            break;
+        }
+        OPENSSL_cleanse( password_blob, base64_decode_len );
+        OPENSSL_free( password_blob );
+    }
+    state.SetBytesProcessed( state.iterations() * password.size() );
+}
+BENCHMARK( BM_base64_decode );
+
+static void BM_contains_invalid_characters( benchmark::State& state )
+{
+    // valid paths are scanned for every invalid character
+    std::string krb_file_path =
+        "/var/credentials-fetcher/krbdir/" + lease_id_sample + "/WebApp01/krb5cc";
+    for ( auto _ : state )
+    {
+        benchmark::DoNotOptimize( contains_invalid_characters( krb_file_path ) );
+    }
+}
+BENCHMARK( BM_contains_invalid_characters );
+
+static void BM_split_string( benchmark::State& state )
+{
+    for ( auto _ : state )
+    {
+        benchmark::DoNotOptimize( split_string( ldap_search_result_sample, '#' ) );
+    }
+    state.SetBytesProcessed( state.iterations() * ldap_search_result_sample.size() );
+}
+BENCHMARK( BM_split_string );
+
+static void BM_generate_lease_id( benchmark::State& state )
+{
+    for ( auto _ : state )
+    {
+        benchmark::DoNotOptimize( generate_lease_id() );
+    }
+}
+BENCHMARK( BM_generate_lease_id );
+
+static void BM_get_ticket_times( benchmark::State& state )
+{
+    BenchmarkDir krb_dir( "get_ticket_times" );
+    std::vector<std::string> krb_cc_names;
+    for ( int64_t i = 0; i < state.range( 0 ); i++ )
+    {
+        krb_cc_names.push_back( "FILE:" + krb_dir.path() + "/krb5cc_" + std::to_string( i ) );
+        if ( write_tgt_ccache( krb_cc_names.back() ) != 0 )
+        {
+            state.SkipWithError( "cannot write the ccache" );
+            return;
+        }
+    }
+    for ( auto _ : state )
+    {
+        benchmark::DoNotOptimize( get_ticket_times( krb_cc_names ) );
+    }
+    state.SetItemsProcessed( state.iterations() * state.range( 0 ) );
+}
+BENCHMARK( BM_get_ticket_times )->Arg( 1 )->Arg( 100 );
+
+BENCHMARK_MAIN();
@@ -0,0 +1,341 @@
+#ifndef _async_journal_h_
+#define _async_journal_h_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <systemd/sd-journal.h>
+#include <thread>
+#include <unistd.h>
+
+// records waiting to be written to the journal, a power of 2
+#define LOG_RING_CAPACITY 1024
+// records written to the journal each time the writer wakes up
+#define LOG_BATCH_SIZE 64
+// records accepted each second, the rest are dropped and counted
+#define LOG_RATE_LIMIT_PER_SECOND 1000
+// longest message and structured field kept in a record, longer ones are truncated
+#define LOG_MESSAGE_SIZE 512
+#define LOG_FIELD_SIZE 256
+
+namespace creds_fetcher
+{
+    /**
+     * Structured fields of a log record, empty fields are not sent
+     */
+    struct log_fields_t
+    {
+        std::string lease_id;
+        std::string account;
+        std::string domain;
+    };
+
+    /**
+     * AsyncJournal - writes the log records of the daemon to journald from a background
+     * thread. The threads logging format the record and push it into a lock-free ring,
+     * so an rpc or a renewal never waits for journald. The writer drains the ring in
+     * batches with sd_journal_sendv. When the ring is full or the rate limit is reached
+     * the record is dropped and counted, the writer then logs how many were dropped.
+     */
+    class AsyncJournal
+    {
+      public:
+        /**
+         * @return - the journal of the process, the writer is started on first use. It
+         *           is never destroyed, threads still logging while the process exits
+         *           write their records themselves once stop was called.
+         */
+        static AsyncJournal& instance()
+        {
+            static AsyncJournal* journal = new AsyncJournal;
+            return *journal;
+        }
+
+        AsyncJournal( const AsyncJournal& ) = delete;
+        AsyncJournal& operator=( const AsyncJournal& ) = delete;
+
+        /**
+         * Queue a record, does not block
+         * @param priority - syslog priority of the record
+         * @param fields - structured fields of the record
+         * @param fmt - printf format of the message
+         * @return - true if the record was queued, false if it was dropped
+         */
+        template <typename... Args>
+        bool log( int priority, const log_fields_t& fields, const char* fmt, Args... args )
+        {
+            if ( !take_token() )
+            {
+                dropped_.fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+
+            log_record_t record;
+            record.priority = priority;
+            snprintf( record.message, sizeof( record.message ), fmt, args... );
+            copy_field( record.lease_id, fields.lease_id );
+            copy_field( record.account, fields.account );
+            copy_field( record.domain, fields.domain );
+
+            if ( stopped_.load( std::memory_order_acquire ) )
+            {
+                // nobody drains the ring any more
+                write_record( record );
+                return true;
+            }
+            if ( !push( record ) )
+            {
+                dropped_.fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+            // only wake up the writer when it sleeps, pairs with the fence in run
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            if ( writer_sleeping_.exchange( false, std::memory_order_acq_rel ) )
+            {
+                wake_writer();
+            }
+            return true;
+        }
+
+        /**
+         * @return - number of records dropped since the start
+         */
+        uint64_t dropped() const
+        {
+            return dropped_.load( std::memory_order_relaxed );
+        }
+
+        /**
+         * Write the queued records and stop the writer, the records logged afterwards
+         * are written by the thread logging them
+         */
+        void stop()
+        {
+            if ( stopped_.exchange( true ) )
+            {
+                return;
+            }
+            wake_writer();
+            if ( writer_.joinable() )
+            {
+                writer_.join();
+            }
+            // wake_fd_ stays open, a thread that pushed before the stop may still write it
+        }
+
+      private:
+        struct log_record_t
+        {
+            int priority;
+            char message[LOG_MESSAGE_SIZE];
+            char lease_id[LOG_FIELD_SIZE];
+            char account[LOG_FIELD_SIZE];
+            char domain[LOG_FIELD_SIZE];
+        };
+
+        // slot of the ring, sequence tells whether it holds a record for the current lap
+        struct cell_t
+        {
+            std::atomic<size_t> sequence;
+            log_record_t record;
+        };
+
+        AsyncJournal() : cells_( new cell_t[LOG_RING_CAPACITY] )
+        {
+            for ( size_t i = 0; i < LOG_RING_CAPACITY; i++ )
+            {
+                cells_[i].sequence.store( i, std::memory_order_relaxed );
+            }
+            wake_fd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+            if ( wake_fd_ < 0 )
+            {
+                // log synchronously
+                stopped_ = true;
+                return;
+            }
+            writer_ = std::thread( &AsyncJournal::run, this );
+        }
+
+        static void copy_field( char* field, const std::string& value )
+        {
+            size_t len = std::min( value.size(), (size_t)LOG_FIELD_SIZE - 1 );
+            memcpy( field, value.data(), len );
+            field[len] = '\0';
+        }
+
+        bool take_token()
+        {
+            time_t now = time( nullptr );
+            time_t window = window_.load( std::memory_order_relaxed );
+            if ( now != window && window_.compare_exchange_strong( window, now ) )
+            {
+                window_count_.store( 0, std::memory_order_relaxed );
+            }
+            return window_count_.fetch_add( 1, std::memory_order_relaxed ) <
+                   LOG_RATE_LIMIT_PER_SECOND;
+        }
+
+        /**
+         * Multiple producers claim a slot with a compare-and-swap on the enqueue position
+         */
+        bool push( const log_record_t& record )
+        {
+            size_t pos = enqueue_pos_.load( std::memory_order_relaxed );
+            cell_t* cell;
+            while ( true )
+            {
+                cell = &cells_[pos & ( LOG_RING_CAPACITY - 1 )];
+                size_t sequence = cell->sequence.load( std::memory_order_acquire );
+                intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if ( diff == 0 )
+                {
+                    if ( enqueue_pos_.compare_exchange_weak( pos, pos + 1,
+                                                             std::memory_order_relaxed ) )
+                    {
+                        break;
+                    }
+                }
+                else if ( diff < 0 )
+                {
+                    // full
+                    return false;
+                }
+                else
+                {
+                    pos = enqueue_pos_.load( std::memory_order_relaxed );
+                }
+            }
+            cell->record = record;
+            cell->sequence.store( pos + 1, std::memory_order_release );
+            return true;
+        }
+
+        /**
+         * Only the writer pops
+         */
+        bool pop( log_record_t& record )
+        {
+            cell_t* cell = &cells_[dequeue_pos_ & ( LOG_RING_CAPACITY - 1 )];
+            if ( cell->sequence.load( std::memory_order_acquire ) != dequeue_pos_ + 1 )
+            {
+                return false;
+            }
+            record = cell->record;
+            cell->sequence.store( dequeue_pos_ + LOG_RING_CAPACITY, std::memory_order_release );
+            dequeue_pos_++;
+            return true;
+        }
+
+        void wake_writer()
+        {
+            uint64_t one = 1;
+            if ( wake_fd_ >= 0 && write( wake_fd_, &one, sizeof( one ) ) < 0 && errno != EAGAIN )
+            {
+                perror( "write" );
+            }
+        }
+
+        static void write_record( const log_record_t& record )
+        {
+            char priority[32];
+            std::string message = std::string( "MESSAGE=" ) + record.message;
+            std::string lease_id = std::string( "LEASE_ID=" ) + record.lease_id;
+            std::string account = std::string( "ACCOUNT=" ) + record.account;
+            std::string domain = std::string( "DOMAIN=" ) + record.domain;
+            snprintf( priority, sizeof( priority ), "PRIORITY=%d", record.priority );
+
+            struct iovec iov[5];
+            int n = 0;
+            iov[n++] = { priority, strlen( priority ) };
+            iov[n++] = { (void*)message.data(), message.size() };
+            if ( record.lease_id[0] != '\0' )
+            {
+                iov[n++] = { (void*)lease_id.data(), lease_id.size() };
+            }
+            if ( record.account[0] != '\0' )
+            {
+                iov[n++] = { (void*)account.data(), account.size() };
+            }
+            if ( record.domain[0] != '\0' )
+            {
+                iov[n++] = { (void*)domain.data(), domain.size() };
+            }
+            sd_journal_sendv( iov, n );
+        }
+
+        void run()
+        {
+            std::unique_ptr<log_record_t> record( new log_record_t );
+            uint64_t reported_dropped = 0;
+            while ( true )
+            {
+                size_t written = 0;
+                while ( written < LOG_BATCH_SIZE && pop( *record ) )
+                {
+                    write_record( *record );
+                    written++;
+                }
+
+                uint64_t dropped = dropped_.load( std::memory_order_relaxed );
+                if ( dropped != reported_dropped )
+                {
+                    sd_journal_print( LOG_WARNING, "%llu log messages dropped",
+                                      (unsigned long long)( dropped - reported_dropped ) );
+                    reported_dropped = dropped;
+                }
+                if ( written == LOG_BATCH_SIZE )
+                {
+                    continue;
+                }
+                if ( stopped_.load( std::memory_order_acquire ) )
+                {
+                    // the ring is drained
+                    break;
+                }
+
+                // sleep until a producer pushes, the ring is checked again after the
+                // flag is set so that a record pushed meanwhile is not missed
+                writer_sleeping_.store( true, std::memory_order_relaxed );
+                std::atomic_thread_fence( std::memory_order_seq_cst );
+                if ( cells_[dequeue_pos_ & ( LOG_RING_CAPACITY - 1 )].sequence.load(
+                         std::memory_order_acquire ) == dequeue_pos_ + 1 ||
+                     stopped_.load( std::memory_order_acquire ) )
+                {
+                    writer_sleeping_.store( false, std::memory_order_relaxed );
+                    continue;
+                }
+                struct pollfd wake_pollfd = { wake_fd_, POLLIN, 0 };
+                if ( poll( &wake_pollfd, 1, -1 ) > 0 )
+                {
+                    uint64_t count;
+                    if ( read( wake_fd_, &count, sizeof( count ) ) < 0 && errno != EAGAIN )
+                    {
+                        perror( "read" );
+                    }
+                }
+            }
+        }
+
+        std::unique_ptr<cell_t[]> cells_;
+        std::atomic<size_t> enqueue_pos_{ 0 };
+        size_t dequeue_pos_ = 0;
+        std::atomic<bool> writer_sleeping_{ false };
+        std::atomic<bool> stopped_{ false };
+        std::atomic<uint64_t> dropped_{ 0 };
+        std::atomic<time_t> window_{ 0 };
+        std::atomic<uint32_t> window_count_{ 0 };
+        int wake_fd_ = -1;
+        std::thread writer_;
+    };
+} // namespace creds_fetcher
+
+#endif // _async_journal_h_
@@ -1,3 +1,4 @@
+#include "async_journal.h"
 #include "config.h"
 #include <json/json.h>
 #include <csignal>
@@ -19,12 +20,31 @@
 #include <iomanip>
 #include <map>
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <memory>
 
 #ifndef _daemon_h_
 #define _daemon_h_
 
 #define DEFAULT_CRED_FILE_LEASE_ID "credspec"
+// number of gRPC completion queues, each one is drained by its own thread
+#define DEFAULT_GRPC_COMPLETION_QUEUES 4
+// number of threads doing the blocking kerberos/ldap work of the rpcs
+#define DEFAULT_RPC_WORKERS 8
+// rpcs waiting for a worker, further rpcs are rejected
+#define DEFAULT_RPC_MAX_QUEUED 256
+// number of threads renewing the kerberos tickets
+#define DEFAULT_RENEWAL_WORKERS 8
+// renewals of the same domain running at the same time
+#define DEFAULT_RENEWAL_DOMAIN_CONCURRENCY 4
+// time a ticket renewal can take, retries included
+#define DEFAULT_RENEWAL_TIMEOUT_SECONDS 120
+// renew the ticket 1 hrs before the expiration
+#define RENEW_TICKET_HOURS 1
+#define SECONDS_IN_HOUR 3600
+// metadata files are named <lease_id>_metadata.json
+#define METADATA_FILE_SUFFIX "_metadata.json"
 
 /*
  * This is a singleton class for the daemon, it is used
@@ -36,6 +56,10 @@ namespace creds_fetcher
      * TBD: move the classes to the corresponding header files
      */
 
+    // machine or domainless user TGT the ldap searches bind with, see tgt_cache.h
+    struct host_tgt_t;
+    typedef std::shared_ptr<const host_tgt_t> host_tgt_ref_t;
+
     /**
      * krb_ticket_info defines the information of the kerberos ticket created
      */
@@ -48,17 +72,39 @@ namespace creds_fetcher
         std::string domainless_user;
     };
 
+    /**
+     * krb_ticket_times defines the lifetime of the TGT in a ccache
+     */
+    class krb_ticket_times
+    {
+      public:
+        time_t endtime = 0;
+        time_t renew_till = 0;
+    };
+
     /*
-     * Log the info/error logs with journalctl
+     * Log the info/error logs with journalctl, the records are written by the
+     * AsyncJournal thread so that logging never blocks the caller
      */
     class CF_logger
     {
-        /* TBD:: Fill this later */
-
       public:
-        int log_level = LOG_NOTICE;
+        // set on the main thread and read by every thread that logs
+        std::atomic<int> log_level{ LOG_INFO };
+
+        CF_logger() = default;
+
+        CF_logger( const CF_logger& other ) : log_level( other.log_level.load() )
+        {
+        }
+
+        CF_logger& operator=( const CF_logger& other )
+        {
+            log_level = other.log_level.load();
+            return *this;
+        }
 
-        /* systemd uses log levels from syslog */
+        /* systemd uses log levels from syslog, a lower level is more severe */
         void set_log_level( int _log_level )
         {
             log_level = _log_level;
@@ -66,9 +112,19 @@ namespace creds_fetcher
 
         template <typename... Logs> void logger( const int level, const char* fmt, Logs... logs )
         {
-            if ( level >= log_level )
+            logger( level, log_fields_t(), fmt, logs... );
+        }
+
+        /**
+         * Log with the lease, account or domain as structured fields, they can be
+         * searched like 'journalctl LEASE_ID=<lease_id>'
+         */
+        template <typename... Logs>
+        void logger( const int level, const log_fields_t& fields, const char* fmt, Logs... logs )
+        {
+            if ( level <= log_level )
             {
-                sd_journal_print( level, fmt, logs... );
+                AsyncJournal::instance().log( level, fields, fmt, logs... );
             }
         }
     };
@@ -89,9 +145,19 @@ namespace creds_fetcher
         CF_logger cf_logger;
         bool run_diagnostic = false;
         std::string aws_sm_secret_name; /* TBD:: Extend to other secret stores */
-        // run ticket renewal every 10 minutes
+        // a failed ticket renewal is retried after 10 minutes
         uint64_t krb_ticket_handle_interval = 10;
-        volatile sig_atomic_t got_systemd_shutdown_signal;
+        int grpc_completion_queues = DEFAULT_GRPC_COMPLETION_QUEUES;
+        int rpc_workers = DEFAULT_RPC_WORKERS;
+        int rpc_max_queued = DEFAULT_RPC_MAX_QUEUED;
+        int renewal_workers = DEFAULT_RENEWAL_WORKERS;
+        int renewal_domain_concurrency = DEFAULT_RENEWAL_DOMAIN_CONCURRENCY;
+        int renewal_timeout_seconds = DEFAULT_RENEWAL_TIMEOUT_SECONDS;
+        // set by the main loop when SIGTERM or SIGHUP is received
+        std::atomic<bool> got_systemd_shutdown_signal{ false };
+        // eventfd that becomes readable when the daemon shuts down, it is never read
+        // so that every thread polling it is woken up
+        int shutdown_fd = -1;
     };
 
     // https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-adts/a9019740-3d73-46ef-a9ae-3ea8eb86ac2e
@@ -118,18 +184,26 @@ namespace creds_fetcher
  */
 int generate_host_machine_krb_ticket( const char* krb_ccname = "" );
 
-int get_machine_krb_ticket( std::string domain_name, creds_fetcher::CF_logger& cf_logger );
+int get_machine_krb_ticket( std::string domain_name, creds_fetcher::host_tgt_ref_t& host_tgt,
+                            creds_fetcher::CF_logger& cf_logger );
 int get_user_krb_ticket( std::string domain_name, std::string aws_sm_secret_name,
+                         creds_fetcher::host_tgt_ref_t& host_tgt,
                          creds_fetcher::CF_logger& cf_logger );
 int get_domainless_user_krb_ticket( std::string domain_name, std::string username, std::string
                                                                                    password,
+                                creds_fetcher::host_tgt_ref_t& host_tgt,
                                 creds_fetcher::CF_logger& cf_logger );
 
 std::pair<int, std::string> get_gmsa_krb_ticket( std::string domain_name,
                                                  const std::string& gmsa_account_name,
                                                  const std::string& krb_cc_name,
+                                                 const creds_fetcher::host_tgt_ref_t& host_tgt,
                                                  creds_fetcher::CF_logger& cf_logger );
 
+int fetch_gmsa_password( const std::string& domain_name, const std::string& gmsa_account_name,
+                         const creds_fetcher::host_tgt_ref_t& host_tgt,
+                         std::pair<size_t, void*>& password, creds_fetcher::CF_logger& cf_logger );
+
 std::list<std::string> renew_kerberos_tickets_domainless(std::string krb_files_dir, std::string
                                                                                          domain_name,
                                                           std::string username, std::string password,
@@ -138,22 +212,49 @@ std::list<std::string> renew_kerberos_tickets_domainless(std::string krb_files_d
 void krb_ticket_creation( const char* ldap_uri_arg, const char* gmsa_account_name_arg,
                           const char* krb_ccname = "" );
 
-bool is_ticket_ready_for_renewal( creds_fetcher::krb_ticket_info* krb_ticket_info );
+bool is_ticket_ready_for_renewal( const creds_fetcher::krb_ticket_info& krb_ticket_info );
+
+std::pair<int, creds_fetcher::krb_ticket_times> get_ticket_times( const std::string& krb_cc_name );
+
+std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> get_ticket_times(
+    const std::vector<std::string>& krb_cc_names );
+
+std::pair<int, time_t> get_ticket_renewal_deadline( const std::string& krb_cc_name );
+
+std::pair<int, std::string> renew_krb_ticket( const std::string& krb_cc_name );
 
-std::string get_ticket_expiration( std::string klist_ticket_info );
+void schedule_krb_ticket_renewal( const creds_fetcher::krb_ticket_info& krb_ticket_info );
+
+int write_file_atomically( const std::string& file_path, const std::string& contents );
 
 std::vector<std::string> delete_krb_tickets( std::string krb_files_dir, std::string lease_id );
 
+size_t utf16le_to_utf8( const uint8_t* utf16_buf, size_t utf16_len, uint8_t* utf8_buf );
+
+std::pair<size_t, char*> get_gmsa_utf8_password( const void* blob_buf, size_t blob_len );
+
+uint8_t* base64_decode( const std::string& password, gsize* base64_decode_len );
+
+std::pair<size_t, void*> find_password( std::string ldap_search_result );
+
 void ltrim( std::string& s );
 
 void rtrim( std::string& s );
 
 // unit tests
 int test_utf16_decode();
+int test_dns_srv_parse();
+int test_ticket_times();
 int config_parse_test();
 int read_meta_data_json_test();
 int read_meta_data_invalid_json_test();
 int write_meta_data_json_test();
+int lease_registry_test();
+int lease_journal_test();
+int lease_metadata_binary_test();
+int metadata_watcher_test();
+int metrics_histogram_test();
+int health_snapshot_test();
 int renewal_failure_krb_dir_not_found_test();
 
 /**
@@ -170,10 +271,11 @@ std::vector<std::string> split_string(std::string input_string, char delimiter);
  */
 bool contains_invalid_characters_in_credentials( const std::string& value );
 int RunGrpcServer( std::string unix_socket_dir, std::string krb_file_path,
-                   creds_fetcher::CF_logger& cf_logger, volatile sig_atomic_t* shutdown_signal,
-                   std::string aws_sm_secret_name );
+                   creds_fetcher::CF_logger& cf_logger, int shutdown_fd,
+                   std::string aws_sm_secret_name, int num_completion_queues,
+                   int num_rpc_workers, int max_queued_rpcs );
 
-int parse_cred_spec( std::string credspec_data, creds_fetcher::krb_ticket_info* krb_ticket_info );
+int parse_cred_spec( std::string credspec_data, creds_fetcher::krb_ticket_info& krb_ticket_info );
 
 int parse_cred_file_path(const std::string& cred_file_path, std::string& cred_file, std::string& cred_file_lease_id );
 
@@ -181,21 +283,24 @@ int ProcessCredSpecFile(std::string krb_files_dir, std::string credspec_filepath
 
 std::string generate_lease_id();
 
+std::string get_prometheus_metrics();
+
 /**
  * Methods in renewal module
  */
-int krb_ticket_renew_handler( creds_fetcher::Daemon cf_daemon );
+int krb_ticket_renew_handler( creds_fetcher::Daemon& cf_daemon );
 
 /**
  * Methods in metadata module
  */
 bool contains_invalid_characters( const std::string& path );
-std::list<creds_fetcher::krb_ticket_info*> read_meta_data_json( std::string file_path );
+std::vector<creds_fetcher::krb_ticket_info> read_meta_data_json( std::string file_path );
 
-int write_meta_data_json( creds_fetcher::krb_ticket_info* krb_ticket_info,
+int write_meta_data_json( const creds_fetcher::krb_ticket_info& krb_ticket_info,
                           std::string lease_id, std::string krb_files_dir );
 
-int write_meta_data_json( std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list,
-                          std::string lease_id, std::string krb_files_dir );
+int write_meta_data_json(
+    const std::vector<creds_fetcher::krb_ticket_info>& krb_ticket_info_list, std::string lease_id,
+    std::string krb_files_dir );
 
 #endif // _daemon_h_
@@ -0,0 +1,94 @@
+#ifndef _dc_cache_h_
+#define _dc_cache_h_
+
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// TTL bounds applied to the SRV answers
+#define DC_CACHE_MIN_TTL_SECONDS 60
+#define DC_CACHE_MAX_TTL_SECONDS 3600
+// failed lookups are not retried for this long
+#define DC_CACHE_NEGATIVE_TTL_SECONDS 30
+// entries are served past their TTL for this long while the refresh keeps failing
+#define DC_CACHE_MAX_STALE_SECONDS 3600
+
+namespace creds_fetcher
+{
+    /**
+     * srv_record_t - one answer of a SRV lookup
+     */
+    struct srv_record_t
+    {
+        std::string target;
+        uint16_t port;
+        uint16_t priority;
+        uint16_t weight;
+        uint32_t ttl;
+    };
+
+    /**
+     * DomainControllerCache - domain controllers of a domain, looked up with DNS SRV
+     * queries (_ldap._tcp.dc._msdcs.<domain>, then _kerberos._tcp.<domain>) and cached
+     * for the TTL of the answers. A background thread refreshes the entries before
+     * they expire so the lookups are served from memory.
+     */
+    class DomainControllerCache
+    {
+      public:
+        DomainControllerCache() = default;
+        ~DomainControllerCache();
+
+        DomainControllerCache( const DomainControllerCache& ) = delete;
+        DomainControllerCache& operator=( const DomainControllerCache& ) = delete;
+
+        /**
+         * Domain controllers of a domain, preferred first
+         * @param domain_name - Like 'contoso.com'
+         * @return - pair of result and fqdns like 'win-m744.contoso.com', 0 if successful
+         */
+        std::pair<int, std::vector<std::string>> get_domain_controllers(
+            const std::string& domain_name );
+
+        /**
+         * Drop the cached entry so that the next lookup goes to DNS, used when none of
+         * the cached domain controllers can be reached
+         */
+        void invalidate( const std::string& domain_name );
+
+      private:
+        struct dc_cache_entry_t
+        {
+            std::vector<std::string> domain_controllers;
+            time_t fetched_at = 0;
+            time_t refresh_at = 0;
+            time_t expires_at = 0;
+            time_t last_used = 0;
+            bool resolving = false;
+        };
+
+        void update_entry( const std::string& domain_name,
+                           const std::pair<int, std::vector<srv_record_t>>& lookup );
+        void refresh_loop();
+
+        std::mutex mutex_;
+        std::condition_variable resolved_cond_;
+        std::condition_variable refresh_cond_;
+        std::map<std::string, dc_cache_entry_t> entries_;
+        std::thread refresh_thread_;
+        bool stopped_ = false;
+    };
+
+    /**
+     * Parse the SRV records of a DNS answer, ordered by priority and weight
+     */
+    std::vector<srv_record_t> parse_srv_answer( const unsigned char* answer, int answer_len );
+} // namespace creds_fetcher
+
+#endif // _dc_cache_h_
@@ -0,0 +1,175 @@
+#ifndef _health_h_
+#define _health_h_
+
+#include "renewal_scheduler.h"
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// the main loop refreshes the health snapshot at this interval
+#define HEALTH_REFRESH_SECONDS 5
+// the renewal thread is considered stuck when its heartbeat is older than this
+#define HEALTH_RENEWAL_HEARTBEAT_MAX_AGE_SECONDS ( 3 * RENEWAL_HEARTBEAT_SECONDS )
+
+#define HEALTH_STATUS_STARTING "STARTING"
+#define HEALTH_STATUS_OK "OK"
+#define HEALTH_STATUS_DEGRADED "DEGRADED"
+#define HEALTH_STATUS_UNHEALTHY "UNHEALTHY"
+
+namespace creds_fetcher
+{
+    /**
+     * Outcome of the last ldap search on the domain controllers of a domain
+     */
+    struct domain_controller_health_t
+    {
+        std::string domain;
+        bool reachable = false;
+        time_t last_checked = 0;
+        // error of the last search, empty if it succeeded
+        std::string error;
+    };
+
+    /**
+     * State of the daemon reported by HealthCheck
+     */
+    struct health_snapshot_t
+    {
+        // OK, DEGRADED when tickets are overdue or a domain is unreachable, UNHEALTHY
+        // when the renewal thread is stuck, STARTING before the first refresh
+        std::string status = HEALTH_STATUS_STARTING;
+        bool renewal_thread_alive = false;
+        time_t renewal_heartbeat = 0;
+        // due and not renewed yet
+        size_t renewal_backlog = 0;
+        // missed deadline of the ticket waiting longest for a successful renewal, failed
+        // retries included, 0 if none is due
+        time_t oldest_overdue_deadline = 0;
+        std::vector<domain_controller_health_t> domain_controllers;
+        std::string last_kdc_error;
+        time_t last_kdc_error_time = 0;
+        time_t updated = 0;
+    };
+
+    /**
+     * HealthMonitor - health of the daemon, served by HealthCheck without doing any
+     * work on the rpc path. The krb code records the outcome of the domain controller
+     * and KDC requests as they happen, the main loop of the daemon periodically folds
+     * them with the renewal state into an immutable snapshot. HealthCheck only copies
+     * the current snapshot, so it answers right away however busy the daemon is.
+     */
+    class HealthMonitor
+    {
+      public:
+        static HealthMonitor& instance()
+        {
+            static HealthMonitor monitor;
+            return monitor;
+        }
+
+        HealthMonitor( const HealthMonitor& ) = delete;
+        HealthMonitor& operator=( const HealthMonitor& ) = delete;
+
+        /**
+         * Record the outcome of a search on the domain controllers of a domain
+         * @param domain_name - Like 'contoso.com'
+         * @param reachable - a domain controller answered
+         * @param error - error of the search, empty if it succeeded
+         */
+        void record_domain_controller( const std::string& domain_name, bool reachable,
+                                       const std::string& error )
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            domain_controller_health_t& domain = domains_[domain_name];
+            domain.domain = domain_name;
+            domain.reachable = reachable;
+            domain.last_checked = time( nullptr );
+            domain.error = error;
+        }
+
+        /**
+         * Record an error returned by the KDC
+         * @param error - krb5 error message
+         */
+        void record_kdc_error( const std::string& error )
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            last_kdc_error_ = error;
+            last_kdc_error_time_ = time( nullptr );
+        }
+
+        /**
+         * Build a new snapshot from the renewal state and the recorded outcomes
+         * @param stats - state of the renewal scheduler
+         * @param renewal_heartbeat - last time the renewal thread was seen waiting
+         * @param overdue_seconds - time a ticket can stay due before the daemon is
+         *                          degraded, the renewal timeout
+         */
+        void refresh( const renewal_stats_t& stats, time_t renewal_heartbeat,
+                      time_t overdue_seconds )
+        {
+            std::shared_ptr<health_snapshot_t> snapshot( new health_snapshot_t );
+            time_t now = time( nullptr );
+            snapshot->updated = now;
+            snapshot->renewal_heartbeat = renewal_heartbeat;
+            snapshot->renewal_thread_alive =
+                now - renewal_heartbeat <= HEALTH_RENEWAL_HEARTBEAT_MAX_AGE_SECONDS;
+            snapshot->renewal_backlog = stats.backlog;
+            snapshot->oldest_overdue_deadline = stats.oldest_overdue;
+
+            bool degraded =
+                stats.oldest_overdue != 0 && now - stats.oldest_overdue > overdue_seconds;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                for ( const auto& domain : domains_ )
+                {
+                    snapshot->domain_controllers.push_back( domain.second );
+                    degraded = degraded || !domain.second.reachable;
+                }
+                snapshot->last_kdc_error = last_kdc_error_;
+                snapshot->last_kdc_error_time = last_kdc_error_time_;
+            }
+
+            if ( !snapshot->renewal_thread_alive )
+            {
+                snapshot->status = HEALTH_STATUS_UNHEALTHY;
+            }
+            else
+            {
+                snapshot->status = degraded ? HEALTH_STATUS_DEGRADED : HEALTH_STATUS_OK;
+            }
+
+            std::lock_guard<std::mutex> lock( snapshot_mutex_ );
+            snapshot_ = snapshot;
+        }
+
+        /**
+         * @return - the last snapshot, it is never modified
+         */
+        std::shared_ptr<const health_snapshot_t> snapshot()
+        {
+            std::lock_guard<std::mutex> lock( snapshot_mutex_ );
+            return snapshot_;
+        }
+
+      private:
+        HealthMonitor() : snapshot_( new health_snapshot_t )
+        {
+        }
+
+        // guards the recorded outcomes, taken by the krb code
+        std::mutex mutex_;
+        // ordered so that the domains are reported in the same order each time
+        std::map<std::string, domain_controller_health_t> domains_;
+        std::string last_kdc_error_;
+        time_t last_kdc_error_time_ = 0;
+        // only held to copy the pointer, HealthCheck never waits for a refresh
+        std::mutex snapshot_mutex_;
+        std::shared_ptr<const health_snapshot_t> snapshot_;
+    };
+} // namespace creds_fetcher
+
+#endif // _health_h_
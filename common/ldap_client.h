@@ -0,0 +1,82 @@
+#ifndef _ldap_client_h_
+#define _ldap_client_h_
+
+#include <ctime>
+#include <ldap.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// bound connections kept per domain controller once the searches are done
+#define DEFAULT_LDAP_MAX_IDLE_CONNECTIONS 4
+// idle connections older than this are unbound instead of reused
+#define DEFAULT_LDAP_IDLE_TIMEOUT_SECONDS 300
+#define LDAP_NETWORK_TIMEOUT_SECONDS 10
+#define LDAP_SEARCH_TIMEOUT_SECONDS 30
+
+namespace creds_fetcher
+{
+    /**
+     * LdapConnectionPool - SASL/GSSAPI bound connections to domain controllers.
+     * A connection is bound once with the kerberos ticket of the ccache given by
+     * the caller and then reused for the msDS-ManagedPassword searches.
+     * Connections are keyed by domain controller and by the credentials they were
+     * bound with, so that a search never uses a connection of other credentials.
+     */
+    class LdapConnectionPool
+    {
+      public:
+        /**
+         * @param max_idle_connections - bound connections kept per domain controller
+         * @param idle_timeout_seconds - unused connections older than this are closed
+         */
+        LdapConnectionPool( size_t max_idle_connections, int idle_timeout_seconds );
+        ~LdapConnectionPool();
+
+        LdapConnectionPool( const LdapConnectionPool& ) = delete;
+        LdapConnectionPool& operator=( const LdapConnectionPool& ) = delete;
+
+        /**
+         * Read msDS-ManagedPassword of a gMSA account from a domain controller
+         * @param fqdn - domain controller such as 'win-m744.contoso.com'
+         * @param base_dn - distinguished name of the domain such as 'DC=contoso,DC=com'
+         * @param gmsa_account_name - gMSA account such as 'webapp01'
+         * @param krb_cc_name - ccache holding the TGT to bind with, it must stay valid
+         *                      until the call returns
+         * @param credentials_key - identifies the credentials of the TGT
+         * @param password - pair of length and password blob allocated with
+         *                   OPENSSL_malloc, (0, nullptr) if not found
+         * @return - 0 if the search was done, ldap error code otherwise
+         */
+        int search_gmsa_password( const std::string& fqdn, const std::string& base_dn,
+                                  const std::string& gmsa_account_name,
+                                  const std::string& krb_cc_name,
+                                  const std::string& credentials_key,
+                                  std::pair<size_t, void*>& password );
+
+        /**
+         * Unbind all the idle connections
+         */
+        void clear();
+
+      private:
+        struct ldap_connection_t
+        {
+            LDAP* ld;
+            time_t last_used;
+        };
+
+        std::pair<int, LDAP*> checkout( const std::string& key, const std::string& fqdn,
+                                        const std::string& krb_cc_name, bool& reused );
+        void checkin( const std::string& key, LDAP* ld );
+
+        std::mutex mutex_;
+        std::map<std::string, std::vector<ldap_connection_t>> idle_connections_;
+        size_t max_idle_connections_;
+        int idle_timeout_seconds_;
+    };
+} // namespace creds_fetcher
+
+#endif // _ldap_client_h_
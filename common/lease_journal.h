@@ -0,0 +1,112 @@
+#ifndef _lease_journal_h_
+#define _lease_journal_h_
+
+#include "daemon.h"
+#include "lease_metadata.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// files of the journal in the krb directory
+#define LEASE_JOURNAL_FILE "leases.journal"
+#define LEASE_SNAPSHOT_FILE "leases.snapshot"
+// the journal is compacted into the snapshot once it has this many records and
+// more records than there are leases
+#define LEASE_JOURNAL_COMPACT_RECORDS 1024
+
+namespace creds_fetcher
+{
+    /**
+     * LeaseJournal - write-ahead log of the lease mutations. Adding or removing a
+     * lease appends one record to the journal and syncs it, the journal is folded
+     * into a snapshot from time to time. The snapshot is a binary lease metadata
+     * file that is mapped at startup, then the journal is replayed.
+     * Each record is a line '<crc32> <json>', a record torn by a crash fails the
+     * checksum and is dropped from the end of the journal. Replaying a record twice
+     * gives the same leases, so a crash between the snapshot and the truncation of
+     * the journal is harmless.
+     */
+    class LeaseJournal
+    {
+      public:
+        typedef lease_map_t leases_t;
+
+        LeaseJournal() = default;
+        ~LeaseJournal();
+
+        LeaseJournal( const LeaseJournal& ) = delete;
+        LeaseJournal& operator=( const LeaseJournal& ) = delete;
+
+        /**
+         * Replay the snapshot and the journal in the directory and open the journal
+         * for appending
+         * @param journal_dir - Like '/var/credentials_fetcher/krb_dir'
+         * @param leases - the leases found
+         * @return - pair of result and true if a snapshot or a journal was found,
+         *           result is 0 if successful
+         */
+        std::pair<int, bool> open( const std::string& journal_dir, leases_t& leases );
+
+        /**
+         * Log that a lease was added or that its tickets were replaced
+         * @return - 0 if the record is on disk
+         */
+        int append_add( const std::string& lease_id,
+                        const std::vector<krb_ticket_info>& krb_tickets );
+
+        /**
+         * Log that a lease was removed
+         * @return - 0 if the record is on disk
+         */
+        int append_remove( const std::string& lease_id );
+
+        /**
+         * Write all the leases to the snapshot and empty the journal
+         * @return - 0 if successful
+         */
+        int compact( const leases_t& leases );
+
+        /**
+         * @return - true if the journal grew large enough to be compacted
+         */
+        bool needs_compaction( size_t num_leases ) const
+        {
+            return num_records_ >= LEASE_JOURNAL_COMPACT_RECORDS && num_records_ > num_leases;
+        }
+
+        bool is_open() const
+        {
+            return fd_ >= 0;
+        }
+
+        void close();
+
+      private:
+        int append( const std::string& record );
+        // cut the journal back to the end of the last complete record
+        void discard_torn_record( off_t record_offset );
+
+        std::string journal_dir_;
+        int fd_ = -1;
+        // records in the journal since the last compaction
+        size_t num_records_ = 0;
+    };
+
+    /**
+     * @return - a journal record, '<crc32> <json>' without the newline
+     */
+    std::string encode_lease_record( const std::string& op, const std::string& lease_id,
+                                     const std::vector<krb_ticket_info>& krb_tickets );
+
+    /**
+     * Apply the records of a journal, or of a snapshot written before the binary
+     * format, to the leases
+     * @param contents - contents of the file
+     * @param leases - leases to update
+     * @return - number of bytes of valid records, the rest of the file is torn or corrupt
+     */
+    size_t replay_lease_records( const std::string& contents,
+                                 LeaseJournal::leases_t& leases );
+} // namespace creds_fetcher
+
+#endif // _lease_journal_h_
@@ -0,0 +1,149 @@
+#ifndef _lease_metadata_h_
+#define _lease_metadata_h_
+
+#include "daemon.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// "CFLM" in the first bytes of the file
+#define LEASE_METADATA_MAGIC 0x4d4c4643
+#define LEASE_METADATA_VERSION 1
+
+namespace creds_fetcher
+{
+    typedef std::unordered_map<std::string, std::vector<krb_ticket_info>> lease_map_t;
+
+    /**
+     * Binary lease metadata, all the leases of the daemon in one file:
+     *   header
+     *   lease entries, one per lease
+     *   ticket entries, the tickets of a lease are contiguous
+     *   string table
+     * Strings are (offset, length) pairs into the string table and are not null
+     * terminated. The checksum covers everything after the header, the integers are
+     * in host byte order since the file never leaves the host.
+     */
+    struct lease_metadata_header_t
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t num_leases;
+        uint32_t num_tickets;
+        uint32_t strings_size;
+        uint32_t crc32;
+    };
+
+    struct lease_metadata_string_t
+    {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    struct lease_metadata_lease_t
+    {
+        lease_metadata_string_t lease_id;
+        uint32_t first_ticket;
+        uint32_t num_tickets;
+    };
+
+    struct lease_metadata_ticket_t
+    {
+        lease_metadata_string_t krb_file_path;
+        lease_metadata_string_t service_account_name;
+        lease_metadata_string_t domain_name;
+        lease_metadata_string_t domainless_user;
+    };
+
+    /**
+     * Ticket of a lease, the strings point into the mapped file
+     */
+    struct krb_ticket_view_t
+    {
+        std::string_view krb_file_path;
+        std::string_view service_account_name;
+        std::string_view domain_name;
+        std::string_view domainless_user;
+    };
+
+    /**
+     * LeaseMetadataView - read-only mapping of a binary lease metadata file. The file
+     * is checked once when it is opened, the leases are then read in place without
+     * parsing or allocating.
+     */
+    class LeaseMetadataView
+    {
+      public:
+        LeaseMetadataView() = default;
+        ~LeaseMetadataView();
+
+        LeaseMetadataView( const LeaseMetadataView& ) = delete;
+        LeaseMetadataView& operator=( const LeaseMetadataView& ) = delete;
+
+        /**
+         * Map the file and check its version, checksum and offsets
+         * @param file_path - binary lease metadata file
+         * @return - 0 if successful, -1 if the file cannot be read or is not valid
+         */
+        int open( const std::string& file_path );
+
+        void close();
+
+        size_t num_leases() const
+        {
+            return num_leases_;
+        }
+
+        std::string_view lease_id( size_t lease ) const;
+
+        size_t num_tickets( size_t lease ) const;
+
+        krb_ticket_view_t ticket( size_t lease, size_t ticket ) const;
+
+      private:
+        std::string_view get_string( const lease_metadata_string_t& str ) const;
+
+        void* map_ = nullptr;
+        size_t map_size_ = 0;
+        size_t num_leases_ = 0;
+        const lease_metadata_lease_t* leases_ = nullptr;
+        const lease_metadata_ticket_t* tickets_ = nullptr;
+        const char* strings_ = nullptr;
+    };
+
+    /**
+     * @return - CRC-32 (IEEE) of the buffer
+     */
+    uint32_t compute_crc32( const char* data, size_t len );
+
+    /**
+     * @return - the leases in the binary lease metadata format
+     */
+    std::string encode_lease_metadata( const lease_map_t& leases );
+
+    /**
+     * @return - true if the contents start like a binary lease metadata file
+     */
+    bool is_binary_lease_metadata( const std::string& contents );
+} // namespace creds_fetcher
+
+/**
+ * Read the metadata files of the leases in the krb directory, such as
+ * '<krb_files_dir>/<lease_id>/<lease_id>_metadata.json'
+ * @param krb_files_dir - Like '/var/credentials_fetcher/krb_dir'
+ * @return - the leases found
+ */
+creds_fetcher::lease_map_t read_meta_data_json_files( const std::string& krb_files_dir );
+
+/**
+ * Convert the json metadata files of the leases into one binary lease metadata file
+ * @param krb_files_dir - Like '/var/credentials_fetcher/krb_dir'
+ * @param binary_file_path - file to write
+ * @return - number of leases converted, -1 if the file cannot be written
+ */
+int convert_meta_data_json_to_binary( const std::string& krb_files_dir,
+                                      const std::string& binary_file_path );
+
+#endif // _lease_metadata_h_
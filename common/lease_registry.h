@@ -0,0 +1,100 @@
+#ifndef _lease_registry_h_
+#define _lease_registry_h_
+
+#include "daemon.h"
+#include "lease_journal.h"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace creds_fetcher
+{
+    /**
+     * LeaseRegistry - the leases and their kerberos tickets, indexed by lease id,
+     * service account and domainless user. It is loaded once at startup and kept up
+     * to date by the rpcs, every change is logged to the lease journal in the krb
+     * directory before the call returns.
+     */
+    class LeaseRegistry
+    {
+      public:
+        LeaseRegistry() = default;
+
+        LeaseRegistry( const LeaseRegistry& ) = delete;
+        LeaseRegistry& operator=( const LeaseRegistry& ) = delete;
+
+        /**
+         * Replay the lease journal in the krb directory. The metadata files of the
+         * leases are read instead when there is no journal yet, such as after an
+         * upgrade, and written to the journal.
+         * @param krb_files_dir - Like '/var/credentials_fetcher/krb_dir'
+         * @return - number of leases found
+         */
+        size_t load( const std::string& krb_files_dir );
+
+        /**
+         * Add a lease or replace the tickets of an existing one
+         * @param lease_id - lease id of the tickets
+         * @param krb_tickets - tickets of the lease
+         */
+        void add_lease( const std::string& lease_id, std::vector<krb_ticket_info> krb_tickets );
+
+        /**
+         * Remove a lease
+         * @param lease_id - lease id of the tickets
+         * @return - tickets of the lease, empty if the lease is not known
+         */
+        std::vector<krb_ticket_info> remove_lease( const std::string& lease_id );
+
+        /**
+         * @return - tickets of the lease, empty if the lease is not known
+         */
+        std::vector<krb_ticket_info> get_lease( const std::string& lease_id );
+
+        /**
+         * @return - tickets of the service account in all the leases
+         */
+        std::vector<krb_ticket_info> get_tickets_by_service_account(
+            const std::string& service_account_name );
+
+        /**
+         * @return - tickets created in domainless mode with the user
+         */
+        std::vector<krb_ticket_info> get_tickets_by_domainless_user(
+            const std::string& domainless_user );
+
+        /**
+         * @return - tickets of all the leases
+         */
+        std::vector<krb_ticket_info> get_all_tickets();
+
+        /**
+         * @return - number of leases
+         */
+        size_t size();
+
+      private:
+        void add_lease_locked( const std::string& lease_id,
+                               std::vector<krb_ticket_info> krb_tickets );
+        std::vector<krb_ticket_info> remove_lease_locked( const std::string& lease_id );
+        std::vector<krb_ticket_info> get_tickets_locked(
+            const std::unordered_map<std::string, std::unordered_set<std::string>>& index,
+            const std::string& key, bool match_service_account );
+
+        void compact_journal_locked();
+
+        std::mutex mutex_;
+        LeaseJournal journal_;
+        std::unordered_map<std::string, std::vector<krb_ticket_info>> leases_;
+        // service account and domainless user to the lease ids with their tickets
+        std::unordered_map<std::string, std::unordered_set<std::string>> by_service_account_;
+        std::unordered_map<std::string, std::unordered_set<std::string>> by_domainless_user_;
+    };
+} // namespace creds_fetcher
+
+// leases of the daemon, shared by the gRPC service and the renewal thread
+extern creds_fetcher::LeaseRegistry lease_registry;
+
+#endif // _lease_registry_h_
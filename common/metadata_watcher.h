@@ -0,0 +1,91 @@
+#ifndef _metadata_watcher_h_
+#define _metadata_watcher_h_
+
+#include "daemon.h"
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace creds_fetcher
+{
+    /**
+     * MetadataWatcher - follows the lease directories of the krb directory with inotify.
+     * The krb directory is watched for lease directories being created or removed and
+     * each lease directory for its metadata file being written, replaced or removed,
+     * such as when an operator restores a backup. The changes are reported as they
+     * happen instead of being found by walking the krb directory.
+     */
+    class MetadataWatcher
+    {
+      public:
+        /**
+         * The metadata file of a lease was written or moved into place
+         */
+        typedef std::function<void( const std::string& lease_id,
+                                    const std::string& metadata_file_path )>
+            metadata_changed_fn_t;
+        /**
+         * The metadata file or the directory of a lease was removed
+         */
+        typedef std::function<void( const std::string& lease_id )> lease_removed_fn_t;
+
+        MetadataWatcher( metadata_changed_fn_t on_metadata_changed,
+                         lease_removed_fn_t on_lease_removed )
+            : on_metadata_changed_( std::move( on_metadata_changed ) ),
+              on_lease_removed_( std::move( on_lease_removed ) )
+        {
+        }
+
+        ~MetadataWatcher();
+
+        MetadataWatcher( const MetadataWatcher& ) = delete;
+        MetadataWatcher& operator=( const MetadataWatcher& ) = delete;
+
+        /**
+         * Watch the krb directory and its lease directories, the metadata files already
+         * there are not reported
+         * @param krb_files_dir - Like '/var/credentials_fetcher/krb_dir'
+         * @return - 0 if successful, -1 if the directory cannot be watched
+         */
+        int open( const std::string& krb_files_dir );
+
+        /**
+         * Handle the events waiting on the inotify descriptor, does not block. It is
+         * called by the main loop of the daemon when fd is readable.
+         * @return - 0 if successful, -1 if the events cannot be read
+         */
+        int process_events();
+
+        /**
+         * @return - inotify descriptor, readable when there are events
+         */
+        int fd() const
+        {
+            return inotify_fd_;
+        }
+
+        void close();
+
+      private:
+        /**
+         * Watch a lease directory, the metadata file already in it is reported if
+         * report_existing is set
+         */
+        void watch_lease_dir( const std::string& lease_id, bool report_existing );
+
+        /**
+         * Watch the lease directories again after the kernel dropped events
+         */
+        void rescan();
+
+        metadata_changed_fn_t on_metadata_changed_;
+        lease_removed_fn_t on_lease_removed_;
+        std::string krb_files_dir_;
+        int inotify_fd_ = -1;
+        int root_wd_ = -1;
+        // watch descriptor of each lease directory to its lease id
+        std::unordered_map<int, std::string> lease_dirs_;
+    };
+} // namespace creds_fetcher
+
+#endif // _metadata_watcher_h_
@@ -0,0 +1,378 @@
+#ifndef _metrics_h_
+#define _metrics_h_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// latencies are kept in microseconds, each power of 2 is split into 16 buckets so a
+// percentile is within 1/16 of the latencies recorded
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKET_COUNT ( 1 << METRICS_SUB_BUCKET_BITS )
+// latencies of 2^40 us (about 12 days) and more are kept in the last bucket
+#define METRICS_MAX_MAGNITUDE 40
+#define METRICS_BUCKET_COUNT                                                                   \
+    ( ( METRICS_MAX_MAGNITUDE - METRICS_SUB_BUCKET_BITS + 1 ) * METRICS_SUB_BUCKET_COUNT )
+
+namespace creds_fetcher
+{
+    /**
+     * Timed stages of the ticket pipeline and of the rpcs
+     */
+    enum metric_stage_t
+    {
+        METRIC_GMSA_TICKET,
+        METRIC_DC_DISCOVERY,
+        METRIC_LDAP_SEARCH,
+        METRIC_PASSWORD_DECODE,
+        METRIC_KINIT,
+        METRIC_MACHINE_TICKET,
+        METRIC_METADATA_READ,
+        METRIC_METADATA_WRITE,
+        METRIC_LEASE_JOURNAL_APPEND,
+        METRIC_RPC_HEALTH_CHECK,
+        METRIC_RPC_ADD_KERBEROS_LEASE,
+        METRIC_RPC_ADD_NON_DOMAIN_JOINED_KERBEROS_LEASE,
+        METRIC_RPC_RENEW_NON_DOMAIN_JOINED_KERBEROS_LEASE,
+        METRIC_RPC_DELETE_KERBEROS_LEASE,
+        METRIC_RPC_GET_METRICS,
+        METRIC_STAGE_COUNT
+    };
+
+    /**
+     * Events counted outside of the stages
+     */
+    enum metric_counter_t
+    {
+        // rpcs rejected because the worker pool queue was full
+        METRIC_RPC_REJECTED,
+        // gMSA tickets copied from a concurrent request for the same account
+        METRIC_GMSA_TICKET_SHARED,
+        METRIC_COUNTER_COUNT
+    };
+
+    inline const char* metric_stage_name( metric_stage_t stage )
+    {
+        static const char* names[METRIC_STAGE_COUNT] = {
+            "gmsa_ticket",
+            "dc_discovery",
+            "ldap_search",
+            "password_decode",
+            "kinit",
+            "machine_ticket",
+            "metadata_read",
+            "metadata_write",
+            "lease_journal_append",
+            "rpc_health_check",
+            "rpc_add_kerberos_lease",
+            "rpc_add_non_domain_joined_kerberos_lease",
+            "rpc_renew_non_domain_joined_kerberos_lease",
+            "rpc_delete_kerberos_lease",
+            "rpc_get_metrics" };
+        return names[stage];
+    }
+
+    inline const char* metric_counter_name( metric_counter_t counter )
+    {
+        static const char* names[METRIC_COUNTER_COUNT] = { "rpc_rejected",
+                                                           "gmsa_ticket_shared" };
+        return names[counter];
+    }
+
+    /**
+     * Latencies of a stage at the time of the snapshot
+     */
+    struct histogram_snapshot_t
+    {
+        std::string name;
+        uint64_t count = 0;
+        uint64_t errors = 0;
+        uint64_t sum_micros = 0;
+        uint64_t max_micros = 0;
+        uint64_t p50_micros = 0;
+        uint64_t p90_micros = 0;
+        uint64_t p99_micros = 0;
+        uint64_t p999_micros = 0;
+        // buckets holding latencies, pair of the highest latency of the bucket and
+        // the number of latencies in it, in increasing order
+        std::vector<std::pair<uint64_t, uint64_t>> buckets;
+    };
+
+    struct metrics_snapshot_t
+    {
+        std::vector<histogram_snapshot_t> stages;
+        std::vector<std::pair<std::string, uint64_t>> counters;
+    };
+
+    /**
+     * State of the daemon reported by the GetMetrics rpc and the metrics socket
+     */
+    struct daemon_metrics_t
+    {
+        uint64_t leases = 0;
+        uint64_t tickets_scheduled = 0;
+        uint64_t tickets_renewing = 0;
+        uint64_t tickets_retrying = 0;
+        uint64_t renewal_backlog = 0;
+        // unix time of the next renewal, 0 if no ticket is waiting for one
+        int64_t next_renewal_time = 0;
+        uint64_t rpc_queue_depth = 0;
+        uint64_t rpc_active_workers = 0;
+        uint64_t log_records_dropped = 0;
+        metrics_snapshot_t latencies;
+    };
+
+    /**
+     * LatencyHistogram - HDR style histogram of latencies. The buckets grow with
+     * the latency so the relative precision is the same from microseconds to hours,
+     * recording is a few relaxed atomic increments.
+     */
+    class LatencyHistogram
+    {
+      public:
+        LatencyHistogram()
+        {
+            for ( auto& bucket : buckets_ )
+            {
+                bucket.store( 0, std::memory_order_relaxed );
+            }
+        }
+
+        LatencyHistogram( const LatencyHistogram& ) = delete;
+        LatencyHistogram& operator=( const LatencyHistogram& ) = delete;
+
+        /**
+         * @param micros - latency in microseconds
+         * @param failed - the stage returned an error
+         */
+        void record( uint64_t micros, bool failed )
+        {
+            buckets_[bucket_index( micros )].fetch_add( 1, std::memory_order_relaxed );
+            sum_micros_.fetch_add( micros, std::memory_order_relaxed );
+            if ( failed )
+            {
+                errors_.fetch_add( 1, std::memory_order_relaxed );
+            }
+            uint64_t max_micros = max_micros_.load( std::memory_order_relaxed );
+            while ( micros > max_micros &&
+                    !max_micros_.compare_exchange_weak( max_micros, micros,
+                                                        std::memory_order_relaxed ) )
+            {
+            }
+        }
+
+        /**
+         * The counters are read one by one while latencies are being recorded, count
+         * is taken from the buckets so that the percentiles are consistent
+         */
+        histogram_snapshot_t snapshot() const
+        {
+            histogram_snapshot_t snapshot;
+            for ( size_t i = 0; i < METRICS_BUCKET_COUNT; i++ )
+            {
+                uint64_t bucket_count = buckets_[i].load( std::memory_order_relaxed );
+                if ( bucket_count != 0 )
+                {
+                    snapshot.buckets.push_back(
+                        std::make_pair( bucket_upper_bound( i ), bucket_count ) );
+                    snapshot.count += bucket_count;
+                }
+            }
+            snapshot.errors = errors_.load( std::memory_order_relaxed );
+            snapshot.sum_micros = sum_micros_.load( std::memory_order_relaxed );
+            snapshot.max_micros = max_micros_.load( std::memory_order_relaxed );
+            snapshot.p50_micros = percentile( snapshot, 50.0 );
+            snapshot.p90_micros = percentile( snapshot, 90.0 );
+            snapshot.p99_micros = percentile( snapshot, 99.0 );
+            snapshot.p999_micros = percentile( snapshot, 99.9 );
+            return snapshot;
+        }
+
+        /**
+         * Latencies below 16 us have a bucket each, above that every power of 2 is
+         * split into 16 buckets
+         */
+        static size_t bucket_index( uint64_t micros )
+        {
+            if ( micros < METRICS_SUB_BUCKET_COUNT )
+            {
+                return micros;
+            }
+            size_t magnitude = 63 - __builtin_clzll( micros );
+            if ( magnitude >= METRICS_MAX_MAGNITUDE )
+            {
+                return METRICS_BUCKET_COUNT - 1;
+            }
+            size_t sub_bucket = ( micros >> ( magnitude - METRICS_SUB_BUCKET_BITS ) ) -
+                                METRICS_SUB_BUCKET_COUNT;
+            return ( magnitude - METRICS_SUB_BUCKET_BITS + 1 ) * METRICS_SUB_BUCKET_COUNT +
+                   sub_bucket;
+        }
+
+        /**
+         * @return - highest latency kept in a bucket
+         */
+        static uint64_t bucket_upper_bound( size_t index )
+        {
+            if ( index < METRICS_SUB_BUCKET_COUNT )
+            {
+                return index;
+            }
+            size_t magnitude = index / METRICS_SUB_BUCKET_COUNT + METRICS_SUB_BUCKET_BITS - 1;
+            uint64_t sub_bucket = index % METRICS_SUB_BUCKET_COUNT + METRICS_SUB_BUCKET_COUNT;
+            return ( ( sub_bucket + 1 ) << ( magnitude - METRICS_SUB_BUCKET_BITS ) ) - 1;
+        }
+
+        /**
+         * @return - latency below which the given percentage of the latencies are,
+         *           0 if nothing was recorded
+         */
+        static uint64_t percentile( const histogram_snapshot_t& snapshot, double percent )
+        {
+            uint64_t rank =
+                std::max( (uint64_t)1, (uint64_t)( snapshot.count * percent / 100.0 + 0.5 ) );
+            uint64_t seen = 0;
+            for ( const auto& bucket : snapshot.buckets )
+            {
+                seen += bucket.second;
+                if ( seen >= rank )
+                {
+                    // the bucket bound can be above the highest latency recorded
+                    return std::min( bucket.first, snapshot.max_micros );
+                }
+            }
+            return snapshot.max_micros;
+        }
+
+      private:
+        std::array<std::atomic<uint64_t>, METRICS_BUCKET_COUNT> buckets_;
+        std::atomic<uint64_t> errors_{ 0 };
+        std::atomic<uint64_t> sum_micros_{ 0 };
+        std::atomic<uint64_t> max_micros_{ 0 };
+    };
+
+    /**
+     * Metrics - latency histograms of the stages and event counters of the daemon
+     */
+    class Metrics
+    {
+      public:
+        static Metrics& instance()
+        {
+            static Metrics metrics;
+            return metrics;
+        }
+
+        Metrics( const Metrics& ) = delete;
+        Metrics& operator=( const Metrics& ) = delete;
+
+        void record( metric_stage_t stage, uint64_t micros, bool failed )
+        {
+            stages_[stage].record( micros, failed );
+        }
+
+        void increment( metric_counter_t counter )
+        {
+            counters_[counter].fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        /**
+         * @return - latencies of all the stages, including the ones never run, and
+         *           the counters
+         */
+        metrics_snapshot_t snapshot() const
+        {
+            metrics_snapshot_t snapshot;
+            for ( int i = 0; i < METRIC_STAGE_COUNT; i++ )
+            {
+                histogram_snapshot_t stage = stages_[i].snapshot();
+                stage.name = metric_stage_name( (metric_stage_t)i );
+                snapshot.stages.push_back( std::move( stage ) );
+            }
+            for ( int i = 0; i < METRIC_COUNTER_COUNT; i++ )
+            {
+                snapshot.counters.push_back(
+                    std::make_pair( std::string( metric_counter_name( (metric_counter_t)i ) ),
+                                    counters_[i].load( std::memory_order_relaxed ) ) );
+            }
+            return snapshot;
+        }
+
+      private:
+        Metrics()
+        {
+            for ( auto& counter : counters_ )
+            {
+                counter.store( 0, std::memory_order_relaxed );
+            }
+        }
+
+        std::array<LatencyHistogram, METRIC_STAGE_COUNT> stages_;
+        std::array<std::atomic<uint64_t>, METRIC_COUNTER_COUNT> counters_;
+    };
+
+    /**
+     * StageTimer - measures a stage and records it when stopped. A timer still running
+     * when it goes out of scope records the stage as failed, so only the successful
+     * path has to stop it.
+     */
+    class StageTimer
+    {
+      public:
+        /**
+         * @param stage - stage being measured
+         * @param start - start measuring now, otherwise when start is called
+         */
+        explicit StageTimer( metric_stage_t stage, bool start = true ) : stage_( stage )
+        {
+            if ( start )
+            {
+                this->start();
+            }
+        }
+
+        ~StageTimer()
+        {
+            stop( false );
+        }
+
+        StageTimer( const StageTimer& ) = delete;
+        StageTimer& operator=( const StageTimer& ) = delete;
+
+        void start()
+        {
+            started_ = std::chrono::steady_clock::now();
+            running_ = true;
+        }
+
+        /**
+         * Record the time since start, does nothing if the timer is not running
+         * @param succeeded - the stage completed without error
+         */
+        void stop( bool succeeded )
+        {
+            if ( !running_ )
+            {
+                return;
+            }
+            running_ = false;
+            std::chrono::microseconds elapsed =
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - started_ );
+            Metrics::instance().record( stage_, elapsed.count(), !succeeded );
+        }
+
+      private:
+        metric_stage_t stage_;
+        std::chrono::steady_clock::time_point started_;
+        bool running_ = false;
+    };
+} // namespace creds_fetcher
+
+#endif // _metrics_h_
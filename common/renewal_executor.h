@@ -0,0 +1,153 @@
+#ifndef _renewal_executor_h_
+#define _renewal_executor_h_
+
+#include "worker_pool.h"
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace creds_fetcher
+{
+    /**
+     * RenewalExecutor - runs the ticket renewals on a worker pool with a cap on the
+     * renewals in flight for each domain. The tickets of a domain beyond the cap wait
+     * in the executor, so a domain whose domain controllers do not answer holds at
+     * most that many workers and the renewals of the other domains keep going.
+     */
+    class RenewalExecutor
+    {
+      public:
+        /**
+         * A renewal gets the time by which it must give up, it is counted from the
+         * moment the renewal starts on a worker
+         */
+        typedef std::function<void( time_t deadline )> renewal_task_t;
+
+        /**
+         * @param num_workers - number of renewals run at the same time
+         * @param max_per_domain - renewals of the same domain run at the same time
+         * @param timeout_seconds - time a renewal can take, retries included
+         */
+        RenewalExecutor( size_t num_workers, size_t max_per_domain, time_t timeout_seconds )
+            : max_per_domain_( max_per_domain == 0 ? 1 : max_per_domain ),
+              timeout_seconds_( timeout_seconds ),
+              // the executor holds back the tickets, the pool queue is not bounded
+              pool_( num_workers, std::numeric_limits<size_t>::max() )
+        {
+        }
+
+        ~RenewalExecutor()
+        {
+            stop();
+        }
+
+        RenewalExecutor( const RenewalExecutor& ) = delete;
+        RenewalExecutor& operator=( const RenewalExecutor& ) = delete;
+
+        /**
+         * Run a renewal as soon as a worker and a slot of the domain are free
+         * @param domain_name - domain of the ticket
+         * @param task - renewal of the ticket
+         */
+        void submit( const std::string& domain_name, renewal_task_t task )
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if ( stopped_ )
+            {
+                return;
+            }
+            domain_queue_t& domain = domains_[domain_name];
+            domain.pending.push_back( std::move( task ) );
+            dispatch_locked( domain_name, domain );
+        }
+
+        /**
+         * Drop the renewals that have not started, the ones running are finished
+         */
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            stopped_ = true;
+            for ( auto& domain : domains_ )
+            {
+                domain.second.pending.clear();
+            }
+        }
+
+        /**
+         * @return - number of renewals running or waiting for a slot
+         */
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            size_t count = 0;
+            for ( const auto& domain : domains_ )
+            {
+                count += domain.second.in_flight + domain.second.pending.size();
+            }
+            return count;
+        }
+
+      private:
+        struct domain_queue_t
+        {
+            std::deque<renewal_task_t> pending;
+            size_t in_flight = 0;
+        };
+
+        void dispatch_locked( const std::string& domain_name, domain_queue_t& domain )
+        {
+            while ( !stopped_ && domain.in_flight < max_per_domain_ && !domain.pending.empty() )
+            {
+                renewal_task_t task = std::move( domain.pending.front() );
+                domain.pending.pop_front();
+                domain.in_flight++;
+                pool_.submit( [this, domain_name, task]() { run( domain_name, task ); } );
+            }
+        }
+
+        void run( const std::string& domain_name, const renewal_task_t& task )
+        {
+            bool stopped;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                stopped = stopped_;
+            }
+            if ( !stopped )
+            {
+                try
+                {
+                    task( time( nullptr ) + timeout_seconds_ );
+                }
+                catch ( const std::exception& ex )
+                {
+                    std::cerr << "Exception in ticket renewal: '" << ex.what() << "'"
+                              << std::endl;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock( mutex_ );
+            domain_queue_t& domain = domains_[domain_name];
+            domain.in_flight--;
+            dispatch_locked( domain_name, domain );
+            if ( domain.in_flight == 0 && domain.pending.empty() )
+            {
+                domains_.erase( domain_name );
+            }
+        }
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, domain_queue_t> domains_;
+        size_t max_per_domain_;
+        time_t timeout_seconds_;
+        bool stopped_ = false;
+        // last member, the workers are joined before the state they use is destroyed
+        WorkerPool pool_;
+    };
+} // namespace creds_fetcher
+
+#endif // _renewal_executor_h_
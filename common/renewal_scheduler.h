@@ -0,0 +1,289 @@
+#ifndef _renewal_scheduler_h_
+#define _renewal_scheduler_h_
+
+#include "daemon.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// the renewal thread wakes up at least this often to show it is not stuck
+#define RENEWAL_HEARTBEAT_SECONDS 30
+
+namespace creds_fetcher
+{
+    /**
+     * Tickets of the scheduler by state
+     */
+    struct renewal_stats_t
+    {
+        // waiting for their deadline after a successful renewal or when added
+        size_t scheduled = 0;
+        // handed to the renewal thread and not re-armed yet
+        size_t renewing = 0;
+        // waiting to be retried after a failed renewal
+        size_t retrying = 0;
+        // due and not renewed yet, the tickets being renewed or retried included
+        size_t backlog = 0;
+        // earliest deadline of the tickets waiting for one, 0 if there are none
+        time_t next_deadline = 0;
+        // time since which the oldest ticket of the backlog has not been renewed,
+        // 0 if no ticket is due
+        time_t oldest_overdue = 0;
+    };
+
+    /**
+     * RenewalScheduler - kerberos tickets ordered by their renewal deadline.
+     * Tickets are added when the lease is created and re-armed after each renewal,
+     * the renewal thread sleeps until the earliest deadline instead of polling.
+     * A min-heap holds the deadlines, re-arming a ticket pushes a new heap entry and
+     * the older one is skipped when it comes up.
+     */
+    class RenewalScheduler
+    {
+      public:
+        RenewalScheduler() = default;
+
+        RenewalScheduler( const RenewalScheduler& ) = delete;
+        RenewalScheduler& operator=( const RenewalScheduler& ) = delete;
+
+        /**
+         * Add a ticket or move the deadline of a ticket already scheduled
+         * @param krb_ticket - ticket information, krb_file_path identifies the ticket
+         * @param deadline - time when the ticket must be renewed
+         */
+        void schedule( const krb_ticket_info& krb_ticket, time_t deadline )
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                scheduled_ticket_t& ticket = tickets_[krb_ticket.krb_file_path];
+                ticket.krb_ticket = krb_ticket;
+                ticket.overdue_since = 0;
+                push( krb_ticket.krb_file_path, ticket, deadline );
+            }
+            cond_.notify_one();
+        }
+
+        /**
+         * Set the next deadline of a ticket after it was renewed, nothing is done if the
+         * ticket was removed in the meantime. A ticket stays overdue from its missed
+         * deadline until a renewal succeeds, whatever its retry deadline.
+         * @param krb_file_path - path of the ticket
+         * @param deadline - time when the ticket must be renewed
+         * @param failed - the renewal failed and the deadline is the retry
+         */
+        void rearm( const std::string& krb_file_path, time_t deadline, bool failed = false )
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                auto it = tickets_.find( krb_file_path );
+                if ( it == tickets_.end() )
+                {
+                    return;
+                }
+                scheduled_ticket_t& ticket = it->second;
+                ticket.failed = failed;
+                if ( !failed )
+                {
+                    ticket.overdue_since = 0;
+                }
+                else if ( ticket.overdue_since == 0 )
+                {
+                    ticket.overdue_since = std::min( ticket.deadline, time( nullptr ) );
+                }
+                push( krb_file_path, ticket, deadline );
+            }
+            cond_.notify_one();
+        }
+
+        /**
+         * Stop renewing a ticket, used when the lease is deleted
+         * @param krb_file_path - path of the ticket
+         */
+        void remove( const std::string& krb_file_path )
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            tickets_.erase( krb_file_path );
+        }
+
+        /**
+         * Wait until at least one ticket is due
+         * @param due_tickets - the tickets whose deadline has passed, they stay known to
+         *                      the scheduler and must be re-armed or removed
+         * @return - false if the scheduler was stopped
+         */
+        bool wait_for_due( std::vector<krb_ticket_info>& due_tickets )
+        {
+            due_tickets.clear();
+            std::unique_lock<std::mutex> lock( mutex_ );
+            while ( !stopped_ )
+            {
+                time_t now = time( nullptr );
+                heartbeat_.store( now, std::memory_order_relaxed );
+                while ( !deadlines_.empty() )
+                {
+                    const heap_entry_t& next = deadlines_.top();
+                    auto it = tickets_.find( next.krb_file_path );
+                    if ( it == tickets_.end() || it->second.generation != next.generation )
+                    {
+                        // removed or re-armed since this entry was pushed
+                        deadlines_.pop();
+                        continue;
+                    }
+                    if ( next.deadline > now )
+                    {
+                        break;
+                    }
+                    it->second.due = true;
+                    due_tickets.push_back( it->second.krb_ticket );
+                    deadlines_.pop();
+                }
+                if ( !due_tickets.empty() )
+                {
+                    return true;
+                }
+
+                // the wait is cut short so that the heartbeat keeps moving
+                time_t wake_up = now + RENEWAL_HEARTBEAT_SECONDS;
+                if ( !deadlines_.empty() && deadlines_.top().deadline < wake_up )
+                {
+                    wake_up = deadlines_.top().deadline;
+                }
+                cond_.wait_until( lock, std::chrono::system_clock::from_time_t( wake_up ) );
+            }
+            return false;
+        }
+
+        /**
+         * Wake up the renewal thread and make wait_for_due return false
+         */
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                stopped_ = true;
+            }
+            cond_.notify_all();
+        }
+
+        /**
+         * @return - number of tickets being renewed
+         */
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            return tickets_.size();
+        }
+
+        /**
+         * @return - number of tickets in each state and the next deadline
+         */
+        renewal_stats_t stats()
+        {
+            renewal_stats_t stats;
+            time_t now = time( nullptr );
+            std::lock_guard<std::mutex> lock( mutex_ );
+            for ( const auto& it : tickets_ )
+            {
+                const scheduled_ticket_t& ticket = it.second;
+                time_t overdue_since = ticket.overdue_since;
+                if ( overdue_since == 0 && ticket.deadline <= now )
+                {
+                    overdue_since = ticket.deadline;
+                }
+                if ( overdue_since != 0 &&
+                     ( stats.oldest_overdue == 0 || overdue_since < stats.oldest_overdue ) )
+                {
+                    stats.oldest_overdue = overdue_since;
+                }
+                if ( ticket.due )
+                {
+                    stats.renewing++;
+                    stats.backlog++;
+                    continue;
+                }
+                if ( ticket.failed )
+                {
+                    stats.retrying++;
+                }
+                else
+                {
+                    stats.scheduled++;
+                }
+                if ( overdue_since != 0 )
+                {
+                    stats.backlog++;
+                }
+                if ( stats.next_deadline == 0 || ticket.deadline < stats.next_deadline )
+                {
+                    stats.next_deadline = ticket.deadline;
+                }
+            }
+            return stats;
+        }
+
+        /**
+         * @return - last time the renewal thread waited for a ticket, it is not updated
+         *           while the thread is stuck elsewhere
+         */
+        time_t heartbeat() const
+        {
+            return heartbeat_.load( std::memory_order_relaxed );
+        }
+
+      private:
+        struct scheduled_ticket_t
+        {
+            krb_ticket_info krb_ticket;
+            uint64_t generation = 0;
+            time_t deadline = 0;
+            // returned by wait_for_due and not re-armed yet
+            bool due = false;
+            // the last renewal failed
+            bool failed = false;
+            // missed deadline of a ticket whose renewals failed since, 0 once renewed
+            time_t overdue_since = 0;
+        };
+
+        struct heap_entry_t
+        {
+            time_t deadline;
+            uint64_t generation;
+            std::string krb_file_path;
+
+            bool operator>( const heap_entry_t& other ) const
+            {
+                return deadline > other.deadline;
+            }
+        };
+
+        void push( const std::string& krb_file_path, scheduled_ticket_t& ticket, time_t deadline )
+        {
+            ticket.generation = ++generation_;
+            ticket.deadline = deadline;
+            ticket.due = false;
+            deadlines_.push( { deadline, ticket.generation, krb_file_path } );
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::unordered_map<std::string, scheduled_ticket_t> tickets_;
+        std::priority_queue<heap_entry_t, std::vector<heap_entry_t>, std::greater<heap_entry_t>>
+            deadlines_;
+        uint64_t generation_ = 0;
+        bool stopped_ = false;
+        std::atomic<time_t> heartbeat_{ time( nullptr ) };
+    };
+} // namespace creds_fetcher
+
+// tickets of the leases, shared by the gRPC service and the renewal thread
+extern creds_fetcher::RenewalScheduler krb_renewal_scheduler;
+
+#endif // _renewal_scheduler_h_
@@ -0,0 +1,112 @@
+#ifndef _single_flight_h_
+#define _single_flight_h_
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace creds_fetcher
+{
+    /**
+     * SingleFlight - coalesces concurrent calls with the same key. The first caller
+     * runs the function, the callers that arrive while it is running wait and get
+     * the same result instead of repeating the work.
+     */
+    template <typename Result> class SingleFlight
+    {
+      public:
+        SingleFlight() = default;
+
+        SingleFlight( const SingleFlight& ) = delete;
+        SingleFlight& operator=( const SingleFlight& ) = delete;
+
+        /**
+         * Run fn unless a call with the same key is in flight
+         * @param key - identifies the work, such as the principal of the ticket
+         * @param fn - work to be done
+         * @return - pair of the result and true if this call ran fn, false if the
+         *           result was shared from the call in flight
+         */
+        std::pair<Result, bool> run( const std::string& key, const std::function<Result()>& fn )
+        {
+            std::shared_ptr<flight_t> flight;
+            bool leader = false;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                auto it = flights_.find( key );
+                if ( it == flights_.end() )
+                {
+                    flight = std::make_shared<flight_t>();
+                    flights_[key] = flight;
+                    leader = true;
+                }
+                else
+                {
+                    flight = it->second;
+                }
+            }
+
+            if ( !leader )
+            {
+                std::unique_lock<std::mutex> lock( flight->mutex );
+                flight->cond.wait( lock, [&flight]() { return flight->done; } );
+                if ( !flight->failed )
+                {
+                    return std::make_pair( flight->result, false );
+                }
+                // the call in flight threw, there is no result to share
+                lock.unlock();
+                return std::make_pair( fn(), true );
+            }
+
+            Result result;
+            try
+            {
+                result = fn();
+            }
+            catch ( ... )
+            {
+                complete( key, flight, Result(), true );
+                throw;
+            }
+            complete( key, flight, result, false );
+
+            return std::make_pair( result, true );
+        }
+
+      private:
+        struct flight_t
+        {
+            std::mutex mutex;
+            std::condition_variable cond;
+            bool done = false;
+            bool failed = false;
+            Result result;
+        };
+
+        void complete( const std::string& key, const std::shared_ptr<flight_t>& flight,
+                       const Result& result, bool failed )
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                flights_.erase( key );
+            }
+            {
+                std::lock_guard<std::mutex> lock( flight->mutex );
+                flight->result = result;
+                flight->failed = failed;
+                flight->done = true;
+            }
+            flight->cond.notify_all();
+        }
+
+        std::mutex mutex_;
+        std::map<std::string, std::shared_ptr<flight_t>> flights_;
+    };
+} // namespace creds_fetcher
+
+#endif // _single_flight_h_
@@ -0,0 +1,191 @@
+#ifndef _tgt_cache_h_
+#define _tgt_cache_h_
+
+#include "daemon.h"
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// private ccaches of the daemon holding the machine or domainless user TGTs that the
+// ldap searches bind with, named after the credentials and numbered per acquisition
+#define HOST_TGT_CCACHE_PREFIX "MEMORY:credentials_fetcher_host_tgt_"
+// the cached TGT is replaced when it expires within this time
+#define HOST_TGT_REFRESH_MARGIN_SECONDS 600
+
+namespace creds_fetcher
+{
+    /**
+     * A machine or domainless user TGT, the ccache is destroyed when the last
+     * reference is dropped so that a search in progress keeps binding with it
+     * even if the TGT of the credentials has been replaced in the meantime.
+     */
+    struct host_tgt_t
+    {
+        // identifies the principal and the credentials, such as 'host:EC2AMAZ$@CONTOSO.COM'
+        std::string credentials_key;
+        // MEMORY ccache holding the TGT
+        std::string krb_cc_name;
+        time_t endtime = 0;
+
+        ~host_tgt_t()
+        {
+            krb5_context context = nullptr;
+            krb5_ccache ccache = nullptr;
+            if ( krb5_init_context( &context ) != 0 )
+            {
+                return;
+            }
+            if ( krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache ) == 0 )
+            {
+                krb5_cc_destroy( context, ccache );
+            }
+            krb5_free_context( context );
+        }
+    };
+
+    /**
+     * TgtCache - the machine or domainless user TGTs used to bind to ldap, one per
+     * credentials. A new TGT is only acquired when the cached one is about to expire
+     * or was rejected, so that lease creations and renewals do not each go to the KDC.
+     * A new TGT goes to a new ccache, the callers keep the reference they got until
+     * their ldap search is done.
+     */
+    class TgtCache
+    {
+      public:
+        typedef std::function<std::pair<int, std::string>( const std::string& krb_cc_name )>
+            acquire_fn_t;
+
+        /**
+         * @param krb_cc_prefix - prefix of the ccaches holding the TGTs
+         * @param refresh_margin - seconds before the expiry at which a TGT is replaced
+         */
+        TgtCache( const std::string& krb_cc_prefix, time_t refresh_margin )
+            : krb_cc_prefix_( krb_cc_prefix ), refresh_margin_( refresh_margin )
+        {
+        }
+
+        TgtCache( const TgtCache& ) = delete;
+        TgtCache& operator=( const TgtCache& ) = delete;
+
+        /**
+         * Get a valid TGT for the credentials
+         * @param credentials_key - identifies the principal and the credentials used,
+         *                          such as 'host:EC2AMAZ$@CONTOSO.COM'
+         * @param acquire - gets a TGT into the ccache, called when the cached one
+         *                  cannot be used
+         * @param host_tgt - set to the TGT if successful
+         * @return - pair of result and error message, 0 if successful
+         */
+        std::pair<int, std::string> get( const std::string& credentials_key,
+                                         const acquire_fn_t& acquire, host_tgt_ref_t& host_tgt )
+        {
+            std::shared_ptr<entry_t> entry;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                std::shared_ptr<entry_t>& slot = entries_[credentials_key];
+                if ( slot == nullptr )
+                {
+                    slot = std::make_shared<entry_t>();
+                }
+                entry = slot;
+            }
+
+            // only the requests for the same credentials wait for the KDC
+            std::lock_guard<std::mutex> entry_lock( entry->mutex );
+            if ( entry->tgt != nullptr &&
+                 entry->tgt->endtime - time( nullptr ) > refresh_margin_ )
+            {
+                host_tgt = entry->tgt;
+                return std::make_pair( EXIT_SUCCESS, std::string( "" ) );
+            }
+
+            std::shared_ptr<host_tgt_t> tgt = std::make_shared<host_tgt_t>();
+            tgt->credentials_key = credentials_key;
+            tgt->krb_cc_name = ccache_name( credentials_key );
+            std::pair<int, std::string> result = acquire( tgt->krb_cc_name );
+            if ( result.first != 0 )
+            {
+                return result;
+            }
+
+            std::pair<int, krb_ticket_times> ticket_times = get_ticket_times( tgt->krb_cc_name );
+            if ( ticket_times.first == 0 )
+            {
+                tgt->endtime = ticket_times.second.endtime;
+            }
+            entry->tgt = tgt;
+            host_tgt = tgt;
+            return result;
+        }
+
+        /**
+         * The next get for the credentials of the TGT acquires a new one, used when
+         * the TGT was rejected. Nothing is done if it was already replaced.
+         * @param host_tgt - TGT returned by get
+         */
+        void invalidate( const host_tgt_ref_t& host_tgt )
+        {
+            if ( host_tgt == nullptr )
+            {
+                return;
+            }
+
+            std::shared_ptr<entry_t> entry;
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                auto it = entries_.find( host_tgt->credentials_key );
+                if ( it == entries_.end() )
+                {
+                    return;
+                }
+                entry = it->second;
+            }
+
+            std::lock_guard<std::mutex> entry_lock( entry->mutex );
+            if ( entry->tgt == host_tgt )
+            {
+                entry->tgt.reset();
+            }
+        }
+
+      private:
+        /**
+         * @return - new ccache named after the digest of the credentials, the key can
+         *           hold a password digest and is not used as is
+         */
+        std::string ccache_name( const std::string& credentials_key )
+        {
+            gchar* key_digest =
+                g_compute_checksum_for_string( G_CHECKSUM_SHA256, credentials_key.c_str(), -1 );
+            std::string krb_cc_name = krb_cc_prefix_ +
+                                      std::string( key_digest != nullptr ? key_digest : "" ) +
+                                      "_" + std::to_string( next_ccache_id_++ );
+            g_free( key_digest );
+            return krb_cc_name;
+        }
+
+        struct entry_t
+        {
+            std::mutex mutex;
+            host_tgt_ref_t tgt;
+        };
+
+        // guards entries_, the TGT of an entry is guarded by the entry mutex
+        std::mutex mutex_;
+        std::map<std::string, std::shared_ptr<entry_t>> entries_;
+        std::string krb_cc_prefix_;
+        time_t refresh_margin_;
+        std::atomic<uint64_t> next_ccache_id_{ 0 };
+    };
+} // namespace creds_fetcher
+
+// TGTs the daemon binds to ldap with
+extern creds_fetcher::TgtCache host_tgt_cache;
+
+#endif // _tgt_cache_h_
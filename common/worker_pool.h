@@ -0,0 +1,145 @@
+#ifndef _worker_pool_h_
+#define _worker_pool_h_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace creds_fetcher
+{
+    /**
+     * WorkerPool - fixed number of threads draining a bounded queue of tasks.
+     * It is used to move blocking kerberos/ldap work off the threads that
+     * must stay responsive, such as the gRPC completion queue threads.
+     */
+    class WorkerPool
+    {
+      public:
+        /**
+         * @param num_workers - number of threads running the tasks
+         * @param max_queued - tasks that can wait for a free worker, further
+         *                     submits are rejected
+         */
+        WorkerPool( size_t num_workers, size_t max_queued )
+            : max_queued_( max_queued )
+        {
+            if ( num_workers == 0 )
+            {
+                num_workers = 1;
+            }
+            for ( size_t i = 0; i < num_workers; i++ )
+            {
+                workers_.emplace_back( [this]() { run(); } );
+            }
+        }
+
+        /**
+         * The tasks still queued are run before the workers are joined, a task that
+         * must not outlive the owner of the pool checks whether it is stopping
+         */
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                stopped_ = true;
+            }
+            cond_.notify_all();
+            for ( auto& worker : workers_ )
+            {
+                worker.join();
+            }
+        }
+
+        WorkerPool( const WorkerPool& ) = delete;
+        WorkerPool& operator=( const WorkerPool& ) = delete;
+
+        /**
+         * Queue a task for one of the workers
+         * @param task - work to be done
+         * @return - false if the queue is full or the pool is stopped
+         */
+        bool submit( std::function<void()> task )
+        {
+            {
+                std::lock_guard<std::mutex> lock( mutex_ );
+                if ( stopped_ || tasks_.size() >= max_queued_ )
+                {
+                    return false;
+                }
+                tasks_.push_back( std::move( task ) );
+            }
+            cond_.notify_one();
+            return true;
+        }
+
+        /**
+         * @return - number of tasks waiting for a worker
+         */
+        size_t queue_depth()
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            return tasks_.size();
+        }
+
+        /**
+         * @return - number of tasks currently being run
+         */
+        size_t active_workers()
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            return active_;
+        }
+
+        size_t num_workers() const
+        {
+            return workers_.size();
+        }
+
+      private:
+        void run()
+        {
+            while ( true )
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock( mutex_ );
+                    cond_.wait( lock, [this]() { return stopped_ || !tasks_.empty(); } );
+                    if ( stopped_ && tasks_.empty() )
+                    {
+                        return;
+                    }
+                    task = std::move( tasks_.front() );
+                    tasks_.pop_front();
+                    active_++;
+                }
+
+                try
+                {
+                    task();
+                }
+                catch ( const std::exception& ex )
+                {
+                    std::cerr << "Exception in worker: '" << ex.what() << "'" << std::endl;
+                }
+
+                std::lock_guard<std::mutex> lock( mutex_ );
+                active_--;
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<std::function<void()>> tasks_;
+        std::vector<std::thread> workers_;
+        size_t max_queued_;
+        size_t active_ = 0;
+        bool stopped_ = false;
+    };
+} // namespace creds_fetcher
+
+#endif // _worker_pool_h_
@@ -69,6 +69,12 @@ int parse_options( int argc, const char* argv[], creds_fetcher::Daemon& cf_daemo
                                          { "verbosity", required_argument, nullptr, 'v' },
                                          { "aws_sm_secret_name", required_argument, nullptr, 's' },
                                          { "version", no_argument, nullptr, 'n' },
+                                         { "grpc_threads", required_argument, nullptr, 'g' },
+                                         { "rpc_workers", required_argument, nullptr, 'w' },
+                                         { "rpc_queue_size", required_argument, nullptr, 'q' },
+                                         { "renewal_workers", required_argument, nullptr, 'r' },
+                                         { "renewal_domain_concurrency", required_argument, nullptr, 'c' },
+                                         { "renewal_timeout", required_argument, nullptr, 'o' },
                                          { nullptr, 0, nullptr, 0 } };
         std::map<std::string, std::string> options_descriptions{
             { "help", "produce help message" },
@@ -76,9 +82,20 @@ int parse_options( int argc, const char* argv[], creds_fetcher::Daemon& cf_daemo
             { "verbosity", "set verbosity level" },
             { "aws_sm_secret_name", "Name of secret containing username/password in AWS Secrets "
                                     "Manager (in same region)" },
-            { "version", "Version of credentials-fetcher" } };
+            { "version", "Version of credentials-fetcher" },
+            { "grpc_threads", "Number of gRPC completion queues, each served by its own thread "
+                              "(default 4)" },
+            { "rpc_workers", "Number of threads doing the kerberos/ldap work of the rpcs "
+                             "(default 8)" },
+            { "rpc_queue_size", "Number of rpcs that can wait for a worker before new rpcs "
+                                "are rejected (default 256)" },
+            { "renewal_workers", "Number of threads renewing the kerberos tickets (default 8)" },
+            { "renewal_domain_concurrency", "Number of tickets of the same domain renewed at the "
+                                            "same time (default 4)" },
+            { "renewal_timeout", "Seconds a ticket renewal can take, retries included "
+                                 "(default 120)" } };
         int option;
-        while ( ( option = getopt_long( argc, (char* const*)argv, "htv:s:n", long_options, nullptr ) ) != -1 )
+        while ( ( option = getopt_long( argc, (char* const*)argv, "htv:s:ng:w:q:r:c:o:", long_options, nullptr ) ) != -1 )
         {
             switch ( option )
             {
@@ -100,6 +117,60 @@ int parse_options( int argc, const char* argv[], creds_fetcher::Daemon& cf_daemo
             case 'n':
                 std::cout << CMAKE_PROJECT_VERSION << std::endl;
                 return EXIT_FAILURE;
+            case 'g':
+                cf_daemon.grpc_completion_queues = std::stoi( optarg );
+                if ( cf_daemon.grpc_completion_queues <= 0 )
+                {
+                    std::cout << "grpc_threads must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Number of gRPC threads was set to " << optarg << std::endl;
+                break;
+            case 'w':
+                cf_daemon.rpc_workers = std::stoi( optarg );
+                if ( cf_daemon.rpc_workers <= 0 )
+                {
+                    std::cout << "rpc_workers must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Number of rpc workers was set to " << optarg << std::endl;
+                break;
+            case 'q':
+                cf_daemon.rpc_max_queued = std::stoi( optarg );
+                if ( cf_daemon.rpc_max_queued <= 0 )
+                {
+                    std::cout << "rpc_queue_size must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "rpc queue size was set to " << optarg << std::endl;
+                break;
+            case 'r':
+                cf_daemon.renewal_workers = std::stoi( optarg );
+                if ( cf_daemon.renewal_workers <= 0 )
+                {
+                    std::cout << "renewal_workers must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Number of renewal workers was set to " << optarg << std::endl;
+                break;
+            case 'c':
+                cf_daemon.renewal_domain_concurrency = std::stoi( optarg );
+                if ( cf_daemon.renewal_domain_concurrency <= 0 )
+                {
+                    std::cout << "renewal_domain_concurrency must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Renewals per domain was set to " << optarg << std::endl;
+                break;
+            case 'o':
+                cf_daemon.renewal_timeout_seconds = std::stoi( optarg );
+                if ( cf_daemon.renewal_timeout_seconds <= 0 )
+                {
+                    std::cout << "renewal_timeout must be greater than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Renewal timeout was set to " << optarg << " seconds" << std::endl;
+                break;
             default:
                 std::cout << "Run with --help to see options" << std::endl;
                 return EXIT_FAILURE;
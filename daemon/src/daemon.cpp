@@ -1,8 +1,20 @@
 #include "daemon.h"
+#include "health.h"
+#include "lease_registry.h"
+#include "metadata_watcher.h"
+#include "renewal_scheduler.h"
 #include <iostream>
+#include <chrono>
 #include <libgen.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 creds_fetcher::Daemon cf_daemon;
 
@@ -15,11 +27,6 @@ struct thread_info
 
 static const char* grpc_thread_name = "grpc_thread";
 
-static void systemd_shutdown_signal_catcher( int signo )
-{
-    cf_daemon.got_systemd_shutdown_signal = 1;
-}
-
 #define handle_error_en( en, msg )                                                                 \
     do                                                                                             \
     {                                                                                              \
@@ -34,6 +41,80 @@ static void systemd_shutdown_signal_catcher( int signo )
     } while ( 0 )
 
 #define ENV_CF_CRED_SPEC_FILE "CF_CRED_SPEC_FILE"
+// events handled by one epoll_wait of the main loop
+#define MAIN_LOOP_MAX_EVENTS 8
+// prometheus metrics are served over http on this socket in the unix socket directory
+#define METRICS_SOCKET_NAME "credentials_fetcher_metrics.sock"
+// time a scraper has to send its request and read the reply, the connection is closed after
+#define METRICS_SOCKET_TIMEOUT_MSECS 500
+// longest http request read from a scraper, the request is not interpreted
+#define METRICS_REQUEST_MAX_SIZE 4096
+
+/**
+ * The metadata file of a lease was written in the krb directory, such as by a
+ * restored backup, the tickets of the lease are renewed from now on
+ * @param lease_id - lease of the metadata file
+ * @param metadata_file_path - path of the metadata file
+ */
+static void lease_metadata_changed( const std::string& lease_id,
+                                    const std::string& metadata_file_path )
+{
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets =
+        read_meta_data_json( metadata_file_path );
+    if ( krb_tickets.empty() )
+    {
+        return;
+    }
+
+    std::vector<creds_fetcher::krb_ticket_info> lease_tickets =
+        lease_registry.get_lease( lease_id );
+    bool unchanged = lease_tickets.size() == krb_tickets.size();
+    for ( size_t i = 0; unchanged && i < krb_tickets.size(); i++ )
+    {
+        unchanged = lease_tickets[i].krb_file_path == krb_tickets[i].krb_file_path;
+    }
+    if ( unchanged )
+    {
+        return;
+    }
+
+    creds_fetcher::log_fields_t log_fields;
+    log_fields.lease_id = lease_id;
+    cf_daemon.cf_logger.logger( LOG_INFO, log_fields, "lease %s was changed in %s",
+                                lease_id.c_str(), metadata_file_path.c_str() );
+    for ( const auto& krb_ticket : lease_tickets )
+    {
+        krb_renewal_scheduler.remove( krb_ticket.krb_file_path );
+    }
+    for ( const auto& krb_ticket : krb_tickets )
+    {
+        schedule_krb_ticket_renewal( krb_ticket );
+    }
+    lease_registry.add_lease( lease_id, std::move( krb_tickets ) );
+}
+
+/**
+ * The metadata file or the directory of a lease was removed from the krb directory,
+ * its tickets are no longer renewed
+ * @param lease_id - lease that was removed
+ */
+static void lease_removed( const std::string& lease_id )
+{
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets =
+        lease_registry.remove_lease( lease_id );
+    if ( krb_tickets.empty() )
+    {
+        return;
+    }
+
+    creds_fetcher::log_fields_t log_fields;
+    log_fields.lease_id = lease_id;
+    cf_daemon.cf_logger.logger( LOG_INFO, log_fields, "lease %s was removed", lease_id.c_str() );
+    for ( const auto& krb_ticket : krb_tickets )
+    {
+        krb_renewal_scheduler.remove( krb_ticket.krb_file_path );
+    }
+}
 
 /**
  * grpc_thread_start - used in pthread_create
@@ -48,7 +129,9 @@ void* grpc_thread_start( void* arg )
             tinfo->argv_string );
 
     RunGrpcServer( cf_daemon.unix_socket_dir, cf_daemon.krb_files_dir, cf_daemon.cf_logger,
-                   &cf_daemon.got_systemd_shutdown_signal, cf_daemon.aws_sm_secret_name );
+                   cf_daemon.shutdown_fd, cf_daemon.aws_sm_secret_name,
+                   cf_daemon.grpc_completion_queues, cf_daemon.rpc_workers,
+                   cf_daemon.rpc_max_queued );
 
     return tinfo->argv_string;
 }
@@ -135,6 +218,342 @@ std::pair<int, void*> create_pthread( void* ( *func )(void*), const char* pthrea
     return std::make_pair( EXIT_SUCCESS, tinfo );
 }
 
+/**
+ * Add a descriptor to the epoll set of the main loop
+ * @return - 0 if successful
+ */
+static int add_epoll_fd( int epoll_fd, int fd )
+{
+    struct epoll_event event;
+    memset( &event, 0, sizeof( event ) );
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event );
+}
+
+/**
+ * Create a timer that expires periodically, starting one interval from now
+ * @param interval_usecs - interval between the expirations
+ * @return - timer descriptor, -1 if it cannot be created
+ */
+static int open_interval_timer( uint64_t interval_usecs )
+{
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = interval_usecs / 1000000;
+    interval.it_interval.tv_nsec = ( interval_usecs % 1000000 ) * 1000;
+    interval.it_value = interval.it_interval;
+    int timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( timer_fd >= 0 && timerfd_settime( timer_fd, 0, &interval, NULL ) != 0 )
+    {
+        close( timer_fd );
+        return -1;
+    }
+    return timer_fd;
+}
+
+/**
+ * Take a new health snapshot for HealthCheck from the renewal state, a ticket due
+ * for longer than the renewal timeout makes the daemon degraded
+ */
+static void refresh_health()
+{
+    creds_fetcher::HealthMonitor::instance().refresh( krb_renewal_scheduler.stats(),
+                                                      krb_renewal_scheduler.heartbeat(),
+                                                      cf_daemon.renewal_timeout_seconds );
+}
+
+/**
+ * Listen on the metrics socket, a socket left by a previous run is replaced. Like the
+ * gRPC socket, it is only usable by the owner and the group of the socket directory.
+ * @param socket_path - Like '/var/credentials-fetcher/socket/credentials_fetcher_metrics.sock'
+ * @return - listening socket, -1 if it cannot be created
+ */
+static int open_metrics_socket( const std::string& socket_path )
+{
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( socket_path.size() >= sizeof( addr.sun_path ) )
+    {
+        return -1;
+    }
+    strncpy( addr.sun_path, socket_path.c_str(), sizeof( addr.sun_path ) - 1 );
+
+    int listen_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( listen_fd < 0 )
+    {
+        return -1;
+    }
+    unlink( socket_path.c_str() );
+    if ( bind( listen_fd, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 )
+    {
+        close( listen_fd );
+        return -1;
+    }
+
+    // the permissions are set before any client can connect
+    struct stat dir_stat;
+    std::string socket_dir = std::filesystem::path( socket_path ).parent_path().string();
+    if ( stat( socket_dir.c_str(), &dir_stat ) != 0 ||
+         chown( socket_path.c_str(), (uid_t)-1, dir_stat.st_gid ) != 0 ||
+         chmod( socket_path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP ) != 0 ||
+         listen( listen_fd, SOMAXCONN ) != 0 )
+    {
+        close( listen_fd );
+        unlink( socket_path.c_str() );
+        return -1;
+    }
+    return listen_fd;
+}
+
+/**
+ * Wait until a scraper connection is ready or its deadline has passed
+ * @param client_fd - non-blocking connection of the scraper
+ * @param events - POLLIN or POLLOUT
+ * @param deadline - end of the time given to the connection
+ * @return - true if the connection is ready
+ */
+static bool wait_metrics_client( int client_fd, short events,
+                                 std::chrono::steady_clock::time_point deadline )
+{
+    while ( true )
+    {
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now() );
+        if ( timeout.count() <= 0 )
+        {
+            return false;
+        }
+        struct pollfd client_pollfd = { client_fd, events, 0 };
+        int ret = poll( &client_pollfd, 1, (int)timeout.count() );
+        if ( ret >= 0 || errno != EINTR )
+        {
+            return ret > 0;
+        }
+    }
+}
+
+/**
+ * Answer a scraper with the metrics of the daemon in the prometheus text format, the
+ * connection is closed after the reply. The whole exchange is bounded by
+ * METRICS_SOCKET_TIMEOUT_MSECS however slowly the scraper sends or reads.
+ * @param client_fd - non-blocking connection of the scraper
+ */
+static void serve_metrics_client( int client_fd )
+{
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds( METRICS_SOCKET_TIMEOUT_MSECS );
+
+    // read the request headers so that closing the socket does not reset it
+    std::string request;
+    char buf[512];
+    while ( request.find( "\r\n\r\n" ) == std::string::npos &&
+            request.size() < METRICS_REQUEST_MAX_SIZE )
+    {
+        ssize_t len = read( client_fd, buf, sizeof( buf ) );
+        if ( len > 0 )
+        {
+            request.append( buf, len );
+            continue;
+        }
+        if ( len == 0 || ( errno != EAGAIN && errno != EINTR ) ||
+             !wait_metrics_client( client_fd, POLLIN, deadline ) )
+        {
+            break;
+        }
+    }
+
+    std::string body = get_prometheus_metrics();
+    std::string reply = "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: " +
+                        std::to_string( body.size() ) + "\r\nConnection: close\r\n\r\n" +
+                        body;
+    size_t written = 0;
+    while ( written < reply.size() )
+    {
+        ssize_t len =
+            send( client_fd, reply.data() + written, reply.size() - written, MSG_NOSIGNAL );
+        if ( len > 0 )
+        {
+            written += len;
+            continue;
+        }
+        if ( len == 0 || ( errno != EAGAIN && errno != EINTR ) ||
+             !wait_metrics_client( client_fd, POLLOUT, deadline ) )
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Serve the metrics socket until the daemon shuts down. It runs in its own thread so
+ * that a scraper never holds up the main loop, which pings the watchdog.
+ * @param listen_fd - metrics socket
+ * @param shutdown_fd - readable when the daemon shuts down
+ */
+static void serve_metrics_socket( int listen_fd, int shutdown_fd )
+{
+    struct pollfd pollfds[2] = { { listen_fd, POLLIN, 0 }, { shutdown_fd, POLLIN, 0 } };
+    while ( true )
+    {
+        if ( poll( pollfds, 2, -1 ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            perror( "poll" );
+            return;
+        }
+        if ( pollfds[1].revents != 0 )
+        {
+            return;
+        }
+
+        int client_fd;
+        while ( ( client_fd = accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >=
+                0 )
+        {
+            serve_metrics_client( client_fd );
+            close( client_fd );
+        }
+    }
+}
+
+/**
+ * Main loop of the daemon, it sleeps in epoll until the watchdog or the health refresh
+ * is due, a shutdown signal is received or a lease changes in the krb directory
+ * @param signal_mask - signals that shut down the daemon, blocked in all the threads
+ * @param metadata_watcher - watcher of the krb directory, not used if it is not open
+ * @return - 0 when the daemon shuts down, -1 if the loop cannot be set up
+ */
+static int run_main_loop( const sigset_t& signal_mask,
+                          creds_fetcher::MetadataWatcher& metadata_watcher )
+{
+    int epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    int signal_fd = signalfd( -1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC );
+    int timer_fd = -1;
+    int health_timer_fd = -1;
+    int status = 0;
+    if ( epoll_fd < 0 || signal_fd < 0 || add_epoll_fd( epoll_fd, signal_fd ) != 0 )
+    {
+        perror( "epoll/signalfd" );
+        status = -1;
+    }
+
+    /* The watchdog is pinged at half its interval, there is no timer without systemd */
+    if ( status == 0 && cf_daemon.watchdog_interval_usecs > 0 )
+    {
+        timer_fd = open_interval_timer( cf_daemon.watchdog_interval_usecs / 2 );
+        if ( timer_fd < 0 || add_epoll_fd( epoll_fd, timer_fd ) != 0 )
+        {
+            perror( "timerfd" );
+            status = -1;
+        }
+    }
+
+    if ( status == 0 )
+    {
+        health_timer_fd = open_interval_timer( HEALTH_REFRESH_SECONDS * 1000000ULL );
+        if ( health_timer_fd < 0 || add_epoll_fd( epoll_fd, health_timer_fd ) != 0 )
+        {
+            perror( "timerfd" );
+            status = -1;
+        }
+    }
+
+    if ( status == 0 && metadata_watcher.fd() >= 0 &&
+         add_epoll_fd( epoll_fd, metadata_watcher.fd() ) != 0 )
+    {
+        perror( "epoll_ctl" );
+        status = -1;
+    }
+
+    int watchdog_count = 0;
+    while ( status == 0 && !cf_daemon.got_systemd_shutdown_signal )
+    {
+        struct epoll_event events[MAIN_LOOP_MAX_EVENTS];
+        int num_events = epoll_wait( epoll_fd, events, MAIN_LOOP_MAX_EVENTS, -1 );
+        if ( num_events < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            perror( "epoll_wait" );
+            status = -1;
+            break;
+        }
+
+        for ( int i = 0; i < num_events; i++ )
+        {
+            int fd = events[i].data.fd;
+            if ( fd == timer_fd )
+            {
+                uint64_t expirations;
+                if ( read( timer_fd, &expirations, sizeof( expirations ) ) < 0 )
+                {
+                    continue;
+                }
+                /* Tells the service manager to update the watchdog timestamp */
+                sd_notify( 0, "WATCHDOG=1" );
+
+                /* sd_notifyf() is similar to sd_notify() but takes a printf()-like format
+                 * string plus arguments. */
+                sd_notifyf( 0, "STATUS=Watchdog notify count = %d",
+                            ++watchdog_count ); // visible in systemctl status
+            }
+            else if ( fd == health_timer_fd )
+            {
+                uint64_t expirations;
+                if ( read( health_timer_fd, &expirations, sizeof( expirations ) ) < 0 )
+                {
+                    continue;
+                }
+                refresh_health();
+            }
+            else if ( fd == signal_fd )
+            {
+                struct signalfd_siginfo siginfo;
+                while ( read( signal_fd, &siginfo, sizeof( siginfo ) ) == sizeof( siginfo ) )
+                {
+                    cf_daemon.cf_logger.logger( LOG_NOTICE, "signal %d received, shutting down",
+                                                siginfo.ssi_signo );
+                    cf_daemon.got_systemd_shutdown_signal = true;
+                }
+            }
+            else if ( fd == metadata_watcher.fd() )
+            {
+                try
+                {
+                    if ( metadata_watcher.process_events() != 0 )
+                    {
+                        fprintf( stderr, SD_CRIT "cannot read the changes in the krb directory" );
+                        epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+                        metadata_watcher.close();
+                    }
+                }
+                catch ( const std::exception& ex )
+                {
+                    std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
+                    fprintf( stderr, SD_CRIT "failed to handle a change in the krb directory" );
+                }
+            }
+        }
+    }
+
+    for ( int fd : { timer_fd, health_timer_fd, signal_fd, epoll_fd } )
+    {
+        if ( fd >= 0 )
+        {
+            close( fd );
+        }
+    }
+    return status;
+}
+
 int parse_cred_file_path(const std::string& cred_file_path, std::string& cred_file, std::string& cred_file_lease_id )
 {
     size_t colon_delim_pos;
@@ -217,18 +636,30 @@ int main( int argc, const char* argv[] )
 
     if ( cf_daemon.run_diagnostic )
     {
-        exit(  read_meta_data_json_test() ||
-              read_meta_data_invalid_json_test() || renewal_failure_krb_dir_not_found_test() ||
-              write_meta_data_json_test() );
+        exit(  test_utf16_decode() || test_dns_srv_parse() || test_ticket_times() ||
+              read_meta_data_json_test() || read_meta_data_invalid_json_test() ||
+              renewal_failure_krb_dir_not_found_test() || write_meta_data_json_test() ||
+              lease_registry_test() || lease_journal_test() ||
+              lease_metadata_binary_test() || metadata_watcher_test() ||
+              metrics_histogram_test() || health_snapshot_test() );
     }
 
-    struct sigaction sa;
-    cf_daemon.got_systemd_shutdown_signal = 0;
-    memset( &sa, 0, sizeof( struct sigaction ) );
-    sa.sa_handler = &systemd_shutdown_signal_catcher;
-    if ( sigaction( SIGTERM, &sa, NULL ) == -1 )
+    /* SIGTERM and SIGHUP are read from a signalfd by the main loop, they are blocked
+     * before any thread is created so that no other thread takes them */
+    sigset_t signal_mask;
+    sigemptyset( &signal_mask );
+    sigaddset( &signal_mask, SIGTERM );
+    sigaddset( &signal_mask, SIGHUP );
+    if ( pthread_sigmask( SIG_BLOCK, &signal_mask, NULL ) != 0 )
+    {
+        perror( "pthread_sigmask" );
+        return EXIT_FAILURE;
+    }
+    cf_daemon.got_systemd_shutdown_signal = false;
+    cf_daemon.shutdown_fd = eventfd( 0, EFD_CLOEXEC );
+    if ( cf_daemon.shutdown_fd < 0 )
     {
-        perror( "sigaction" );
+        perror( "eventfd" );
         return EXIT_FAILURE;
     }
 
@@ -237,6 +668,19 @@ int main( int argc, const char* argv[] )
     // 2. grpc server
     // 3. timer to run every 45 min
 
+    /* Leases created before the daemon was restarted */
+    size_t num_leases = lease_registry.load( cf_daemon.krb_files_dir );
+    cf_daemon.cf_logger.logger( LOG_INFO, "%zu leases found in %s", num_leases,
+                                cf_daemon.krb_files_dir.c_str() );
+
+    /* Leases changed in the krb directory while the daemon runs */
+    creds_fetcher::MetadataWatcher metadata_watcher( lease_metadata_changed, lease_removed );
+    if ( metadata_watcher.open( cf_daemon.krb_files_dir ) != 0 )
+    {
+        cf_daemon.cf_logger.logger( LOG_WARNING, "cannot watch %s for lease changes",
+                                    cf_daemon.krb_files_dir.c_str() );
+    }
+
     if ( !cf_daemon.cred_file.empty() ) {
         cf_daemon.cf_logger.logger( LOG_INFO, "Credential file exists %s", cf_daemon.cred_file.c_str() );
         
@@ -271,8 +715,6 @@ int main( int argc, const char* argv[] )
     krb_refresh_pthread = pthread_status.second;
     cf_daemon.cf_logger.logger( LOG_INFO, "krb refresh pthread is at %p", krb_refresh_pthread );
 
-    cf_daemon.cf_logger.set_log_level( LOG_NOTICE );
-
     char* daemon_started_by_systemd = getenv( "CREDENTIALS_FETCHERD_STARTED_BY_SYSTEMD" );
 
     if ( daemon_started_by_systemd != NULL )
@@ -302,22 +744,58 @@ int main( int argc, const char* argv[] )
         }
     }
 
+    std::string metrics_socket_path = cf_daemon.unix_socket_dir + "/" + METRICS_SOCKET_NAME;
+    int metrics_fd = open_metrics_socket( metrics_socket_path );
+    if ( metrics_fd < 0 )
+    {
+        cf_daemon.cf_logger.logger( LOG_WARNING, "cannot serve metrics on %s",
+                                    metrics_socket_path.c_str() );
+    }
+    std::thread metrics_thread;
+    if ( metrics_fd >= 0 )
+    {
+        metrics_thread = std::thread( serve_metrics_socket, metrics_fd, cf_daemon.shutdown_fd );
+    }
+
+    // HealthCheck reports STARTING until the first snapshot
+    refresh_health();
+
     /* Tells the service manager that service startup is finished */
     sd_notify( 0, "READY=1" );
-    int i = 0;
-    while ( !cf_daemon.got_systemd_shutdown_signal )
+    int loop_status = run_main_loop( signal_mask, metadata_watcher );
+
+    sd_notify( 0, "STOPPING=1" );
+    cf_daemon.got_systemd_shutdown_signal = true;
+    // wake up the gRPC server and the metrics thread polling the shutdown eventfd and
+    // the renewal thread waiting for the next ticket deadline
+    uint64_t shutdown_event = 1;
+    if ( write( cf_daemon.shutdown_fd, &shutdown_event, sizeof( shutdown_event ) ) < 0 )
     {
-        usleep( cf_daemon.watchdog_interval_usecs / 2 ); /* TBD: Replace this later */
-        /* Tells the service manager to update the watchdog timestamp */
-        sd_notify( 0, "WATCHDOG=1" );
-
-        /* sd_notifyf() is similar to sd_notify() but takes a printf()-like format string plus
-         * arguments. */
-        sd_notifyf( 0, "STATUS=Watchdog notify count = %d",
-                    i ); // TBD: Remove later, visible in systemctl status
-        ++i;
+        perror( "write" );
+    }
+    krb_renewal_scheduler.stop();
+    metadata_watcher.close();
+    if ( metrics_fd >= 0 )
+    {
+        metrics_thread.join();
+        close( metrics_fd );
+        unlink( metrics_socket_path.c_str() );
+    }
+    // the gRPC server returns once its completion queues are drained and the renewal
+    // thread once the renewals in progress are done, they still log until then
+    for ( void* pthread : { grpc_pthread, krb_refresh_pthread } )
+    {
+        struct thread_info* tinfo = (struct thread_info*)pthread;
+        int status = pthread_join( tinfo->thread_id, nullptr );
+        if ( status != 0 )
+        {
+            handle_error_en( status, "pthread_join" );
+        }
+        free( tinfo );
     }
+    // write the logs still queued, later ones are written by the thread logging them
+    creds_fetcher::AsyncJournal::instance().stop();
 
-    return EXIT_SUCCESS;
+    return loop_status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
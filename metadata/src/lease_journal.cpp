@@ -0,0 +1,293 @@
+#include "lease_journal.h"
+#include "metrics.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sys/stat.h>
+
+#define LEASE_RECORD_ADD "add"
+#define LEASE_RECORD_REMOVE "remove"
+
+static std::string read_file( const std::string& file_path )
+{
+    std::ifstream file( file_path, std::ios::binary );
+    return std::string( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+}
+
+std::string creds_fetcher::encode_lease_record( const std::string& op,
+                                                const std::string& lease_id,
+                                                const std::vector<krb_ticket_info>& krb_tickets )
+{
+    Json::Value record;
+    record["op"] = op;
+    record["lease_id"] = lease_id;
+    if ( op == LEASE_RECORD_ADD )
+    {
+        Json::Value krb_ticket_info_parent( Json::arrayValue );
+        for ( const auto& krb_ticket : krb_tickets )
+        {
+            Json::Value ticket_info;
+            ticket_info["krb_file_path"] = krb_ticket.krb_file_path;
+            ticket_info["service_account_name"] = krb_ticket.service_account_name;
+            ticket_info["domain_name"] = krb_ticket.domain_name;
+            ticket_info["domainless_user"] = krb_ticket.domainless_user;
+            krb_ticket_info_parent.append( ticket_info );
+        }
+        record["krb_ticket_info"] = krb_ticket_info_parent;
+    }
+
+    // one record per line
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    std::string json = Json::writeString( writer, record );
+
+    char crc_hex[9];
+    snprintf( crc_hex, sizeof( crc_hex ), "%08x", compute_crc32( json.data(), json.size() ) );
+    return std::string( crc_hex ) + " " + json;
+}
+
+size_t creds_fetcher::replay_lease_records( const std::string& contents,
+                                            LeaseJournal::leases_t& leases )
+{
+    size_t valid_bytes = 0;
+    Json::CharReaderBuilder reader_builder;
+    std::unique_ptr<Json::CharReader> reader( reader_builder.newCharReader() );
+
+    while ( valid_bytes < contents.size() )
+    {
+        size_t end = contents.find( '\n', valid_bytes );
+        // a record without its newline was not completely written
+        if ( end == std::string::npos || end - valid_bytes < 10 ||
+             contents[valid_bytes + 8] != ' ' )
+        {
+            break;
+        }
+
+        std::string crc_hex = contents.substr( valid_bytes, 8 );
+        const char* json_begin = contents.data() + valid_bytes + 9;
+        const char* json_end = contents.data() + end;
+        char* crc_end = nullptr;
+        unsigned long crc = strtoul( crc_hex.c_str(), &crc_end, 16 );
+        if ( crc_end != crc_hex.c_str() + 8 || crc != compute_crc32( json_begin, json_end - json_begin ) )
+        {
+            break;
+        }
+
+        Json::Value record;
+        std::string errors;
+        if ( !reader->parse( json_begin, json_end, &record, &errors ) )
+        {
+            break;
+        }
+
+        std::string lease_id = record["lease_id"].asString();
+        if ( record["op"].asString() == LEASE_RECORD_ADD )
+        {
+            std::vector<krb_ticket_info> krb_tickets;
+            for ( const Json::Value& krb_info : record["krb_ticket_info"] )
+            {
+                krb_ticket_info krb_ticket;
+                krb_ticket.krb_file_path = krb_info["krb_file_path"].asString();
+                krb_ticket.service_account_name = krb_info["service_account_name"].asString();
+                krb_ticket.domain_name = krb_info["domain_name"].asString();
+                krb_ticket.domainless_user = krb_info["domainless_user"].asString();
+                krb_tickets.push_back( krb_ticket );
+            }
+            leases[lease_id] = krb_tickets;
+        }
+        else
+        {
+            leases.erase( lease_id );
+        }
+
+        valid_bytes = end + 1;
+    }
+
+    return valid_bytes;
+}
+
+creds_fetcher::LeaseJournal::~LeaseJournal()
+{
+    close();
+}
+
+std::pair<int, bool> creds_fetcher::LeaseJournal::open( const std::string& journal_dir,
+                                                        leases_t& leases )
+{
+    close();
+    journal_dir_ = journal_dir;
+    std::string snapshot_path = journal_dir + "/" + LEASE_SNAPSHOT_FILE;
+    std::string journal_path = journal_dir + "/" + LEASE_JOURNAL_FILE;
+    bool found = false;
+
+    if ( std::filesystem::exists( snapshot_path ) )
+    {
+        found = true;
+        LeaseMetadataView snapshot_view;
+        if ( snapshot_view.open( snapshot_path ) == 0 )
+        {
+            for ( size_t i = 0; i < snapshot_view.num_leases(); i++ )
+            {
+                std::vector<krb_ticket_info>& krb_tickets =
+                    leases[std::string( snapshot_view.lease_id( i ) )];
+                krb_tickets.reserve( snapshot_view.num_tickets( i ) );
+                for ( size_t j = 0; j < snapshot_view.num_tickets( i ); j++ )
+                {
+                    krb_ticket_view_t ticket_view = snapshot_view.ticket( i, j );
+                    krb_ticket_info krb_ticket;
+                    krb_ticket.krb_file_path = std::string( ticket_view.krb_file_path );
+                    krb_ticket.service_account_name =
+                        std::string( ticket_view.service_account_name );
+                    krb_ticket.domain_name = std::string( ticket_view.domain_name );
+                    krb_ticket.domainless_user = std::string( ticket_view.domainless_user );
+                    krb_tickets.push_back( krb_ticket );
+                }
+            }
+        }
+        else
+        {
+            // snapshots written before the binary format are journal records
+            std::string snapshot = read_file( snapshot_path );
+            if ( is_binary_lease_metadata( snapshot ) ||
+                 replay_lease_records( snapshot, leases ) != snapshot.size() )
+            {
+                // the snapshot is written with a rename, it is never torn
+                fprintf( stderr, SD_CRIT "lease snapshot %s is corrupt", snapshot_path.c_str() );
+            }
+        }
+    }
+
+    num_records_ = 0;
+    if ( std::filesystem::exists( journal_path ) )
+    {
+        found = true;
+        std::string journal = read_file( journal_path );
+        size_t valid_bytes = replay_lease_records( journal, leases );
+        num_records_ = std::count( journal.begin(), journal.begin() + valid_bytes, '\n' );
+        if ( valid_bytes != journal.size() )
+        {
+            // drop the record torn by a crash, the next records are appended after
+            // the last complete one
+            std::cout << "Dropping " << journal.size() - valid_bytes
+                      << " bytes from the end of " << journal_path << std::endl;
+            if ( truncate( journal_path.c_str(), valid_bytes ) != 0 )
+            {
+                return std::make_pair( -1, found );
+            }
+        }
+    }
+
+    std::filesystem::create_directories( journal_dir );
+    fd_ = ::open( journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR );
+    if ( fd_ < 0 )
+    {
+        return std::make_pair( -1, found );
+    }
+
+    return std::make_pair( EXIT_SUCCESS, found );
+}
+
+int creds_fetcher::LeaseJournal::append_add( const std::string& lease_id,
+                                             const std::vector<krb_ticket_info>& krb_tickets )
+{
+    return append( encode_lease_record( LEASE_RECORD_ADD, lease_id, krb_tickets ) );
+}
+
+int creds_fetcher::LeaseJournal::append_remove( const std::string& lease_id )
+{
+    return append( encode_lease_record( LEASE_RECORD_REMOVE, lease_id, {} ) );
+}
+
+int creds_fetcher::LeaseJournal::append( const std::string& record )
+{
+    if ( fd_ < 0 )
+    {
+        return -1;
+    }
+
+    creds_fetcher::StageTimer append_timer( creds_fetcher::METRIC_LEASE_JOURNAL_APPEND );
+    // end of the last complete record, a failed append is cut back to it so that the
+    // next records are not appended after a torn one
+    off_t record_offset = lseek( fd_, 0, SEEK_END );
+    if ( record_offset < 0 )
+    {
+        return -1;
+    }
+
+    std::string line = record + "\n";
+    size_t written = 0;
+    while ( written < line.size() )
+    {
+        ssize_t n = write( fd_, line.data() + written, line.size() - written );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            discard_torn_record( record_offset );
+            return -1;
+        }
+        written += n;
+    }
+    if ( fdatasync( fd_ ) != 0 )
+    {
+        discard_torn_record( record_offset );
+        return -1;
+    }
+
+    num_records_++;
+    append_timer.stop( true );
+    return 0;
+}
+
+void creds_fetcher::LeaseJournal::discard_torn_record( off_t record_offset )
+{
+    if ( ftruncate( fd_, record_offset ) == 0 && fdatasync( fd_ ) == 0 )
+    {
+        return;
+    }
+
+    // the records appended after the torn one would not be replayed, the journal is
+    // not used anymore
+    fprintf( stderr, SD_CRIT "cannot remove a torn record from the lease journal in %s",
+             journal_dir_.c_str() );
+    ::close( fd_ );
+    fd_ = -1;
+}
+
+int creds_fetcher::LeaseJournal::compact( const leases_t& leases )
+{
+    if ( fd_ < 0 )
+    {
+        return -1;
+    }
+
+    if ( write_file_atomically( journal_dir_ + "/" + LEASE_SNAPSHOT_FILE,
+                                encode_lease_metadata( leases ) ) != 0 )
+    {
+        return -1;
+    }
+
+    // the records are in the snapshot now, the snapshot and its directory entry were
+    // synced by write_file_atomically so the journal can be dropped
+    if ( ftruncate( fd_, 0 ) != 0 || fdatasync( fd_ ) != 0 )
+    {
+        return -1;
+    }
+    num_records_ = 0;
+
+    return 0;
+}
+
+void creds_fetcher::LeaseJournal::close()
+{
+    if ( fd_ >= 0 )
+    {
+        ::close( fd_ );
+        fd_ = -1;
+    }
+}
@@ -0,0 +1,293 @@
+#include "lease_metadata.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint32_t creds_fetcher::compute_crc32( const char* data, size_t len )
+{
+    static uint32_t table[256];
+    static bool table_ready = []() {
+        for ( uint32_t i = 0; i < 256; i++ )
+        {
+            uint32_t c = i;
+            for ( int k = 0; k < 8; k++ )
+            {
+                c = ( c & 1 ) ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)table_ready;
+
+    uint32_t crc = 0xFFFFFFFF;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        crc = table[( crc ^ (unsigned char)data[i] ) & 0xFF] ^ ( crc >> 8 );
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * Add a string to the string table
+ * @return - reference to the string in the table
+ */
+static creds_fetcher::lease_metadata_string_t add_string( std::string& strings,
+                                                          const std::string& str )
+{
+    creds_fetcher::lease_metadata_string_t table_string;
+    table_string.offset = strings.size();
+    table_string.length = str.size();
+    strings += str;
+    return table_string;
+}
+
+std::string creds_fetcher::encode_lease_metadata( const lease_map_t& leases )
+{
+    std::vector<lease_metadata_lease_t> lease_entries;
+    std::vector<lease_metadata_ticket_t> ticket_entries;
+    std::string strings;
+
+    lease_entries.reserve( leases.size() );
+    for ( const auto& lease : leases )
+    {
+        lease_metadata_lease_t lease_entry;
+        lease_entry.lease_id = add_string( strings, lease.first );
+        lease_entry.first_ticket = ticket_entries.size();
+        lease_entry.num_tickets = lease.second.size();
+        lease_entries.push_back( lease_entry );
+
+        for ( const auto& krb_ticket : lease.second )
+        {
+            lease_metadata_ticket_t ticket_entry;
+            ticket_entry.krb_file_path = add_string( strings, krb_ticket.krb_file_path );
+            ticket_entry.service_account_name =
+                add_string( strings, krb_ticket.service_account_name );
+            ticket_entry.domain_name = add_string( strings, krb_ticket.domain_name );
+            ticket_entry.domainless_user = add_string( strings, krb_ticket.domainless_user );
+            ticket_entries.push_back( ticket_entry );
+        }
+    }
+
+    std::string body;
+    body.append( (const char*)lease_entries.data(),
+                 lease_entries.size() * sizeof( lease_metadata_lease_t ) );
+    body.append( (const char*)ticket_entries.data(),
+                 ticket_entries.size() * sizeof( lease_metadata_ticket_t ) );
+    body += strings;
+
+    lease_metadata_header_t header;
+    memset( &header, 0, sizeof( header ) );
+    header.magic = LEASE_METADATA_MAGIC;
+    header.version = LEASE_METADATA_VERSION;
+    header.num_leases = lease_entries.size();
+    header.num_tickets = ticket_entries.size();
+    header.strings_size = strings.size();
+    header.crc32 = compute_crc32( body.data(), body.size() );
+
+    return std::string( (const char*)&header, sizeof( header ) ) + body;
+}
+
+bool creds_fetcher::is_binary_lease_metadata( const std::string& contents )
+{
+    uint32_t magic = LEASE_METADATA_MAGIC;
+    return contents.size() >= sizeof( magic ) &&
+           memcmp( contents.data(), &magic, sizeof( magic ) ) == 0;
+}
+
+/**
+ * Check the header, the checksum and that every string is inside the string table,
+ * the entries can then be read without further checks
+ */
+static bool validate_lease_metadata( const char* buf, size_t size )
+{
+    creds_fetcher::lease_metadata_header_t header;
+    if ( size < sizeof( header ) )
+    {
+        return false;
+    }
+    memcpy( &header, buf, sizeof( header ) );
+    if ( header.magic != LEASE_METADATA_MAGIC || header.version != LEASE_METADATA_VERSION )
+    {
+        return false;
+    }
+
+    uint64_t expected_size = sizeof( header ) +
+                             (uint64_t)header.num_leases *
+                                 sizeof( creds_fetcher::lease_metadata_lease_t ) +
+                             (uint64_t)header.num_tickets *
+                                 sizeof( creds_fetcher::lease_metadata_ticket_t ) +
+                             header.strings_size;
+    if ( expected_size != size ||
+         creds_fetcher::compute_crc32( buf + sizeof( header ), size - sizeof( header ) ) !=
+             header.crc32 )
+    {
+        return false;
+    }
+
+    auto is_valid_string = [&header]( const creds_fetcher::lease_metadata_string_t& str ) {
+        return (uint64_t)str.offset + str.length <= header.strings_size;
+    };
+    const auto* leases =
+        reinterpret_cast<const creds_fetcher::lease_metadata_lease_t*>( buf + sizeof( header ) );
+    const auto* tickets =
+        reinterpret_cast<const creds_fetcher::lease_metadata_ticket_t*>( leases +
+                                                                         header.num_leases );
+    for ( uint32_t i = 0; i < header.num_leases; i++ )
+    {
+        if ( !is_valid_string( leases[i].lease_id ) ||
+             (uint64_t)leases[i].first_ticket + leases[i].num_tickets > header.num_tickets )
+        {
+            return false;
+        }
+    }
+    for ( uint32_t i = 0; i < header.num_tickets; i++ )
+    {
+        if ( !is_valid_string( tickets[i].krb_file_path ) ||
+             !is_valid_string( tickets[i].service_account_name ) ||
+             !is_valid_string( tickets[i].domain_name ) ||
+             !is_valid_string( tickets[i].domainless_user ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+creds_fetcher::LeaseMetadataView::~LeaseMetadataView()
+{
+    close();
+}
+
+int creds_fetcher::LeaseMetadataView::open( const std::string& file_path )
+{
+    close();
+
+    int fd = ::open( file_path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( lease_metadata_header_t ) )
+    {
+        ::close( fd );
+        return -1;
+    }
+    void* map = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if ( map == MAP_FAILED )
+    {
+        return -1;
+    }
+    map_ = map;
+    map_size_ = st.st_size;
+
+    const char* buf = (const char*)map_;
+    if ( !validate_lease_metadata( buf, map_size_ ) )
+    {
+        close();
+        return -1;
+    }
+
+    // the header is at the start of the page aligned mapping, so are the entries
+    const auto* header = reinterpret_cast<const lease_metadata_header_t*>( buf );
+    num_leases_ = header->num_leases;
+    leases_ = reinterpret_cast<const lease_metadata_lease_t*>( buf + sizeof( *header ) );
+    tickets_ = reinterpret_cast<const lease_metadata_ticket_t*>( leases_ + header->num_leases );
+    strings_ = reinterpret_cast<const char*>( tickets_ + header->num_tickets );
+
+    return 0;
+}
+
+void creds_fetcher::LeaseMetadataView::close()
+{
+    if ( map_ != nullptr )
+    {
+        munmap( map_, map_size_ );
+    }
+    map_ = nullptr;
+    map_size_ = 0;
+    num_leases_ = 0;
+    leases_ = nullptr;
+    tickets_ = nullptr;
+    strings_ = nullptr;
+}
+
+std::string_view creds_fetcher::LeaseMetadataView::get_string(
+    const lease_metadata_string_t& str ) const
+{
+    return std::string_view( strings_ + str.offset, str.length );
+}
+
+std::string_view creds_fetcher::LeaseMetadataView::lease_id( size_t lease ) const
+{
+    return get_string( leases_[lease].lease_id );
+}
+
+size_t creds_fetcher::LeaseMetadataView::num_tickets( size_t lease ) const
+{
+    return leases_[lease].num_tickets;
+}
+
+creds_fetcher::krb_ticket_view_t creds_fetcher::LeaseMetadataView::ticket( size_t lease,
+                                                                          size_t ticket ) const
+{
+    const lease_metadata_ticket_t& entry = tickets_[leases_[lease].first_ticket + ticket];
+    krb_ticket_view_t ticket_view;
+    ticket_view.krb_file_path = get_string( entry.krb_file_path );
+    ticket_view.service_account_name = get_string( entry.service_account_name );
+    ticket_view.domain_name = get_string( entry.domain_name );
+    ticket_view.domainless_user = get_string( entry.domainless_user );
+    return ticket_view;
+}
+
+creds_fetcher::lease_map_t read_meta_data_json_files( const std::string& krb_files_dir )
+{
+    creds_fetcher::lease_map_t leases;
+    if ( krb_files_dir.empty() || !std::filesystem::exists( krb_files_dir ) )
+    {
+        return leases;
+    }
+
+    // each lease has its own directory with the metadata file
+    for ( const auto& lease_dir : std::filesystem::directory_iterator( krb_files_dir ) )
+    {
+        if ( !lease_dir.is_directory() )
+        {
+            continue;
+        }
+        std::string lease_id = lease_dir.path().filename().string();
+        std::string file_path = lease_dir.path().string() + "/" + lease_id + METADATA_FILE_SUFFIX;
+        if ( !std::filesystem::exists( file_path ) )
+        {
+            continue;
+        }
+
+        leases[lease_id] = read_meta_data_json( file_path );
+    }
+
+    return leases;
+}
+
+int convert_meta_data_json_to_binary( const std::string& krb_files_dir,
+                                      const std::string& binary_file_path )
+{
+    try
+    {
+        creds_fetcher::lease_map_t leases = read_meta_data_json_files( krb_files_dir );
+        if ( write_file_atomically( binary_file_path,
+                                    creds_fetcher::encode_lease_metadata( leases ) ) != 0 )
+        {
+            return -1;
+        }
+        return leases.size();
+    }
+    catch ( const std::exception& ex )
+    {
+        std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
+        fprintf( stderr, SD_CRIT "failed to convert the meta data files" );
+        return -1;
+    }
+}
@@ -0,0 +1,243 @@
+#include "lease_registry.h"
+#include <filesystem>
+
+creds_fetcher::LeaseRegistry lease_registry;
+
+size_t creds_fetcher::LeaseRegistry::load( const std::string& krb_files_dir )
+{
+    if ( krb_files_dir.empty() || !std::filesystem::exists( krb_files_dir ) )
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock( mutex_ );
+    try
+    {
+        LeaseJournal::leases_t leases;
+        std::pair<int, bool> journal_result = journal_.open( krb_files_dir, leases );
+        if ( journal_result.first != 0 )
+        {
+            fprintf( stderr, SD_CRIT "cannot open the lease journal in %s",
+                     krb_files_dir.c_str() );
+        }
+
+        if ( !journal_result.second )
+        {
+            // no journal yet, the leases are in the metadata files
+            leases = read_meta_data_json_files( krb_files_dir );
+        }
+
+        for ( const auto& lease : leases )
+        {
+            // the tickets removed from the disk by hand are not renewed
+            std::vector<krb_ticket_info> krb_tickets;
+            for ( const auto& krb_ticket : lease.second )
+            {
+                if ( std::filesystem::exists( krb_ticket.krb_file_path ) )
+                {
+                    krb_tickets.push_back( krb_ticket );
+                }
+            }
+            if ( !krb_tickets.empty() )
+            {
+                add_lease_locked( lease.first, std::move( krb_tickets ) );
+            }
+        }
+
+        if ( !journal_result.second && journal_.is_open() )
+        {
+            // the leases of the metadata files are the first snapshot
+            if ( journal_.compact( leases_ ) != 0 )
+            {
+                fprintf( stderr, SD_CRIT "cannot write the lease snapshot" );
+            }
+        }
+    }
+    catch ( const std::exception& ex )
+    {
+        std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
+        fprintf( stderr, SD_CRIT "failed to read the leases in the krb directory" );
+    }
+
+    return leases_.size();
+}
+
+void creds_fetcher::LeaseRegistry::add_lease( const std::string& lease_id,
+                                              std::vector<krb_ticket_info> krb_tickets )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    remove_lease_locked( lease_id );
+    if ( journal_.is_open() )
+    {
+        if ( journal_.append_add( lease_id, krb_tickets ) != 0 )
+        {
+            fprintf( stderr, SD_CRIT "cannot log lease %s to the lease journal",
+                     lease_id.c_str() );
+        }
+    }
+    add_lease_locked( lease_id, std::move( krb_tickets ) );
+    if ( journal_.is_open() )
+    {
+        compact_journal_locked();
+    }
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::remove_lease(
+    const std::string& lease_id )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    std::vector<krb_ticket_info> krb_tickets = remove_lease_locked( lease_id );
+    if ( !krb_tickets.empty() && journal_.is_open() )
+    {
+        if ( journal_.append_remove( lease_id ) != 0 )
+        {
+            fprintf( stderr, SD_CRIT "cannot log the removal of lease %s to the lease journal",
+                     lease_id.c_str() );
+        }
+        compact_journal_locked();
+    }
+    return krb_tickets;
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::get_lease(
+    const std::string& lease_id )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    auto it = leases_.find( lease_id );
+    if ( it == leases_.end() )
+    {
+        return std::vector<krb_ticket_info>();
+    }
+    return it->second;
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::
+    get_tickets_by_service_account( const std::string& service_account_name )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return get_tickets_locked( by_service_account_, service_account_name, true );
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::
+    get_tickets_by_domainless_user( const std::string& domainless_user )
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return get_tickets_locked( by_domainless_user_, domainless_user, false );
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::get_all_tickets()
+{
+    std::vector<krb_ticket_info> krb_tickets;
+    std::lock_guard<std::mutex> lock( mutex_ );
+    for ( const auto& lease : leases_ )
+    {
+        krb_tickets.insert( krb_tickets.end(), lease.second.begin(), lease.second.end() );
+    }
+    return krb_tickets;
+}
+
+size_t creds_fetcher::LeaseRegistry::size()
+{
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return leases_.size();
+}
+
+void creds_fetcher::LeaseRegistry::add_lease_locked( const std::string& lease_id,
+                                                     std::vector<krb_ticket_info> krb_tickets )
+{
+    std::vector<krb_ticket_info>& lease_tickets = leases_[lease_id];
+    lease_tickets = std::move( krb_tickets );
+    for ( const auto& krb_ticket : lease_tickets )
+    {
+        by_service_account_[krb_ticket.service_account_name].insert( lease_id );
+        if ( !krb_ticket.domainless_user.empty() )
+        {
+            by_domainless_user_[krb_ticket.domainless_user].insert( lease_id );
+        }
+    }
+}
+
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::remove_lease_locked(
+    const std::string& lease_id )
+{
+    auto it = leases_.find( lease_id );
+    if ( it == leases_.end() )
+    {
+        return std::vector<krb_ticket_info>();
+    }
+
+    std::vector<krb_ticket_info> krb_tickets = std::move( it->second );
+    leases_.erase( it );
+
+    auto remove_from_index =
+        []( std::unordered_map<std::string, std::unordered_set<std::string>>& index,
+            const std::string& key, const std::string& lease_id ) {
+            auto index_it = index.find( key );
+            if ( index_it != index.end() )
+            {
+                index_it->second.erase( lease_id );
+                if ( index_it->second.empty() )
+                {
+                    index.erase( index_it );
+                }
+            }
+        };
+    for ( const auto& krb_ticket : krb_tickets )
+    {
+        remove_from_index( by_service_account_, krb_ticket.service_account_name, lease_id );
+        if ( !krb_ticket.domainless_user.empty() )
+        {
+            remove_from_index( by_domainless_user_, krb_ticket.domainless_user, lease_id );
+        }
+    }
+
+    return krb_tickets;
+}
+
+/**
+ * Tickets of the leases listed in the index for the key, a lease can hold tickets
+ * of other accounts so the tickets are matched again
+ */
+std::vector<creds_fetcher::krb_ticket_info> creds_fetcher::LeaseRegistry::get_tickets_locked(
+    const std::unordered_map<std::string, std::unordered_set<std::string>>& index,
+    const std::string& key, bool match_service_account )
+{
+    std::vector<krb_ticket_info> krb_tickets;
+    auto index_it = index.find( key );
+    if ( index_it == index.end() )
+    {
+        return krb_tickets;
+    }
+
+    for ( const auto& lease_id : index_it->second )
+    {
+        for ( const auto& krb_ticket : leases_[lease_id] )
+        {
+            const std::string& ticket_key = match_service_account
+                                                ? krb_ticket.service_account_name
+                                                : krb_ticket.domainless_user;
+            if ( ticket_key == key )
+            {
+                krb_tickets.push_back( krb_ticket );
+            }
+        }
+    }
+
+    return krb_tickets;
+}
+
+/**
+ * Fold the journal into the snapshot once it has grown, so that the journal
+ * replayed at startup stays short
+ */
+void creds_fetcher::LeaseRegistry::compact_journal_locked()
+{
+    if ( !journal_.needs_compaction( leases_.size() ) )
+    {
+        return;
+    }
+    if ( journal_.compact( leases_ ) != 0 )
+    {
+        fprintf( stderr, SD_CRIT "cannot compact the lease journal" );
+    }
+}
@@ -1,4 +1,5 @@
 #include "daemon.h"
+#include "metrics.h"
 #include <filesystem>
 #include <fstream>
 #include <vector>
@@ -31,9 +32,10 @@ bool contains_invalid_characters( const std::string& path )
  * @param krb_files_dir - path of the dir for kerberos tickets
  * @return vector of kerberos ticket info
  */
-std::list<creds_fetcher::krb_ticket_info*> read_meta_data_json( std::string file_path )
+std::vector<creds_fetcher::krb_ticket_info> read_meta_data_json( std::string file_path )
 {
-    std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list;
+    std::vector<creds_fetcher::krb_ticket_info> krb_ticket_info_list;
+    creds_fetcher::StageTimer metadata_read_timer( creds_fetcher::METRIC_METADATA_READ );
     try
     {
         if ( file_path.empty() )
@@ -54,31 +56,31 @@ std::list<creds_fetcher::krb_ticket_info*> read_meta_data_json( std::string file
             // deserialize json to krb_ticket_info object
             const Json::Value& child_tree_krb_info = root["krb_ticket_info"];
 
+            krb_ticket_info_list.reserve( child_tree_krb_info.size() );
             for ( const Json::Value& krb_info : child_tree_krb_info )
             {
-                creds_fetcher::krb_ticket_info* krb_ticket_info =
-                    new creds_fetcher::krb_ticket_info;
                 std::string krb_file_path = krb_info["krb_file_path"].asString();
 
                 if ( contains_invalid_characters( krb_file_path ) )
                 {
                     fprintf( stderr, SD_CRIT "krb file path contains invalid characters" );
-                    free( krb_ticket_info );
                     break;
                 }
 
                 // only add path if it exists
                 if ( std::filesystem::exists( krb_file_path ) )
                 {
-                    krb_ticket_info->krb_file_path = krb_file_path;
-                    krb_ticket_info->service_account_name =
+                    creds_fetcher::krb_ticket_info krb_ticket_info;
+                    krb_ticket_info.krb_file_path = krb_file_path;
+                    krb_ticket_info.service_account_name =
                         krb_info["service_account_name"].asString();
-                    krb_ticket_info->domain_name = krb_info["domain_name"].asString();
-                    krb_ticket_info->domainless_user = krb_info["domainless_user"].asString();
+                    krb_ticket_info.domain_name = krb_info["domain_name"].asString();
+                    krb_ticket_info.domainless_user = krb_info["domainless_user"].asString();
 
-                    krb_ticket_info_list.push_back( krb_ticket_info );
+                    krb_ticket_info_list.push_back( std::move( krb_ticket_info ) );
                 }
             }
+            metadata_read_timer.stop( true );
         }
     }
     catch ( const std::exception& ex )
@@ -112,14 +114,11 @@ std::list<creds_fetcher::krb_ticket_info*> read_meta_data_json( std::string file
  * @return 0 or 1 for successful or failed writes
  */
 
-int write_meta_data_json( creds_fetcher::krb_ticket_info* krb_ticket_info,
+int write_meta_data_json( const creds_fetcher::krb_ticket_info& krb_ticket_info,
                           std::string lease_id, std::string krb_files_dir )
 {
-    std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list;
-
-    krb_ticket_info_list.push_back(krb_ticket_info);
-    
-    return write_meta_data_json(krb_ticket_info_list, lease_id, krb_files_dir);
+    return write_meta_data_json( std::vector<creds_fetcher::krb_ticket_info>{ krb_ticket_info },
+                                 lease_id, krb_files_dir );
 }
 
 /* @param krb_ticket_info_list - info of the kerberos tickets created
@@ -127,12 +126,14 @@ int write_meta_data_json( creds_fetcher::krb_ticket_info* krb_ticket_info,
  * @param krb_files_dir - path of the dir for kerberos tickets
  * @return 0 or 1 for successful or failed writes
  */
-int write_meta_data_json( std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list,
-                          std::string lease_id, std::string krb_files_dir )
+int write_meta_data_json(
+    const std::vector<creds_fetcher::krb_ticket_info>& krb_ticket_info_list, std::string lease_id,
+    std::string krb_files_dir )
 {
+    creds_fetcher::StageTimer metadata_write_timer( creds_fetcher::METRIC_METADATA_WRITE );
     try
     {
-        std::string meta_file_name = lease_id + "_metadata.json";
+        std::string meta_file_name = lease_id + METADATA_FILE_SUFFIX;
         std::string file_path = krb_files_dir + "/" + lease_id + "/" + meta_file_name;
 
         // create the meta file in the lease directory
@@ -143,13 +144,13 @@ int write_meta_data_json( std::list<creds_fetcher::krb_ticket_info*> krb_ticket_
         Json::Value root;
         Json::Value krb_ticket_info_parent;
 
-        for ( auto krb_ticket_info : krb_ticket_info_list )
+        for ( const auto& krb_ticket_info : krb_ticket_info_list )
         {
             Json::Value ticket_info;
-            ticket_info["krb_file_path"] = krb_ticket_info->krb_file_path;
-            ticket_info["service_account_name"] = krb_ticket_info->service_account_name;
-            ticket_info["domain_name"] = krb_ticket_info->domain_name;
-            ticket_info["domainless_user"] = krb_ticket_info->domainless_user;
+            ticket_info["krb_file_path"] = krb_ticket_info.krb_file_path;
+            ticket_info["service_account_name"] = krb_ticket_info.service_account_name;
+            ticket_info["domain_name"] = krb_ticket_info.domain_name;
+            ticket_info["domainless_user"] = krb_ticket_info.domainless_user;
 
             krb_ticket_info_parent.append( ticket_info );
         }
@@ -158,15 +159,11 @@ int write_meta_data_json( std::list<creds_fetcher::krb_ticket_info*> krb_ticket_
 
         Json::StreamWriterBuilder writer;
         std::string jsonString = Json::writeString( writer, root );
-        std::ofstream json_file( file_path );
-        if ( json_file.is_open() )
-        {
-            json_file << jsonString;
-            json_file.close();
-        }
-        else
+        // replaced with a rename, a crash never leaves a partial file
+        if ( write_file_atomically( file_path, jsonString ) != 0 )
         {
             std::cerr << "Failed to write JSON file: " << file_path << std::endl;
+            return -1;
         }
     }
     catch ( const std::exception& ex )
@@ -175,5 +172,6 @@ int write_meta_data_json( std::list<creds_fetcher::krb_ticket_info*> krb_ticket_
         fprintf( stderr, SD_CRIT "failed to write meta data file" );
         return -1;
     }
+    metadata_write_timer.stop( true );
     return 0;
 }
@@ -0,0 +1,167 @@
+#include "metadata_watcher.h"
+#include <cerrno>
+#include <climits>
+#include <sys/inotify.h>
+
+// lease directories created or removed in the krb directory
+#define KRB_DIR_EVENTS ( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR )
+// metadata file written, replaced or removed in a lease directory
+#define LEASE_DIR_EVENTS ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR )
+// room for several events with the longest file name
+#define INOTIFY_BUF_SIZE ( 16 * ( sizeof( struct inotify_event ) + NAME_MAX + 1 ) )
+
+creds_fetcher::MetadataWatcher::~MetadataWatcher()
+{
+    close();
+}
+
+int creds_fetcher::MetadataWatcher::open( const std::string& krb_files_dir )
+{
+    close();
+    krb_files_dir_ = krb_files_dir;
+    inotify_fd_ = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( inotify_fd_ < 0 )
+    {
+        return -1;
+    }
+
+    root_wd_ = inotify_add_watch( inotify_fd_, krb_files_dir.c_str(), KRB_DIR_EVENTS );
+    if ( root_wd_ < 0 )
+    {
+        fprintf( stderr, SD_CRIT "cannot watch %s: %s", krb_files_dir.c_str(),
+                 strerror( errno ) );
+        close();
+        return -1;
+    }
+
+    // the watch is in place before the walk, a lease directory created meanwhile is
+    // seen by both and only watched once
+    for ( const auto& lease_dir : std::filesystem::directory_iterator( krb_files_dir ) )
+    {
+        if ( lease_dir.is_directory() )
+        {
+            watch_lease_dir( lease_dir.path().filename().string(), false );
+        }
+    }
+
+    return 0;
+}
+
+void creds_fetcher::MetadataWatcher::watch_lease_dir( const std::string& lease_id,
+                                                      bool report_existing )
+{
+    std::string lease_dir = krb_files_dir_ + "/" + lease_id;
+    int wd = inotify_add_watch( inotify_fd_, lease_dir.c_str(), LEASE_DIR_EVENTS );
+    if ( wd < 0 )
+    {
+        // removed before it could be watched
+        return;
+    }
+    lease_dirs_[wd] = lease_id;
+
+    // the metadata file may have been written before the watch was added
+    std::string metadata_file_path = lease_dir + "/" + lease_id + METADATA_FILE_SUFFIX;
+    if ( report_existing && std::filesystem::exists( metadata_file_path ) )
+    {
+        on_metadata_changed_( lease_id, metadata_file_path );
+    }
+}
+
+void creds_fetcher::MetadataWatcher::rescan()
+{
+    std::cout << "inotify queue overflowed, rescanning " << krb_files_dir_ << std::endl;
+    for ( const auto& lease_dir : std::filesystem::directory_iterator( krb_files_dir_ ) )
+    {
+        if ( lease_dir.is_directory() )
+        {
+            watch_lease_dir( lease_dir.path().filename().string(), true );
+        }
+    }
+}
+
+int creds_fetcher::MetadataWatcher::process_events()
+{
+    if ( inotify_fd_ < 0 )
+    {
+        return -1;
+    }
+
+    alignas( struct inotify_event ) char buf[INOTIFY_BUF_SIZE];
+    while ( true )
+    {
+        ssize_t len = read( inotify_fd_, buf, sizeof( buf ) );
+        if ( len < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        for ( char* ptr = buf; ptr < buf + len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            ptr += sizeof( struct inotify_event ) + event->len;
+            std::string name = event->len > 0 ? event->name : "";
+
+            if ( event->mask & IN_Q_OVERFLOW )
+            {
+                rescan();
+            }
+            else if ( event->wd == root_wd_ )
+            {
+                if ( !( event->mask & IN_ISDIR ) || name.empty() )
+                {
+                    continue;
+                }
+                if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                {
+                    watch_lease_dir( name, true );
+                }
+                else
+                {
+                    // the watch of the lease directory goes away with IN_IGNORED
+                    on_lease_removed_( name );
+                }
+            }
+            else
+            {
+                auto it = lease_dirs_.find( event->wd );
+                if ( it == lease_dirs_.end() )
+                {
+                    continue;
+                }
+                std::string lease_id = it->second;
+                if ( event->mask & IN_IGNORED )
+                {
+                    lease_dirs_.erase( it );
+                    continue;
+                }
+                if ( name != lease_id + METADATA_FILE_SUFFIX )
+                {
+                    continue;
+                }
+                if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+                {
+                    on_metadata_changed_( lease_id, krb_files_dir_ + "/" + lease_id + "/" + name );
+                }
+                else
+                {
+                    on_lease_removed_( lease_id );
+                }
+            }
+        }
+    }
+}
+
+void creds_fetcher::MetadataWatcher::close()
+{
+    if ( inotify_fd_ >= 0 )
+    {
+        ::close( inotify_fd_ );
+        inotify_fd_ = -1;
+    }
+    root_wd_ = -1;
+    lease_dirs_.clear();
+}
@@ -1,6 +1,15 @@
 #include "daemon.h"
+#include "health.h"
+#include "lease_journal.h"
+#include "lease_metadata.h"
+#include "lease_registry.h"
+#include "metadata_watcher.h"
+#include "metrics.h"
 #include <filesystem>
 #include <fstream>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 int read_meta_data_json_test()
 {
@@ -23,7 +32,7 @@ int read_meta_data_json_test()
         }
     }
 
-    std::list<creds_fetcher::krb_ticket_info*> result = read_meta_data_json( metadata_file_path );
+    std::vector<creds_fetcher::krb_ticket_info> result = read_meta_data_json( metadata_file_path );
 
     if ( result.empty() || result.size() != 2 )
     {
@@ -47,7 +56,7 @@ int read_meta_data_invalid_json_test()
 {
     std::string metadata_file_path = "metadata_invalid_sample.json";
 
-    std::list<creds_fetcher::krb_ticket_info*> result = read_meta_data_json( metadata_file_path );
+    std::vector<creds_fetcher::krb_ticket_info> result = read_meta_data_json( metadata_file_path );
 
     if ( result.empty() )
     {
@@ -79,7 +88,7 @@ int write_meta_data_json_test()
         }
     }
 
-    std::list<creds_fetcher::krb_ticket_info*> test_ticket_info =
+    std::vector<creds_fetcher::krb_ticket_info> test_ticket_info =
         read_meta_data_json( metadata_file_path );
 
     std::string krb_files_dir = "/usr/share/credentials-fetcher/krbdir";
@@ -107,3 +116,418 @@ int write_meta_data_json_test()
     }
     return EXIT_SUCCESS;
 }
+
+int lease_registry_test()
+{
+    std::string metadata_file_path = "metadata_sample.json";
+
+    std::vector<std::string> paths = {
+        "/usr/share/credentials-fetcher/krbdir/73099acdb5807b4bbf91/ccname_WebApp01_7K4PEM",
+        "/usr/share/credentials-fetcher/krbdir/73099acdb5807b4bbf91/ccname_WebApp03_53Yg4I" };
+
+    for ( auto file_path : paths )
+    {
+        // create the meta file in the lease directory
+        std::filesystem::path dirPath( file_path );
+        std::filesystem::create_directories( dirPath.parent_path() );
+
+        if ( !std::filesystem::exists( file_path ) )
+        {
+            std::ofstream file( file_path );
+            file.close();
+        }
+    }
+
+    std::vector<creds_fetcher::krb_ticket_info> test_ticket_info =
+        read_meta_data_json( metadata_file_path );
+
+    std::string krb_files_dir = "/usr/share/credentials-fetcher/krbdir";
+    std::string test_lease_id = "test1234567890";
+    write_meta_data_json( test_ticket_info, test_lease_id, krb_files_dir );
+    // without a journal the registry is loaded from the metadata files
+    std::filesystem::remove( krb_files_dir + "/" + LEASE_JOURNAL_FILE );
+    std::filesystem::remove( krb_files_dir + "/" + LEASE_SNAPSHOT_FILE );
+
+    // the registry is loaded from the metadata files and then updated in memory
+    creds_fetcher::LeaseRegistry registry;
+    bool passed = registry.load( krb_files_dir ) >= 1 &&
+                  registry.get_lease( test_lease_id ).size() == test_ticket_info.size();
+
+    std::string service_account_name;
+    if ( passed && !test_ticket_info.empty() )
+    {
+        service_account_name = test_ticket_info.front().service_account_name;
+        passed = !registry.get_tickets_by_service_account( service_account_name ).empty();
+    }
+    if ( passed )
+    {
+        passed = registry.remove_lease( test_lease_id ).size() == test_ticket_info.size() &&
+                 registry.get_lease( test_lease_id ).empty() &&
+                 registry.get_tickets_by_service_account( service_account_name ).empty();
+    }
+
+    // finally delete test lease directory
+    std::filesystem::remove_all( krb_files_dir + "/" + test_lease_id );
+    std::filesystem::remove( krb_files_dir + "/" + LEASE_JOURNAL_FILE );
+    std::filesystem::remove( krb_files_dir + "/" + LEASE_SNAPSHOT_FILE );
+    for ( auto file_path : paths )
+    {
+        std::filesystem::remove_all( file_path );
+    }
+
+    if ( !passed )
+    {
+        std::cout << "lease registry test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "lease registry test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int lease_journal_test()
+{
+    std::string journal_dir =
+        ( std::filesystem::temp_directory_path() / "credentials_fetcher_journal_test" ).string();
+    std::string journal_path = journal_dir + "/" + LEASE_JOURNAL_FILE;
+    std::filesystem::remove_all( journal_dir );
+
+    creds_fetcher::krb_ticket_info krb_ticket;
+    krb_ticket.krb_file_path = journal_dir + "/lease2/WebApp01/krb5cc";
+    krb_ticket.service_account_name = "WebApp01";
+    krb_ticket.domain_name = "contoso.com";
+
+    bool passed;
+    {
+        creds_fetcher::LeaseJournal journal;
+        creds_fetcher::LeaseJournal::leases_t leases;
+        std::pair<int, bool> result = journal.open( journal_dir, leases );
+        passed = result.first == 0 && !result.second && leases.empty() &&
+                 journal.append_add( "lease1", { krb_ticket, krb_ticket } ) == 0 &&
+                 journal.append_add( "lease2", { krb_ticket } ) == 0 &&
+                 journal.append_remove( "lease1" ) == 0;
+    }
+    uintmax_t journal_size = passed ? std::filesystem::file_size( journal_path ) : 0;
+
+    // a record torn by a crash is dropped
+    if ( passed )
+    {
+        std::ofstream journal_file( journal_path, std::ios::app );
+        journal_file << "1234abcd {\"op\":\"add\",\"lease_id\":\"lease3\"";
+    }
+
+    creds_fetcher::LeaseJournal journal;
+    creds_fetcher::LeaseJournal::leases_t leases;
+    if ( passed )
+    {
+        std::pair<int, bool> result = journal.open( journal_dir, leases );
+        passed = result.first == 0 && result.second && leases.size() == 1 &&
+                 leases["lease2"].size() == 1 &&
+                 leases["lease2"][0].krb_file_path == krb_ticket.krb_file_path &&
+                 std::filesystem::file_size( journal_path ) == journal_size;
+    }
+
+    // an append cut short by the file size limit is removed, the next one follows the
+    // last complete record
+    if ( passed )
+    {
+        struct rlimit old_limit;
+        struct rlimit limit;
+        getrlimit( RLIMIT_FSIZE, &old_limit );
+        limit = old_limit;
+        limit.rlim_cur = journal_size + 16;
+        void ( *old_handler )( int ) = signal( SIGXFSZ, SIG_IGN );
+        setrlimit( RLIMIT_FSIZE, &limit );
+        passed = journal.append_add( "lease3", { krb_ticket } ) != 0 &&
+                 std::filesystem::file_size( journal_path ) == journal_size;
+        setrlimit( RLIMIT_FSIZE, &old_limit );
+        signal( SIGXFSZ, old_handler );
+        passed = passed && journal.append_add( "lease3", { krb_ticket } ) == 0;
+        journal.close();
+    }
+    if ( passed )
+    {
+        leases.clear();
+        passed = journal.open( journal_dir, leases ).first == 0 && leases.size() == 2 &&
+                 leases.count( "lease3" ) == 1 && journal.append_remove( "lease3" ) == 0;
+        leases.erase( "lease3" );
+    }
+
+    // the snapshot holds the leases once the journal is compacted
+    if ( passed )
+    {
+        passed = journal.compact( leases ) == 0 &&
+                 std::filesystem::file_size( journal_path ) == 0 &&
+                 journal.append_remove( "lease2" ) == 0;
+        journal.close();
+    }
+    if ( passed )
+    {
+        creds_fetcher::LeaseJournal::leases_t replayed_leases;
+        passed = journal.open( journal_dir, replayed_leases ).first == 0 &&
+                 replayed_leases.empty();
+        journal.close();
+    }
+
+    std::filesystem::remove_all( journal_dir );
+
+    if ( !passed )
+    {
+        std::cout << "lease journal test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "lease journal test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int lease_metadata_binary_test()
+{
+    std::string metadata_path =
+        ( std::filesystem::temp_directory_path() / "credentials_fetcher_leases.bin" ).string();
+
+    creds_fetcher::krb_ticket_info krb_ticket;
+    krb_ticket.krb_file_path = "/var/credentials-fetcher/krbdir/lease1/WebApp01/krb5cc";
+    krb_ticket.service_account_name = "WebApp01";
+    krb_ticket.domain_name = "contoso.com";
+    krb_ticket.domainless_user = "user1";
+
+    creds_fetcher::lease_map_t leases;
+    leases["lease1"] = { krb_ticket, krb_ticket };
+    leases["lease2"] = {};
+    std::string contents = creds_fetcher::encode_lease_metadata( leases );
+    std::filesystem::remove( metadata_path );
+
+    // a new file is only readable by the owner, the mode of a replaced file is kept
+    struct stat st;
+    bool passed = creds_fetcher::is_binary_lease_metadata( contents ) &&
+                  write_file_atomically( metadata_path, contents ) == 0 &&
+                  stat( metadata_path.c_str(), &st ) == 0 &&
+                  ( st.st_mode & ( S_IRWXU | S_IRWXG | S_IRWXO ) ) == ( S_IRUSR | S_IWUSR );
+    passed = passed && chmod( metadata_path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP ) == 0 &&
+             write_file_atomically( metadata_path, contents ) == 0 &&
+             stat( metadata_path.c_str(), &st ) == 0 &&
+             ( st.st_mode & ( S_IRWXU | S_IRWXG | S_IRWXO ) ) == ( S_IRUSR | S_IWUSR | S_IRGRP );
+    if ( passed )
+    {
+        creds_fetcher::LeaseMetadataView view;
+        passed = view.open( metadata_path ) == 0 && view.num_leases() == 2;
+        for ( size_t i = 0; passed && i < view.num_leases(); i++ )
+        {
+            std::string lease_id( view.lease_id( i ) );
+            passed = leases.count( lease_id ) == 1 &&
+                     view.num_tickets( i ) == leases[lease_id].size();
+            for ( size_t j = 0; passed && j < view.num_tickets( i ); j++ )
+            {
+                creds_fetcher::krb_ticket_view_t ticket_view = view.ticket( i, j );
+                passed = ticket_view.krb_file_path == krb_ticket.krb_file_path &&
+                         ticket_view.service_account_name == krb_ticket.service_account_name &&
+                         ticket_view.domain_name == krb_ticket.domain_name &&
+                         ticket_view.domainless_user == krb_ticket.domainless_user;
+            }
+        }
+    }
+
+    // a corrupt file is rejected
+    if ( passed )
+    {
+        contents[contents.size() - 1] ^= 0x1;
+        creds_fetcher::LeaseMetadataView view;
+        passed = write_file_atomically( metadata_path, contents ) == 0 &&
+                 view.open( metadata_path ) != 0 && view.num_leases() == 0;
+    }
+
+    std::filesystem::remove( metadata_path );
+
+    if ( !passed )
+    {
+        std::cout << "lease metadata binary test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "lease metadata binary test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int metadata_watcher_test()
+{
+    std::string krb_files_dir =
+        ( std::filesystem::temp_directory_path() / "credentials_fetcher_watcher_test" ).string();
+    std::string lease_id = "lease1";
+    std::filesystem::remove_all( krb_files_dir );
+    std::filesystem::create_directories( krb_files_dir );
+
+    std::vector<std::string> changed_leases;
+    std::vector<std::string> removed_leases;
+    creds_fetcher::MetadataWatcher watcher(
+        [&changed_leases]( const std::string& lease_id, const std::string& ) {
+            changed_leases.push_back( lease_id );
+        },
+        [&removed_leases]( const std::string& lease_id ) {
+            removed_leases.push_back( lease_id );
+        } );
+
+    creds_fetcher::krb_ticket_info krb_ticket;
+    krb_ticket.krb_file_path = krb_files_dir + "/" + lease_id + "/WebApp01/krb5cc";
+    krb_ticket.service_account_name = "WebApp01";
+    krb_ticket.domain_name = "contoso.com";
+
+    // a lease directory restored with its metadata file is reported once
+    bool passed = watcher.open( krb_files_dir ) == 0 &&
+                  write_meta_data_json( krb_ticket, lease_id, krb_files_dir ) == 0 &&
+                  watcher.process_events() == 0 && changed_leases.size() == 1 &&
+                  changed_leases[0] == lease_id;
+
+    // replacing the metadata file is a change, removing the lease directory a removal
+    if ( passed )
+    {
+        passed = write_meta_data_json( krb_ticket, lease_id, krb_files_dir ) == 0 &&
+                 watcher.process_events() == 0 && changed_leases.size() == 2;
+    }
+    if ( passed )
+    {
+        std::filesystem::remove_all( krb_files_dir + "/" + lease_id );
+        passed = watcher.process_events() == 0 && !removed_leases.empty() &&
+                 removed_leases.back() == lease_id;
+    }
+
+    watcher.close();
+    std::filesystem::remove_all( krb_files_dir );
+
+    if ( !passed )
+    {
+        std::cout << "metadata watcher test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "metadata watcher test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int metrics_histogram_test()
+{
+    // every latency falls in a bucket whose bound is at most 1/16 above it
+    bool passed = true;
+    for ( uint64_t micros : { 0ULL, 1ULL, 15ULL, 16ULL, 17ULL, 31ULL, 32ULL, 1000ULL, 123456ULL,
+                              60000000ULL, ( 1ULL << 40 ) - 1 } )
+    {
+        size_t index = creds_fetcher::LatencyHistogram::bucket_index( micros );
+        uint64_t upper_bound = creds_fetcher::LatencyHistogram::bucket_upper_bound( index );
+        if ( index >= METRICS_BUCKET_COUNT || upper_bound < micros ||
+             upper_bound - micros > micros / METRICS_SUB_BUCKET_COUNT ||
+             ( index > 0 &&
+               creds_fetcher::LatencyHistogram::bucket_upper_bound( index - 1 ) >= micros ) )
+        {
+            std::cout << "latency " << micros << " is in the wrong bucket" << std::endl;
+            passed = false;
+        }
+    }
+    passed = passed && creds_fetcher::LatencyHistogram::bucket_index( 1ULL << 50 ) ==
+                           METRICS_BUCKET_COUNT - 1;
+
+    // 1..1000 us, one of them failed
+    creds_fetcher::LatencyHistogram histogram;
+    for ( uint64_t micros = 1; micros <= 1000; micros++ )
+    {
+        histogram.record( micros, micros == 500 );
+    }
+    creds_fetcher::histogram_snapshot_t snapshot = histogram.snapshot();
+    passed = passed && snapshot.count == 1000 && snapshot.errors == 1 &&
+             snapshot.sum_micros == 500500 && snapshot.max_micros == 1000 &&
+             snapshot.p50_micros >= 500 && snapshot.p50_micros <= 500 + 500 / 16 &&
+             snapshot.p99_micros >= 990 && snapshot.p99_micros <= 1000 &&
+             snapshot.p999_micros == 1000;
+
+    creds_fetcher::histogram_snapshot_t empty_snapshot =
+        creds_fetcher::LatencyHistogram().snapshot();
+    passed = passed && empty_snapshot.count == 0 && empty_snapshot.p99_micros == 0 &&
+             empty_snapshot.buckets.empty();
+
+    if ( !passed )
+    {
+        std::cout << "metrics histogram test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "metrics histogram test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int health_snapshot_test()
+{
+    creds_fetcher::HealthMonitor& health_monitor = creds_fetcher::HealthMonitor::instance();
+    time_t now = time( nullptr );
+    bool passed = true;
+
+    // a ticket due an hour ago is the oldest overdue one
+    creds_fetcher::RenewalScheduler scheduler;
+    creds_fetcher::krb_ticket_info overdue_ticket;
+    overdue_ticket.krb_file_path = "/var/credentials-fetcher/krbdir/lease/ccname_overdue";
+    creds_fetcher::krb_ticket_info scheduled_ticket;
+    scheduled_ticket.krb_file_path = "/var/credentials-fetcher/krbdir/lease/ccname_scheduled";
+    scheduler.schedule( overdue_ticket, now - 3600 );
+    scheduler.schedule( scheduled_ticket, now + 3600 );
+    creds_fetcher::renewal_stats_t stats = scheduler.stats();
+    passed = passed && stats.backlog == 1 && stats.oldest_overdue == now - 3600;
+
+    health_monitor.refresh( creds_fetcher::renewal_stats_t(), now, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_OK &&
+             health_monitor.snapshot()->renewal_thread_alive;
+
+    health_monitor.refresh( stats, now, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_DEGRADED &&
+             health_monitor.snapshot()->oldest_overdue_deadline == now - 3600;
+
+    // a failed renewal moves the deadline to the retry, the ticket is still overdue
+    std::vector<creds_fetcher::krb_ticket_info> due_tickets;
+    passed = passed && scheduler.wait_for_due( due_tickets ) && due_tickets.size() == 1;
+    scheduler.rearm( overdue_ticket.krb_file_path, now + 60, true );
+    creds_fetcher::renewal_stats_t retry_stats = scheduler.stats();
+    passed = passed && retry_stats.retrying == 1 && retry_stats.backlog == 1 &&
+             retry_stats.oldest_overdue == now - 3600;
+    health_monitor.refresh( retry_stats, now, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_DEGRADED &&
+             health_monitor.snapshot()->oldest_overdue_deadline == now - 3600;
+
+    // further failures keep the missed deadline, a successful renewal clears it
+    scheduler.rearm( overdue_ticket.krb_file_path, now + 120, true );
+    passed = passed && scheduler.stats().oldest_overdue == now - 3600;
+    scheduler.rearm( overdue_ticket.krb_file_path, now + 3600 );
+    creds_fetcher::renewal_stats_t renewed_stats = scheduler.stats();
+    passed = passed && renewed_stats.backlog == 0 && renewed_stats.oldest_overdue == 0;
+    health_monitor.refresh( renewed_stats, now, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_OK;
+
+    health_monitor.refresh( stats, now - HEALTH_RENEWAL_HEARTBEAT_MAX_AGE_SECONDS - 1, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_UNHEALTHY &&
+             !health_monitor.snapshot()->renewal_thread_alive;
+
+    // the snapshot only changes on refresh
+    std::shared_ptr<const creds_fetcher::health_snapshot_t> previous = health_monitor.snapshot();
+    health_monitor.record_domain_controller( "contoso.com", false, "Can't contact LDAP server" );
+    health_monitor.record_kdc_error( "WebApp01$@CONTOSO.COM: Preauthentication failed" );
+    passed = passed && health_monitor.snapshot() == previous &&
+             previous->domain_controllers.empty();
+
+    health_monitor.refresh( creds_fetcher::renewal_stats_t(), now, 120 );
+    std::shared_ptr<const creds_fetcher::health_snapshot_t> snapshot = health_monitor.snapshot();
+    passed = passed && snapshot->status == HEALTH_STATUS_DEGRADED &&
+             snapshot->domain_controllers.size() == 1 &&
+             snapshot->domain_controllers[0].domain == "contoso.com" &&
+             !snapshot->domain_controllers[0].reachable &&
+             snapshot->last_kdc_error == "WebApp01$@CONTOSO.COM: Preauthentication failed" &&
+             snapshot->last_kdc_error_time >= now;
+
+    health_monitor.record_domain_controller( "contoso.com", true, "" );
+    health_monitor.refresh( creds_fetcher::renewal_stats_t(), now, 120 );
+    passed = passed && health_monitor.snapshot()->status == HEALTH_STATUS_OK;
+
+    if ( !passed )
+    {
+        std::cout << "health snapshot test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "health snapshot test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
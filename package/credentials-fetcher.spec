@@ -14,11 +14,11 @@ License:        Apache-2.0
 URL:            https://github.com/aws/credentials-fetcher
 Source0:        https://github.com/aws/credentials-fetcher/archive/refs/tags/v.%{version}.tar.gz
  
-BuildRequires:  cmake3 make chrpath openldap-clients grpc-devel gcc-c++ glib2-devel jsoncpp-devel
+BuildRequires:  cmake3 make chrpath openldap-devel grpc-devel gcc-c++ glib2-devel jsoncpp-devel
 BuildRequires:  openssl-devel zlib-devel protobuf-devel re2-devel krb5-devel systemd-devel
 BuildRequires:  systemd-rpm-macros dotnet-sdk-6.0 grpc-plugins
  
-Requires: bind-utils openldap openldap-clients awscli dotnet-runtime-6.0 jsoncpp-devel jsoncpp
+Requires: bind-utils openldap cyrus-sasl-gssapi awscli dotnet-runtime-6.0 jsoncpp-devel jsoncpp
 # No one likes you i686
 ExclusiveArch: x86_64 aarch64 s390x
  
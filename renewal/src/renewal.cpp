@@ -1,12 +1,174 @@
 #include "daemon.h"
+#include "lease_registry.h"
+#include "renewal_executor.h"
+#include "renewal_scheduler.h"
+#include "tgt_cache.h"
 #include <filesystem>
 #include <chrono>
 #include <stdlib.h>
 
-int krb_ticket_renew_handler( creds_fetcher::Daemon cf_daemon )
+/**
+ * Add the tickets of the leases in the lease registry to the renewal scheduler,
+ * the leases created before the daemon was restarted are found this way. The
+ * ccaches are read in one batch, a ticket that cannot be read is renewed right away.
+ */
+static void schedule_existing_tickets()
+{
+    std::vector<creds_fetcher::krb_ticket_info> krb_tickets;
+    std::vector<std::string> krb_cc_names;
+    for ( const auto& krb_ticket : lease_registry.get_all_tickets() )
+    {
+        // tickets of domainless leases are renewed by RenewNonDomainJoinedKerberosLease
+        if ( krb_ticket.domainless_user.empty() )
+        {
+            krb_tickets.push_back( krb_ticket );
+            krb_cc_names.push_back( krb_ticket.krb_file_path );
+        }
+    }
+
+    std::vector<std::pair<int, creds_fetcher::krb_ticket_times>> ticket_times =
+        get_ticket_times( krb_cc_names );
+    time_t now = time( nullptr );
+    for ( size_t i = 0; i < krb_tickets.size(); i++ )
+    {
+        time_t deadline = now;
+        if ( ticket_times[i].first == 0 )
+        {
+            deadline = ticket_times[i].second.endtime - RENEW_TICKET_HOURS * SECONDS_IN_HOUR;
+        }
+        krb_renewal_scheduler.schedule( krb_tickets[i], deadline );
+    }
+}
+
+/**
+ * Renew the gMSA ticket with a TGS request while it is renewable, otherwise get a new
+ * one. The machine ticket used for the ldap search is refreshed and the gMSA ticket
+ * retried if the first attempt fails
+ * @param krb_ticket - ticket to be renewed
+ * @param deadline - no further attempt is made after this time
+ * @param cf_logger - log to systemd daemon
+ * @return - 0 if successful
+ */
+static int renew_gmsa_ticket( const creds_fetcher::krb_ticket_info& krb_ticket, time_t deadline,
+                              creds_fetcher::CF_logger& cf_logger )
+{
+    std::pair<int, std::string> gmsa_ticket_result;
+    std::string krb_cc_name = krb_ticket.krb_file_path;
+    std::string domainless_user = krb_ticket.domainless_user;
+    creds_fetcher::log_fields_t log_fields;
+    log_fields.account = krb_ticket.service_account_name;
+    log_fields.domain = krb_ticket.domain_name;
+
+    std::pair<int, std::string> renew_result = renew_krb_ticket( krb_cc_name );
+    if ( renew_result.first == 0 )
+    {
+        return EXIT_SUCCESS;
+    }
+    if ( renew_result.first != -1 )
+    {
+        cf_logger.logger( LOG_WARNING, log_fields, "WARNING: Cannot renew krb ticket %s: %s",
+                          krb_cc_name.c_str(), renew_result.second.c_str() );
+    }
+
+    int num_retries = 1;
+    // machine or user TGT the ldap search binds with
+    creds_fetcher::host_tgt_ref_t host_tgt;
+    for ( int i = 0; i <= num_retries; i++ )
+    {
+        if ( time( nullptr ) >= deadline )
+        {
+            cf_logger.logger( LOG_ERR, log_fields, "ERROR: renewal of krb ticket %s timed out",
+                              krb_cc_name.c_str() );
+            break;
+        }
+
+        int status = -1;
+        if ( domainless_user.find( "awsdomainlessusersecret" ) != std::string::npos )
+        {
+            int pos = domainless_user.find( ":" );
+            std::string domainlessUser = domainless_user.substr( pos + 1 );
+            status = get_user_krb_ticket( krb_ticket.domain_name, domainlessUser, host_tgt,
+                                          cf_logger );
+        }
+        else
+        {
+            status = get_machine_krb_ticket( krb_ticket.domain_name, host_tgt, cf_logger );
+        }
+        if ( status < 0 )
+        {
+            cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket", status );
+            break;
+        }
+
+        gmsa_ticket_result = get_gmsa_krb_ticket( krb_ticket.domain_name,
+                                                  krb_ticket.service_account_name, krb_cc_name,
+                                                  host_tgt, cf_logger );
+        if ( gmsa_ticket_result.first == 0 )
+        {
+            return EXIT_SUCCESS;
+        }
+
+        cf_logger.logger( LOG_ERR, log_fields,
+                          "ERROR: Cannot get gMSA krb ticket using account %s",
+                          krb_ticket.service_account_name.c_str() );
+        // the cached machine/user ticket can have been rejected, get a new one
+        host_tgt_cache.invalidate( host_tgt );
+        host_tgt.reset();
+    }
+
+    return EXIT_FAILURE;
+}
+
+/**
+ * Renew a ticket and set its next deadline in the renewal scheduler
+ * @param krb_ticket - ticket to be renewed
+ * @param deadline - time by which the renewal must give up
+ * @param retry_interval - minutes after which a failed renewal is retried
+ * @param cf_logger - log to systemd daemon
+ */
+static void renew_scheduled_ticket( const creds_fetcher::krb_ticket_info& krb_ticket,
+                                    time_t deadline, uint64_t retry_interval,
+                                    creds_fetcher::CF_logger& cf_logger )
+{
+    std::string krb_cc_name = krb_ticket.krb_file_path;
+    try
+    {
+        std::cout << "gMSA ticket is at " + krb_cc_name + " is ready for renewal!" << std::endl;
+
+        time_t next_deadline = time( nullptr ) + retry_interval * 60;
+        bool renewed = renew_gmsa_ticket( krb_ticket, deadline, cf_logger ) == 0;
+        if ( renewed )
+        {
+            std::pair<int, time_t> renewal_deadline = get_ticket_renewal_deadline( krb_cc_name );
+            if ( renewal_deadline.first == 0 && renewal_deadline.second > time( nullptr ) )
+            {
+                next_deadline = renewal_deadline.second;
+            }
+            cf_logger.logger( LOG_INFO, "gMSA ticket is at %s", krb_cc_name.c_str() );
+        }
+        krb_renewal_scheduler.rearm( krb_cc_name, next_deadline, !renewed );
+    }
+    catch ( const std::exception& ex )
+    {
+        std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
+        fprintf( stderr, SD_CRIT "failed to run the ticket renewal" );
+        krb_renewal_scheduler.rearm( krb_cc_name, time( nullptr ) + retry_interval * 60, true );
+    }
+}
+
+/**
+ * Renew the kerberos tickets of the leases when they are due. The tickets are kept
+ * in krb_renewal_scheduler ordered by their deadline, the thread sleeps until the
+ * earliest one instead of scanning the krb directory periodically. The due tickets
+ * are renewed in parallel with a cap on the renewals in flight for each domain.
+ * @param cf_daemon - parent daemon object
+ * @return - -1 if the renewal cannot be started, 0 when the daemon shuts down
+ */
+int krb_ticket_renew_handler( creds_fetcher::Daemon& cf_daemon )
 {
     std::string krb_files_dir = cf_daemon.krb_files_dir;
-    int interval = cf_daemon.krb_ticket_handle_interval;
+    // a failed renewal is retried after this interval
+    uint64_t retry_interval = cf_daemon.krb_ticket_handle_interval;
     creds_fetcher::CF_logger cf_logger = cf_daemon.cf_logger;
 
     if ( krb_files_dir.empty() )
@@ -15,105 +177,42 @@ int krb_ticket_renew_handler( creds_fetcher::Daemon cf_daemon )
         return -1;
     }
 
-    while ( !cf_daemon.got_systemd_shutdown_signal )
+    try
+    {
+        schedule_existing_tickets();
+    }
+    catch ( const std::exception& ex )
+    {
+        std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
+        fprintf( stderr, SD_CRIT "failed to read the kerberos tickets to renew" );
+    }
+
+    creds_fetcher::RenewalExecutor renewal_executor( cf_daemon.renewal_workers,
+                                                     cf_daemon.renewal_domain_concurrency,
+                                                     cf_daemon.renewal_timeout_seconds );
+    std::vector<creds_fetcher::krb_ticket_info> due_tickets;
+    while ( !cf_daemon.got_systemd_shutdown_signal &&
+            krb_renewal_scheduler.wait_for_due( due_tickets ) )
     {
-        try
+        std::cout << "###### renewal started ######" << std::endl;
+
+        for ( const auto& krb_ticket : due_tickets )
         {
-            auto x = std::chrono::steady_clock::now() + std::chrono::minutes( interval );
-            std::this_thread::sleep_until( x );
-            std::cout << "###### renewal started ######" << std::endl;
-
-            // identify the metadata files in the krb directory
-            std::vector<std::string> metadatafiles;
-            for ( std::filesystem::recursive_directory_iterator end, dir( krb_files_dir );
-                  dir != end; ++dir )
+            // the lease was deleted
+            if ( !std::filesystem::exists( krb_ticket.krb_file_path ) )
             {
-                auto path = dir->path();
-                if ( std::filesystem::is_regular_file( path ) )
-                {
-                    // find the file with metadata extension
-                    std::string filename = path.filename().string();
-                    if ( !filename.empty() && filename.find( "_metadata" ) != std::string::npos )
-                    {
-                        std::string filepath = path.parent_path().string() + "/" + filename;
-                        metadatafiles.push_back( filepath );
-                    }
-                }
+                krb_renewal_scheduler.remove( krb_ticket.krb_file_path );
+                continue;
             }
 
-            // read the information of service account from the files
-            for ( auto file_path : metadatafiles )
-            {
-                std::list<creds_fetcher::krb_ticket_info*> krb_ticket_info_list =
-                    read_meta_data_json( file_path );
-
-                // refresh the kerberos tickets for the service accounts, if tickets ready for
-                // renewal
-                for ( auto krb_ticket : krb_ticket_info_list )
-                {
-                    std::pair<int, std::string> gmsa_ticket_result;
-                    std::string krb_cc_name = krb_ticket->krb_file_path;
-                    std::string domainless_user = krb_ticket->domainless_user;
-                    // check if the ticket is ready for renewal and not created in domainless mode
-                    if ( domainless_user.empty() && is_ticket_ready_for_renewal( krb_ticket ))
-                    {
-                        std::cout << "gMSA ticket is at " + krb_cc_name +
-                                        " is ready for renewal!"
-                                        << std::endl;
-
-                        int num_retries = 1;
-                        for ( int i = 0; i <= num_retries; i++ )
-                        {
-                            gmsa_ticket_result = get_gmsa_krb_ticket(
-                                krb_ticket->domain_name, krb_ticket->service_account_name,
-                                krb_cc_name, cf_logger );
-                            if ( gmsa_ticket_result.first != 0 )
-                            {
-                                int status = -1;
-                                cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
-                                                    krb_ticket->service_account_name.c_str() );
-                                if (domainless_user.find("awsdomainlessusersecret") !=
-                                                           std::string::npos) {
-                                    int pos = domainless_user.find(":");
-                                    std::string domainlessUser = domainless_user.substr(pos + 1);
-                                    status = get_user_krb_ticket(krb_ticket->domain_name,
-                                                                  domainlessUser, cf_logger );
-                                }
-                                else
-                                {
-                                    status = get_machine_krb_ticket( krb_ticket->domain_name,
-                                                                         cf_logger );
-                                }
-                                if ( status < 0 )
-                                {
-                                    cf_logger.logger( LOG_ERR,
-                                                      "Error %d: Cannot get machine krb ticket",
-                                                      status );
-                                }
-                                else
-                                {
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        cf_logger.logger( LOG_INFO, "gMSA ticket is at %s", krb_cc_name.c_str() );
-                        std::cout << "gMSA ticket is at " + krb_cc_name +
-                                         " is not yet ready for "
-                                         "renewal"
-                                  << std::endl;
-                    }
-                }
-            }
-        }
-        catch ( const std::exception& ex  )
-        {
-            std::cout << "Exception: '" << ex.what() << "'!" << std::endl;
-            fprintf( stderr, SD_CRIT "failed to run the ticket renewal" );
-            break;
+            renewal_executor.submit( krb_ticket.domain_name,
+                                     [krb_ticket, retry_interval, &cf_logger]( time_t deadline ) {
+                                         renew_scheduled_ticket( krb_ticket, deadline,
+                                                                 retry_interval, cf_logger );
+                                     } );
         }
     }
-    return -1;
+    renewal_executor.stop();
+
+    return EXIT_SUCCESS;
 }